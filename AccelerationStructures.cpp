@@ -1,8 +1,181 @@
 #include "AccelerationStructures.hpp"
 
+#include <bvh/binned_sah_builder.hpp>
+#include <bvh/linear_bvh_builder.hpp>
+#include <bvh/spatial_split_bvh_builder.hpp>
+#include <bvh/sweep_sah_builder.hpp>
 #include <bvh/triangle.hpp>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <memory>
+
+namespace {
+    constexpr char          CACHE_MAGIC[4]  = {'R', 'T', 'A', 'S'};
+    constexpr std::uint32_t CACHE_VERSION   = 6;
+    constexpr std::uint64_t CACHE_ALIGNMENT = 64;
+
+    struct CacheHeader {
+        char          magic[4];
+        std::uint32_t version;
+        std::uint64_t sourceHash;
+        std::uint32_t bufferCount;
+        std::uint32_t reserved;
+        struct {
+            std::uint64_t offset;
+            std::uint64_t size;
+        } buffers[AccelerationStructures::BUFFER_COUNT];
+    };
+
+    constexpr std::uint32_t FLATTEN_GRAIN             = 4096;
+    constexpr std::uint32_t PARALLEL_BUILD_THRESHOLD  = 1 << 16;
+    constexpr std::size_t   BINNED_SAH_BINS           = 16;
+    constexpr std::size_t   SPATIAL_SPLIT_BINS        = 64;
+
+    // Affine inverse: the inverted 3x3 part and the translation taken back through it.
+    std::array<float, 12> invertTransform(const std::array<float, 12>& m) {
+        float c00 = m[5] * m[10] - m[6] * m[9];
+        float c01 = m[2] * m[9]  - m[1] * m[10];
+        float c02 = m[1] * m[6]  - m[2] * m[5];
+        float c10 = m[6] * m[8]  - m[4] * m[10];
+        float c11 = m[0] * m[10] - m[2] * m[8];
+        float c12 = m[2] * m[4]  - m[0] * m[6];
+        float c20 = m[4] * m[9]  - m[5] * m[8];
+        float c21 = m[1] * m[8]  - m[0] * m[9];
+        float c22 = m[0] * m[5]  - m[1] * m[4];
+        float invDet = 1.0f / (m[0] * c00 + m[1] * c10 + m[2] * c20);
+
+        std::array<float, 12> result = {c00 * invDet, c01 * invDet, c02 * invDet, 0.0f,
+                                        c10 * invDet, c11 * invDet, c12 * invDet, 0.0f,
+                                        c20 * invDet, c21 * invDet, c22 * invDet, 0.0f};
+        for (std::uint32_t row = 0; row < 3; row++) {
+            float* r = &result[row * 4];
+            r[3] = -(r[0] * m[3] + r[1] * m[7] + r[2] * m[11]);
+        }
+        return result;
+    }
+
+    // Transforms the box center and grows it by the absolute matrix applied to the half extent.
+    bvh::BoundingBox<float> transformBox(const bvh::BoundingBox<float>& box, const std::array<float, 12>& transform) {
+        bvh::Vector3<float> center, extent;
+        for (std::uint32_t row = 0; row < 3; row++) {
+            const float* m = &transform[row * 4];
+            float cx = (box.min[0] + box.max[0]) * 0.5f, cy = (box.min[1] + box.max[1]) * 0.5f, cz = (box.min[2] + box.max[2]) * 0.5f;
+            float ex = (box.max[0] - box.min[0]) * 0.5f, ey = (box.max[1] - box.min[1]) * 0.5f, ez = (box.max[2] - box.min[2]) * 0.5f;
+            center[row] = m[0] * cx + m[1] * cy + m[2] * cz + m[3];
+            extent[row] = std::abs(m[0]) * ex + std::abs(m[1]) * ey + std::abs(m[2]) * ez;
+        }
+        return bvh::BoundingBox<float>(center - extent, center + extent);
+    }
+
+    template <typename T>
+    AccelerationStructures::BufferView viewOf(const std::vector<T>& data) {
+        return {data.data(), data.size() * sizeof(T)};
+    }
+
+    template <typename T>
+    void copyView(const AccelerationStructures::BufferView& view, std::vector<T>& data) {
+        data.assign(view.as<T>(), view.as<T>() + view.count<T>());
+    }
+
+    void writeAabb(float* aabb, const bvh::Bvh<float>::Node& node) {
+        std::uint32_t count = node.primitive_count;
+
+        aabb[0] = node.bounds[0]; aabb[1] = node.bounds[2]; aabb[2] = node.bounds[4]; aabb[3] = 1.0f;
+        aabb[4] = node.bounds[1]; aabb[5] = node.bounds[3]; aabb[6] = node.bounds[5]; std::memcpy(&aabb[7], &count, sizeof(count));
+    }
+
+    // LBVH builds single primitive leaves, and bvh's LeafCollapser merges them wherever the SAH
+    // improves with no bound on the leaf size. Here a subtree becomes a leaf only if it holds at
+    // most maxLeafSize primitives, contiguous in primitive_indices, and the SAH improves; the
+    // nodes left unreachable are dropped and the rest renumbered with siblings side by side.
+    void collapseLeaves(bvh::Bvh<float>& tree, std::size_t maxLeafSize) {
+        using Node = bvh::Bvh<float>::Node;
+        auto halfArea = [](const Node& node) {
+            float x = node.bounds[1] - node.bounds[0], y = node.bounds[3] - node.bounds[2], z = node.bounds[5] - node.bounds[4];
+            return x * y + y * z + z * x;
+        };
+
+        // Breadth first, so walking it backwards visits children before their parents.
+        std::vector<std::uint32_t> order = {0};
+        order.reserve(tree.node_count);
+        for (std::size_t i = 0; i < order.size(); i++) {
+            const Node& node = tree.nodes[order[i]];
+            if (!node.is_leaf()) {
+                order.push_back(node.first_child_or_primitive);
+                order.push_back(node.first_child_or_primitive + 1);
+            }
+        }
+
+        std::vector<std::uint32_t> first(tree.node_count), count(tree.node_count);
+        std::vector<float> cost(tree.node_count);
+        std::vector<bool> contiguous(tree.node_count, true), collapsed(tree.node_count, false);
+        for (auto it = order.rbegin(); it != order.rend(); ++it) {
+            std::uint32_t index = *it;
+            const Node& node = tree.nodes[index];
+            float area = halfArea(node);
+            if (node.is_leaf()) {
+                first[index] = node.first_child_or_primitive;
+                count[index] = node.primitive_count;
+                cost[index] = area * node.primitive_count * AccelerationStructures::SAH_INTERSECTION_COST;
+                continue;
+            }
+
+            std::uint32_t left = node.first_child_or_primitive, right = left + 1;
+            first[index] = std::min(first[left], first[right]);
+            count[index] = count[left] + count[right];
+            contiguous[index] = contiguous[left] && contiguous[right] &&
+                                (first[left] + count[left] == first[right] || first[right] + count[right] == first[left]);
+            cost[index] = area * AccelerationStructures::SAH_TRAVERSAL_COST + cost[left] + cost[right];
+
+            float leafCost = area * count[index] * AccelerationStructures::SAH_INTERSECTION_COST;
+            if (contiguous[index] && count[index] <= maxLeafSize && leafCost <= cost[index]) {
+                collapsed[index] = true;
+                cost[index] = leafCost;
+            }
+        }
+
+        auto nodes = std::make_unique<Node[]>(order.size());
+        std::size_t nodeCount = 1;
+        std::vector<std::pair<std::uint32_t, std::uint32_t>> pending = {{0, 0}};
+        while (!pending.empty()) {
+            auto [oldIndex, newIndex] = pending.back();
+            pending.pop_back();
+
+            Node node = tree.nodes[oldIndex];
+            if (collapsed[oldIndex]) {
+                node.primitive_count = count[oldIndex];
+                node.first_child_or_primitive = first[oldIndex];
+            } else if (!node.is_leaf()) {
+                pending.push_back({node.first_child_or_primitive, nodeCount});
+                pending.push_back({node.first_child_or_primitive + 1, nodeCount + 1});
+                node.first_child_or_primitive = nodeCount;
+                nodeCount += 2;
+            }
+            nodes[newIndex] = node;
+        }
+
+        tree.nodes = std::move(nodes);
+        tree.node_count = nodeCount;
+    }
+
+    void packChild(float* out, const bvh::Bvh<float>::Node& node) {
+        std::uint32_t child = node.is_leaf() ? node.first_child_or_primitive : (node.first_child_or_primitive - 1) / 2;
+        std::uint32_t count = node.primitive_count;
+
+        out[0] = node.bounds[0]; out[1] = node.bounds[2]; out[2] = node.bounds[4]; std::memcpy(&out[3], &child, sizeof(child));
+        out[4] = node.bounds[1]; out[5] = node.bounds[3]; out[6] = node.bounds[5]; std::memcpy(&out[7], &count, sizeof(count));
+    }
+}
 
 AccelerationStructures::AccelerationStructures() {
 }
@@ -10,68 +183,764 @@ AccelerationStructures::AccelerationStructures() {
 AccelerationStructures::~AccelerationStructures() {
 }
 
-void AccelerationStructures::addBLAS(const std::vector<float>& mesh) {
-    std::vector<bvh::Triangle<float>> triangles;
-    triangles.reserve(mesh.size() / 4);
+void AccelerationStructures::reserveBLAS(std::size_t triangles, std::size_t vertices) {
+    unmapBLAS();
+
+    // Every leaf holds at least one triangle, so a tree has fewer than two nodes per triangle
+    // and at most one packed record per triangle.
+    m_flatBlasAabbs.reserve(m_flatBlasAabbs.size() + triangles * 2 * 8);
+    m_flatBlasChildren.reserve(m_flatBlasChildren.size() + triangles * 2);
+    m_flatBlasLeafs.reserve(m_flatBlasLeafs.size() + triangles * 2);
+    m_flatBlasLinks.reserve(m_flatBlasLinks.size() + triangles * 2);
+    m_flatBlasNodes.reserve(m_flatBlasNodes.size() + triangles * 16);
+    m_flatBlasTriangles.reserve(m_flatBlasTriangles.size() + triangles * 3 * 4);
+    m_flatBlasIndices.reserve(m_flatBlasIndices.size() + triangles * 3);
+    m_flatBlasMaterials.reserve(m_flatBlasMaterials.size() + triangles);
+    m_flatBlasNormals.reserve(m_flatBlasNormals.size() + vertices * 3);
+}
+
+const char* AccelerationStructures::getBuilderName(Builder builder) {
+    switch (builder) {
+    case Builder::SweepSah:     return "sweep";
+    case Builder::BinnedSah:    return "binned";
+    case Builder::SpatialSplit: return "sbvh";
+    case Builder::Linear:       return "lbvh";
+    default:                    return "unknown";
+    }
+}
+
+bool AccelerationStructures::parseBuilder(const std::string& name, Builder& builder) {
+    for (std::uint32_t i = 0; i < static_cast<std::uint32_t>(Builder::Count); i++) {
+        if (name == getBuilderName(static_cast<Builder>(i))) {
+            builder = static_cast<Builder>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+std::size_t AccelerationStructures::buildTree(bvh::Bvh<float>& tree, const BuildOptions& options, const bvh::BoundingBox<float>* bboxes,
+                                              const bvh::Vector3<float>* centers, const Mesh* mesh, std::size_t count) {
+    auto global_bbox = bvh::compute_bounding_boxes_union(bboxes, count);
+    std::size_t maxLeafSize = std::max<std::uint32_t>(options.maxLeafSize, 1);
+
+    switch (options.builder) {
+    case Builder::BinnedSah: {
+        bvh::BinnedSahBuilder<bvh::Bvh<float>, BINNED_SAH_BINS> builder(tree);
+        builder.max_leaf_size = maxLeafSize;
+        builder.build(global_bbox, bboxes, centers, count);
+        return count;
+    }
+    case Builder::SpatialSplit:
+        if (mesh) {
+            // The splitter clips the actual triangles, so it needs them besides their bounds.
+            auto position = [mesh](std::uint32_t vertex) {
+                return bvh::Vector3<float>(mesh->positions[vertex * 3 + 0], mesh->positions[vertex * 3 + 1], mesh->positions[vertex * 3 + 2]);
+            };
+            std::vector<bvh::Triangle<float>> triangles(count);
+            for (std::size_t i = 0; i < count; i++) {
+                const std::uint32_t* index = &mesh->indices[i * 3];
+                triangles[i] = bvh::Triangle<float>(position(index[0]), position(index[1]), position(index[2]));
+            }
+
+            bvh::SpatialSplitBvhBuilder<bvh::Bvh<float>, bvh::Triangle<float>, SPATIAL_SPLIT_BINS> builder(tree);
+            builder.max_leaf_size = maxLeafSize;
+            return builder.build(global_bbox, triangles.data(), bboxes, centers, count);
+        }
+        break;
+    case Builder::Linear: {
+        bvh::LinearBvhBuilder<bvh::Bvh<float>, std::uint32_t> builder(tree);
+        builder.build(global_bbox, bboxes, centers, count);
+        if (maxLeafSize > 1) {
+            collapseLeaves(tree, maxLeafSize);
+        }
+        return count;
+    }
+    default:
+        break;
+    }
+
+    bvh::SweepSahBuilder<bvh::Bvh<float>> builder(tree);
+    builder.max_leaf_size = maxLeafSize;
+    builder.build(global_bbox, bboxes, centers, count);
+    return count;
+}
+
+bvh::BoundingBox<float> AccelerationStructures::buildBLAS(BVH& blas, const Mesh& mesh, BuildStats& stats, ThreadPool* pool) {
+    std::uint32_t triangleCount = mesh.indices.size() / 3;
+
+    auto position = [&mesh](std::uint32_t vertex) {
+        return bvh::Vector3<float>(mesh.positions[vertex * 3 + 0], mesh.positions[vertex * 3 + 1], mesh.positions[vertex * 3 + 2]);
+    };
+
+    // The builders only need every triangle's bounds and center, which come straight from the indexed mesh.
+    auto bboxes = std::make_unique<bvh::BoundingBox<float>[]>(triangleCount);
+    auto centers = std::make_unique<bvh::Vector3<float>[]>(triangleCount);
+    auto boundRange = [&](std::uint32_t begin, std::uint32_t end) {
+        for (std::uint32_t i = begin; i < end; i++) {
+            auto p0 = position(mesh.indices[i * 3 + 0]);
+            auto p1 = position(mesh.indices[i * 3 + 1]);
+            auto p2 = position(mesh.indices[i * 3 + 2]);
+            bboxes[i] = bvh::BoundingBox<float>(p0).extend(p1).extend(p2);
+            centers[i] = (p0 + p1 + p2) * (1.0f / 3.0f);
+        }
+    };
+
+    if (pool) {
+        pool->parallelFor(0, triangleCount, FLATTEN_GRAIN, boundRange);
+    } else {
+        boundRange(0, triangleCount);
+    }
+
+    stats.builder = mesh.options.builder;
+    stats.triangles = triangleCount;
+    stats.references = buildTree(blas.bvh, mesh.options, bboxes.get(), centers.get(), &mesh, triangleCount);
+    stats.nodes = blas.bvh.node_count;
+    stats.sahCost = computeSahCost(blas.bvh);
+
+    return bvh::compute_bounding_boxes_union(bboxes.get(), triangleCount);
+}
+
+void AccelerationStructures::writeBLAS(const BVH& blas, const Mesh& mesh, std::uint32_t slotCount, std::uint32_t geometryOffset, std::uint32_t vertexOffset,
+                                       ThreadPool* pool) {
+    auto position = [&mesh](std::uint32_t vertex) {
+        return bvh::Vector3<float>(mesh.positions[vertex * 3 + 0], mesh.positions[vertex * 3 + 1], mesh.positions[vertex * 3 + 2]);
+    };
+
+    // Reorder into leaf slots so a leaf's triangles are contiguous and no primitive id lookup is needed.
+    // A triangle split by SBVH is simply written to each of its slots.
+    const std::size_t* primitives = blas.bvh.primitive_indices.get();
+    auto writeRange = [&](std::uint32_t begin, std::uint32_t end) {
+        for (std::uint32_t slot = begin; slot < end; slot++) {
+            const std::uint32_t* index = &mesh.indices[primitives[slot] * 3];
+            auto p0 = position(index[0]);
+            auto e1 = position(index[1]) - p0;
+            auto e2 = position(index[2]) - p0;
+
+            float* triangle = &m_flatBlasTriangles[std::size_t(geometryOffset + slot) * 3 * 4];
+            triangle[0] = p0[0]; triangle[1]  = p0[1]; triangle[2]  = p0[2]; triangle[3]  = 1.0f;
+            triangle[4] = e1[0]; triangle[5]  = e1[1]; triangle[6]  = e1[2]; triangle[7]  = 0.0f;
+            triangle[8] = e2[0]; triangle[9]  = e2[1]; triangle[10] = e2[2]; triangle[11] = 0.0f;
+
+            std::uint32_t* indices = &m_flatBlasIndices[std::size_t(geometryOffset + slot) * 3];
+            indices[0] = index[0] + vertexOffset;
+            indices[1] = index[1] + vertexOffset;
+            indices[2] = index[2] + vertexOffset;
+            m_flatBlasMaterials[geometryOffset + slot] = mesh.material;
+        }
+    };
+
+    if (pool) {
+        pool->parallelFor(0, slotCount, FLATTEN_GRAIN, writeRange);
+    } else {
+        writeRange(0, slotCount);
+    }
+
+    std::copy(mesh.normals.begin(), mesh.normals.end(), m_flatBlasNormals.begin() + std::size_t(vertexOffset) * 3);
+}
+
+std::uint32_t AccelerationStructures::packedRecordCount(const bvh::Bvh<float>& tree) {
+    return tree.node_count > 1 ? (tree.node_count - 1) / 2 : 1;
+}
+
+void AccelerationStructures::flattenNodes(BVH& target, ThreadPool* pool) {
+    target.leafs.resize(target.bvh.node_count);
+    target.children.resize(target.bvh.node_count);
+    target.links.resize(target.bvh.node_count);
+    target.aabbs.resize(target.bvh.node_count * 8);
+    target.nodes.resize(packedRecordCount(target.bvh) * 16);
+    flattenNodes(target.bvh, target.aabbs.data(), target.children.data(), target.leafs.data(), target.links.data(), target.nodes.data(), pool);
+}
+
+void AccelerationStructures::flattenNodes(const bvh::Bvh<float>& tree, float* aabbs, std::uint32_t* children, std::uint32_t* leafs, std::uint32_t* links,
+                                          float* nodes, ThreadPool* pool) {
+    std::uint32_t nodeCount = tree.node_count;
+    links[0] = tree.nodes[0].is_leaf();
+
+    // Every inner node writes its children's links, so each link has exactly one writer.
+    auto flattenRange = [&](std::uint32_t begin, std::uint32_t end) {
+        for (std::uint32_t i = begin; i < end; i++) {
+            const auto& node = tree.nodes[i];
+            leafs[i] = node.is_leaf();
+            children[i] = node.first_child_or_primitive;
+            writeAabb(&aabbs[i * 8], node);
+            if (!node.is_leaf()) {
+                std::uint32_t child = node.first_child_or_primitive;
+                links[child + 0] = (i << 1) | tree.nodes[child + 0].is_leaf();
+                links[child + 1] = (i << 1) | tree.nodes[child + 1].is_leaf();
+            }
+        }
+    };
+
+    if (pool) {
+        pool->parallelFor(0, nodeCount, FLATTEN_GRAIN, flattenRange);
+    } else {
+        flattenRange(0, nodeCount);
+    }
+
+    packNodes(tree, nodes, pool);
+}
+
+void AccelerationStructures::packNodes(const bvh::Bvh<float>& tree, float* nodes, ThreadPool* pool) {
+    // Siblings are allocated in pairs (2k + 1, 2k + 2), so record k describes that pair and an
+    // inner node whose first child is c is described by record (c - 1) / 2.
+    std::uint32_t recordCount = packedRecordCount(tree);
+
+    if (tree.node_count == 1) {
+        // A single leaf root: the right slot stays empty and is skipped by its null child index.
+        std::uint32_t nullChild = std::uint32_t(-1);
+        std::fill(nodes, nodes + 16, 0.0f);
+        packChild(&nodes[0], tree.nodes[0]);
+        std::memcpy(&nodes[11], &nullChild, sizeof(nullChild));
+        return;
+    }
+
+    auto packRange = [&](std::uint32_t begin, std::uint32_t end) {
+        for (std::uint32_t record = begin; record < end; record++) {
+            packChild(&nodes[record * 16 + 0], tree.nodes[record * 2 + 1]);
+            packChild(&nodes[record * 16 + 8], tree.nodes[record * 2 + 2]);
+        }
+    };
+
+    if (pool) {
+        pool->parallelFor(0, recordCount, FLATTEN_GRAIN, packRange);
+    } else {
+        packRange(0, recordCount);
+    }
+}
+
+void AccelerationStructures::flattenNode(BVH& target, std::uint32_t nodeId) {
+    const auto& node = target.bvh.nodes[nodeId];
+    writeAabb(&target.aabbs[nodeId * 8], node);
+
+    // Node i > 0 is a side of record (i - 1) / 2. The root has no record of its own
+    // unless it is a single leaf, which takes the left side of record 0.
+    if (nodeId > 0) {
+        packChild(&target.nodes[(nodeId - 1) * 8], node);
+    } else if (target.bvh.node_count == 1) {
+        packChild(&target.nodes[0], node);
+    }
+}
+
+std::uint32_t AccelerationStructures::addBLAS(const Mesh& mesh) {
+    std::vector<Mesh> meshes(1, mesh);
+    appendBLAS(meshes, nullptr);
+    return m_blas.size() - 1;
+}
+
+std::vector<AccelerationStructures::BuildStats> AccelerationStructures::addBLASBatch(std::vector<Mesh> meshes, ThreadPool& pool) {
+    return appendBLAS(meshes, &pool);
+}
+
+std::vector<AccelerationStructures::BuildStats> AccelerationStructures::appendBLAS(std::vector<Mesh>& meshes, ThreadPool* pool) {
+    unmapBLAS();
+
+    std::size_t first = m_blas.size();
+    m_blas.resize(first + meshes.size());
+    m_blasAabbs.resize(first + meshes.size());
+    m_tlasBlasGeometryOffsets.resize(first + meshes.size());
+
+    std::vector<BuildStats> stats(meshes.size());
+
+    auto build = [&](std::size_t meshId) {
+        auto start = std::chrono::steady_clock::now();
+        m_blasAabbs[first + meshId] = buildBLAS(m_blas[first + meshId], meshes[meshId], stats[meshId], pool);
+        stats[meshId].seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    if (pool) {
+        // Large meshes go one at a time so the builder's own OpenMP tasks get every core,
+        // the rest are spread over the pool with one mesh per task.
+        std::vector<std::uint32_t> smallMeshes;
+        for (std::uint32_t meshId = 0; meshId < meshes.size(); meshId++) {
+            if (meshes[meshId].indices.size() / 3 >= PARALLEL_BUILD_THRESHOLD) {
+                build(meshId);
+            } else {
+                smallMeshes.push_back(meshId);
+            }
+        }
+
+        pool->parallelFor(0, smallMeshes.size(), 1, [&](std::uint32_t begin, std::uint32_t end) {
+#ifdef _OPENMP
+            // Keep the builder from opening a full OpenMP team inside every pool task.
+            int ompThreads = omp_get_max_threads();
+            omp_set_num_threads(1);
+#endif
+            for (std::uint32_t i = begin; i < end; i++) {
+                build(smallMeshes[i]);
+            }
+#ifdef _OPENMP
+            omp_set_num_threads(ompThreads);
+#endif
+        });
+    } else {
+        for (std::uint32_t meshId = 0; meshId < meshes.size(); meshId++) {
+            build(meshId);
+        }
+    }
+
+    // SBVH only knows its slot count once built, so the flat geometry buffers are sized after all
+    // trees of the batch exist (within the reserveBLAS capacity unless references were split)
+    // and each BLAS then writes its own range.
+    std::vector<std::uint32_t> vertexOffsets(meshes.size());
+    std::uint32_t slotCount = m_flatBlasMaterials.size();
+    std::uint32_t vertexCount = m_flatBlasNormals.size() / 3;
+    for (std::uint32_t meshId = 0; meshId < meshes.size(); meshId++) {
+        m_tlasBlasGeometryOffsets[first + meshId] = slotCount;
+        vertexOffsets[meshId] = vertexCount;
+        slotCount += stats[meshId].references;
+        vertexCount += meshes[meshId].positions.size() / 3;
+    }
+    // Slots and vertices fit 32 bit ids, their float counts do not.
+    m_flatBlasTriangles.resize(std::size_t(slotCount) * 3 * 4);
+    m_flatBlasIndices.resize(std::size_t(slotCount) * 3);
+    m_flatBlasMaterials.resize(slotCount);
+    m_flatBlasNormals.resize(std::size_t(vertexCount) * 3);
+
+    auto write = [&](std::uint32_t meshId) {
+        writeBLAS(m_blas[first + meshId], meshes[meshId], stats[meshId].references, m_tlasBlasGeometryOffsets[first + meshId],
+                  vertexOffsets[meshId], pool);
+        // The mesh is in the flat buffers now; drop it so a batch never holds two copies.
+        meshes[meshId] = Mesh();
+    };
+
+    if (pool) {
+        pool->parallelFor(0, meshes.size(), 1, [&](std::uint32_t begin, std::uint32_t end) {
+            for (std::uint32_t meshId = begin; meshId < end; meshId++) {
+                write(meshId);
+            }
+        });
+    } else {
+        for (std::uint32_t meshId = 0; meshId < meshes.size(); meshId++) {
+            write(meshId);
+        }
+    }
+
+    flattenBLAS(first, pool);
+    return stats;
+}
+
+std::uint32_t AccelerationStructures::addInstance(std::uint32_t blas, const std::array<float, 12>& transform) {
+    m_instances.push_back({blas, transform});
+    return m_instances.size() - 1;
+}
+
+void AccelerationStructures::buildTLAS(ThreadPool* pool) {
+    if (m_instances.empty()) {
+        for (std::uint32_t blasId = 0; blasId < m_blas.size(); blasId++) {
+            addInstance(blasId);
+        }
+    }
 
-    std::uint32_t stride = 3;
-    for (std::uint32_t i = 0; i < mesh.size(); i += 3 * 4 * stride) {
-        triangles.push_back(bvh::Triangle<float>(
-                               bvh::Vector3<float>(mesh[i + 4 * stride * 0], mesh[i + 4 * stride * 0 + 1], mesh[i + 4 * stride * 0 + 2]),
-                               bvh::Vector3<float>(mesh[i + 4 * stride * 1], mesh[i + 4 * stride * 1 + 1], mesh[i + 4 * stride * 1 + 2]),
-                               bvh::Vector3<float>(mesh[i + 4 * stride * 2], mesh[i + 4 * stride * 2 + 1], mesh[i + 4 * stride * 2 + 2])
-                           ));
+    resizeInstances();
+    for (std::uint32_t i = 0; i < m_instances.size(); i++) {
+        writeInstance(i);
     }
+    m_dirtyInstances.clear();
 
-    auto [bboxes, centers] = bvh::compute_bounding_boxes_and_centers(triangles.data(), triangles.size());
-    auto global_bbox = bvh::compute_bounding_boxes_union(bboxes.get(), triangles.size());
-    m_blasAabbs.push_back(global_bbox);
-    m_blasCenters.push_back(global_bbox.center());
+    rebuildTLAS(pool);
+}
 
-    m_blas.emplace_back();
-    BVH& blas = m_blas.back();
+void AccelerationStructures::setInstanceTransform(std::uint32_t instance, const std::array<float, 12>& transform) {
+    m_instances[instance].transform = transform;
+    m_dirtyInstances.push_back(instance);
+}
 
-    blas.builder.build(global_bbox, bboxes.get(), centers.get(), triangles.size());
+AccelerationStructures::TlasUpdate AccelerationStructures::updateTLAS(ThreadPool* pool) {
+    TlasUpdate update;
 
-    for (std::uint32_t i = 0; i < blas.bvh.node_count; i++) {
-        const auto& node = blas.bvh.nodes[i];
-        blas.leafs.insert(blas.leafs.end(), {node.is_leaf()});
-        blas.children.insert(blas.children.end(), {node.first_child_or_primitive});
-        blas.aabbs.insert(blas.aabbs.end(), {node.bounds[0], node.bounds[2], node.bounds[4], 1.0f,
-                                             node.bounds[1], node.bounds[3], node.bounds[5], 1.0f});
+    // A rebuild changes the node count whenever leaves hold several instances, so the sizes
+    // are compared against those from before it rather than inferred from the instance count.
+    std::array<std::size_t, BUFFER_COUNT> oldSizes;
+    for (std::uint32_t i = 0; i < BUFFER_COUNT; i++) {
+        oldSizes[i] = m_buffers[i].size;
     }
 
-    blas.geometry.insert(blas.geometry.end(), mesh.begin(), mesh.end());
+    auto markRebuilt = [&]() {
+        update.rebuilt = true;
+        for (Buffer buffer : {Buffer::TlasAABB, Buffer::TlasGeometry, Buffer::TlasChild, Buffer::TlasPrimitiveId, Buffer::TlasIsLeaf,
+                              Buffer::TlasNodeLink, Buffer::TlasNode, Buffer::TlasInstanceBlas, Buffer::TlasWorldToObject, Buffer::TlasObjectToWorld}) {
+            update.ranges[static_cast<std::uint32_t>(buffer)] = {0, getBuffer(buffer).size};
+            update.resized |= getBuffer(buffer).size != oldSizes[static_cast<std::uint32_t>(buffer)];
+        }
+    };
+
+    // New instances change the buffer sizes, and a cache-mapped TLAS has no build-time tree to refit.
+    if (m_instances.size() != m_tlasInstanceBlas.size() || m_tlas.bvh.node_count == 0) {
+        buildTLAS(pool);
+        markRebuilt();
+        update.sahCost = m_tlasBuildStats.sahCost;
+        return update;
+    }
+
+    if (m_dirtyInstances.empty()) {
+        update.sahCost = m_tlasBuildStats.sahCost;
+        return update;
+    }
+
+    std::uint32_t firstInstance = m_dirtyInstances.front();
+    std::uint32_t lastInstance = m_dirtyInstances.front();
+    for (std::uint32_t instance : m_dirtyInstances) {
+        writeInstance(instance);
+        firstInstance = std::min(firstInstance, instance);
+        lastInstance = std::max(lastInstance, instance);
+    }
+    m_dirtyInstances.clear();
 
-    blas.primitives.insert(blas.primitives.end(), blas.bvh.primitive_indices.get(), blas.bvh.primitive_indices.get() + triangles.size());
+    std::uint32_t firstNode, lastNode;
+    refitTLAS(firstNode, lastNode);
+
+    update.sahCost = computeSahCost(m_tlas.bvh);
+    if (update.sahCost > m_tlasBuildStats.sahCost * TLAS_REBUILD_RATIO) {
+        rebuildTLAS(pool);
+        markRebuilt();
+        update.sahCost = m_tlasBuildStats.sahCost;
+        return update;
+    }
+
+    auto markRange = [&](Buffer buffer, std::size_t elementSize, std::uint32_t first, std::uint32_t last) {
+        update.ranges[static_cast<std::uint32_t>(buffer)] = {first * elementSize, (last - first + 1) * elementSize};
+    };
+
+    markRange(Buffer::TlasGeometry, 8 * sizeof(float), firstInstance, lastInstance);
+    markRange(Buffer::TlasWorldToObject, 12 * sizeof(float), firstInstance, lastInstance);
+    markRange(Buffer::TlasObjectToWorld, 12 * sizeof(float), firstInstance, lastInstance);
+    if (firstNode <= lastNode) {
+        markRange(Buffer::TlasAABB, 8 * sizeof(float), firstNode, lastNode);
+        // Node i > 0 lives in record (i - 1) / 2, a single leaf root in record 0.
+        std::uint32_t firstRecord = firstNode > 0 ? (firstNode - 1) / 2 : 0;
+        std::uint32_t lastRecord = lastNode > 0 ? (lastNode - 1) / 2 : 0;
+        markRange(Buffer::TlasNode, 16 * sizeof(float), firstRecord, lastRecord);
+    }
+
+    return update;
 }
 
-void AccelerationStructures::buildTLAS() {
-    auto global_bbox = bvh::compute_bounding_boxes_union(m_blasAabbs.data(), m_blasAabbs.size());
-    m_tlas.builder.build(global_bbox, m_blasAabbs.data(), m_blasCenters.data(), m_blasAabbs.size());
+void AccelerationStructures::resizeInstances() {
+    std::uint32_t instanceCount = m_instances.size();
+    m_instanceAabbs.resize(instanceCount);
+    m_tlasInstanceBlas.resize(instanceCount);
+    m_tlasWorldToObject.resize(instanceCount * 12);
+    m_tlasObjectToWorld.resize(instanceCount * 12);
+    m_tlas.geometry.resize(instanceCount * 8);
+}
+
+void AccelerationStructures::writeInstance(std::uint32_t instanceId) {
+    const Instance& instance = m_instances[instanceId];
+    const auto& bbox = m_instanceAabbs[instanceId] = transformBox(m_blasAabbs[instance.blas], instance.transform);
+
+    auto inverse = invertTransform(instance.transform);
+    m_tlasInstanceBlas[instanceId] = instance.blas;
+    std::copy(inverse.begin(), inverse.end(), m_tlasWorldToObject.begin() + instanceId * 12);
+    std::copy(instance.transform.begin(), instance.transform.end(), m_tlasObjectToWorld.begin() + instanceId * 12);
+
+    float* aabb = &m_tlas.geometry[instanceId * 8];
+    aabb[0] = bbox.min[0]; aabb[1] = bbox.min[1]; aabb[2] = bbox.min[2]; aabb[3] = 1.0f;
+    aabb[4] = bbox.max[0]; aabb[5] = bbox.max[1]; aabb[6] = bbox.max[2]; aabb[7] = 1.0f;
+}
 
-    for (std::uint32_t i = 0; i < m_tlas.bvh.node_count; i++) {
-        const auto& node = m_tlas.bvh.nodes[i];
-        m_tlas.leafs.insert(m_tlas.leafs.end(), {node.is_leaf()});
-        m_tlas.children.insert(m_tlas.children.end(), {node.first_child_or_primitive});
-        m_tlas.aabbs.insert(m_tlas.aabbs.end(), {node.bounds[0], node.bounds[2], node.bounds[4], 1.0f,
-                                                 node.bounds[1], node.bounds[3], node.bounds[5], 1.0f});
+void AccelerationStructures::rebuildTLAS(ThreadPool* pool) {
+    std::uint32_t instanceCount = m_instances.size();
+    std::vector<bvh::Vector3<float>> instanceCenters(instanceCount);
+    for (std::uint32_t i = 0; i < instanceCount; i++) {
+        instanceCenters[i] = m_instanceAabbs[i].center();
     }
 
-    for (const auto& bbox : m_blasAabbs) {
-        m_tlas.geometry.insert(m_tlas.geometry.end(), {bbox.min[0], bbox.min[1], bbox.min[2], 1.0,
-                                                       bbox.max[0], bbox.max[1], bbox.max[2], 1.0});
+    auto start = std::chrono::steady_clock::now();
+    std::uint32_t references = buildTree(m_tlas.bvh, m_tlasOptions, m_instanceAabbs.data(), instanceCenters.data(), nullptr, instanceCount);
+
+    flattenNodes(m_tlas, pool);
+
+    m_tlas.primitives.assign(m_tlas.bvh.primitive_indices.get(), m_tlas.bvh.primitive_indices.get() + references);
+
+    m_tlasBuildStats.builder = m_tlasOptions.builder == Builder::SpatialSplit ? Builder::SweepSah : m_tlasOptions.builder;
+    m_tlasBuildStats.triangles = instanceCount;
+    m_tlasBuildStats.references = references;
+    m_tlasBuildStats.nodes = m_tlas.bvh.node_count;
+    m_tlasBuildStats.sahCost = computeSahCost(m_tlas.bvh);
+    m_tlasBuildStats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    m_buffers[static_cast<std::uint32_t>(Buffer::TlasAABB)]               = viewOf(m_tlas.aabbs);
+    m_buffers[static_cast<std::uint32_t>(Buffer::TlasGeometry)]           = viewOf(m_tlas.geometry);
+    m_buffers[static_cast<std::uint32_t>(Buffer::TlasChild)]              = viewOf(m_tlas.children);
+    m_buffers[static_cast<std::uint32_t>(Buffer::TlasPrimitiveId)]        = viewOf(m_tlas.primitives);
+    m_buffers[static_cast<std::uint32_t>(Buffer::TlasIsLeaf)]             = viewOf(m_tlas.leafs);
+    m_buffers[static_cast<std::uint32_t>(Buffer::TlasNodeLink)]           = viewOf(m_tlas.links);
+    m_buffers[static_cast<std::uint32_t>(Buffer::TlasNode)]               = viewOf(m_tlas.nodes);
+    m_buffers[static_cast<std::uint32_t>(Buffer::TlasInstanceBlas)]       = viewOf(m_tlasInstanceBlas);
+    m_buffers[static_cast<std::uint32_t>(Buffer::TlasWorldToObject)]      = viewOf(m_tlasWorldToObject);
+    m_buffers[static_cast<std::uint32_t>(Buffer::TlasObjectToWorld)]      = viewOf(m_tlasObjectToWorld);
+}
+
+void AccelerationStructures::refitTLAS(std::uint32_t& firstNode, std::uint32_t& lastNode) {
+    auto& tree = m_tlas.bvh;
+    firstNode = tree.node_count;
+    lastNode = 0;
+
+    // Children are allocated after their parents, so a backwards pass sees them first.
+    for (std::uint32_t i = tree.node_count; i-- > 0;) {
+        auto& node = tree.nodes[i];
+
+        auto bbox = bvh::BoundingBox<float>::empty();
+        if (node.is_leaf()) {
+            for (std::uint32_t j = 0; j < node.primitive_count; j++) {
+                bbox.extend(m_instanceAabbs[tree.primitive_indices[node.first_child_or_primitive + j]]);
+            }
+        } else {
+            for (std::uint32_t child = node.first_child_or_primitive; child < node.first_child_or_primitive + 2; child++) {
+                const auto& bounds = tree.nodes[child].bounds;
+                bbox.extend(bvh::BoundingBox<float>(bvh::Vector3<float>(bounds[0], bounds[2], bounds[4]), bvh::Vector3<float>(bounds[1], bounds[3], bounds[5])));
+            }
+        }
+
+        float bounds[6] = {bbox.min[0], bbox.max[0], bbox.min[1], bbox.max[1], bbox.min[2], bbox.max[2]};
+        if (std::equal(bounds, bounds + 6, node.bounds)) {
+            continue;
+        }
+
+        std::copy(bounds, bounds + 6, node.bounds);
+        flattenNode(m_tlas, i);
+        firstNode = std::min(firstNode, i);
+        lastNode = std::max(lastNode, i);
     }
+}
 
-    m_tlas.primitives.insert(m_tlas.primitives.end(), m_tlas.bvh.primitive_indices.get(), m_tlas.bvh.primitive_indices.get() + m_blasAabbs.size());
+float AccelerationStructures::computeSahCost(const bvh::Bvh<float>& tree) {
+    auto halfArea = [](const float* bounds) {
+        float x = bounds[1] - bounds[0], y = bounds[3] - bounds[2], z = bounds[5] - bounds[4];
+        return x * y + y * z + z * x;
+    };
 
-    std::uint32_t offsetNode = 0;
-    std::uint32_t offsetGeometry = 0;
-    for (const auto& blasBVH : m_blas) {
-        m_tlasBlasNodeOffsets.push_back(offsetNode);
-        offsetNode += blasBVH.bvh.node_count;
+    float rootArea = halfArea(tree.nodes[0].bounds);
+    if (rootArea <= 0.0f) {
+        return 0.0f;
+    }
+
+    float cost = 0.0f;
+    for (std::uint32_t i = 0; i < tree.node_count; i++) {
+        const auto& node = tree.nodes[i];
+        float area = halfArea(node.bounds) / rootArea;
+        cost += node.is_leaf() ? area * node.primitive_count * SAH_INTERSECTION_COST : area * SAH_TRAVERSAL_COST;
+    }
+    return cost;
+}
+
+std::vector<AccelerationStructures::EmissiveTriangle> AccelerationStructures::getEmissiveTriangles() const {
+    const auto& instanceBlas = getBuffer(Buffer::TlasInstanceBlas);
+    const auto& geometryOffsets = getBuffer(Buffer::TlasBlasGeometryOffset);
+    const auto& materials = getBuffer(Buffer::BlasMaterial);
+    const std::uint32_t* indices = getBuffer(Buffer::BlasIndex).as<std::uint32_t>();
+    const float* objectToWorld = getBuffer(Buffer::TlasObjectToWorld).as<float>();
+    const float* triangles = getBuffer(Buffer::BlasTriangle).as<float>();
+
+    // SBVH can put a triangle into several slots, which would be sampled once per slot, so
+    // every BLAS keeps only the first slot of each vertex index triple.
+    std::uint32_t blasCount = geometryOffsets.count<std::uint32_t>();
+    std::vector<std::vector<std::uint32_t>> emissiveSlots(blasCount);
+    for (std::uint32_t blas = 0; blas < blasCount; blas++) {
+        std::uint32_t firstSlot = geometryOffsets.as<std::uint32_t>()[blas];
+        std::uint32_t endSlot = blas + 1 < blasCount ? geometryOffsets.as<std::uint32_t>()[blas + 1] : materials.count<std::uint32_t>();
+
+        auto& slots = emissiveSlots[blas];
+        for (std::uint32_t slot = firstSlot; slot < endSlot; slot++) {
+            if (materials.as<std::uint32_t>()[slot] & MATERIAL_EMISSIVE) {
+                slots.push_back(slot);
+            }
+        }
+
+        auto triple = [indices](std::uint32_t slot) {
+            const std::uint32_t* index = indices + std::size_t(slot) * 3;
+            return std::array<std::uint32_t, 3>{index[0], index[1], index[2]};
+        };
+        std::stable_sort(slots.begin(), slots.end(), [&](std::uint32_t a, std::uint32_t b) { return triple(a) < triple(b); });
+        slots.erase(std::unique(slots.begin(), slots.end(), [&](std::uint32_t a, std::uint32_t b) { return triple(a) == triple(b); }), slots.end());
+        std::sort(slots.begin(), slots.end());
+    }
+
+    std::vector<EmissiveTriangle> lights;
+    for (std::uint32_t instance = 0; instance < instanceBlas.count<std::uint32_t>(); instance++) {
+        std::uint32_t blas = instanceBlas.as<std::uint32_t>()[instance];
+        const float* m = objectToWorld + instance * 12;
+
+        for (std::uint32_t slot : emissiveSlots[blas]) {
+            // Edges are stored at offsets 4 and 8 of the slot's three vec4s.
+            const float* e1 = triangles + std::size_t(slot) * 12 + 4;
+            const float* e2 = triangles + std::size_t(slot) * 12 + 8;
+            float a[3], b[3];
+            for (std::uint32_t row = 0; row < 3; row++) {
+                a[row] = m[row * 4 + 0] * e1[0] + m[row * 4 + 1] * e1[1] + m[row * 4 + 2] * e1[2];
+                b[row] = m[row * 4 + 0] * e2[0] + m[row * 4 + 1] * e2[1] + m[row * 4 + 2] * e2[2];
+            }
+            float cx = a[1] * b[2] - a[2] * b[1], cy = a[2] * b[0] - a[0] * b[2], cz = a[0] * b[1] - a[1] * b[0];
+            float area = 0.5f * std::sqrt(cx * cx + cy * cy + cz * cz);
+            if (area > 0.0f) {
+                lights.push_back({instance, slot, area});
+            }
+        }
+    }
+    return lights;
+}
+
+void AccelerationStructures::flattenBLAS(std::size_t first, ThreadPool* pool) {
+    std::uint32_t nodeCount = m_flatBlasLeafs.size();
+    std::uint32_t packedNodeCount = m_flatBlasNodes.size() / 16;
+    m_tlasBlasNodeOffsets.resize(m_blas.size());
+    m_tlasBlasPackedNodeOffsets.resize(m_blas.size());
+    for (std::size_t blasId = first; blasId < m_blas.size(); blasId++) {
+        m_tlasBlasNodeOffsets[blasId] = nodeCount;
+        m_tlasBlasPackedNodeOffsets[blasId] = packedNodeCount;
+        nodeCount += m_blas[blasId].bvh.node_count;
+        packedNodeCount += packedRecordCount(m_blas[blasId].bvh);
+    }
+
+    m_flatBlasAabbs.resize(std::size_t(nodeCount) * 8);
+    m_flatBlasChildren.resize(nodeCount);
+    m_flatBlasLeafs.resize(nodeCount);
+    m_flatBlasLinks.resize(nodeCount);
+    m_flatBlasNodes.resize(std::size_t(packedNodeCount) * 16);
+
+    // Once flattened, a BLAS tree is not needed anymore; only its bounds are kept for the instances.
+    auto flattenRange = [&](std::uint32_t begin, std::uint32_t end) {
+        for (std::uint32_t blasId = begin; blasId < end; blasId++) {
+            auto& tree = m_blas[blasId].bvh;
+            std::uint32_t nodeOffset = m_tlasBlasNodeOffsets[blasId];
+            flattenNodes(tree, &m_flatBlasAabbs[std::size_t(nodeOffset) * 8], &m_flatBlasChildren[nodeOffset], &m_flatBlasLeafs[nodeOffset],
+                         &m_flatBlasLinks[nodeOffset], &m_flatBlasNodes[std::size_t(m_tlasBlasPackedNodeOffsets[blasId]) * 16], nullptr);
+            tree = bvh::Bvh<float>();
+        }
+    };
+
+    if (pool) {
+        pool->parallelFor(first, m_blas.size(), 1, flattenRange);
+    } else {
+        flattenRange(first, m_blas.size());
+    }
+
+    m_buffers[static_cast<std::uint32_t>(Buffer::TlasBlasNodeOffset)]     = viewOf(m_tlasBlasNodeOffsets);
+    m_buffers[static_cast<std::uint32_t>(Buffer::TlasBlasGeometryOffset)] = viewOf(m_tlasBlasGeometryOffsets);
+    m_buffers[static_cast<std::uint32_t>(Buffer::BlasAABB)]               = viewOf(m_flatBlasAabbs);
+    m_buffers[static_cast<std::uint32_t>(Buffer::BlasTriangle)]           = viewOf(m_flatBlasTriangles);
+    m_buffers[static_cast<std::uint32_t>(Buffer::BlasChild)]              = viewOf(m_flatBlasChildren);
+    m_buffers[static_cast<std::uint32_t>(Buffer::BlasIndex)]              = viewOf(m_flatBlasIndices);
+    m_buffers[static_cast<std::uint32_t>(Buffer::BlasIsLeaf)]             = viewOf(m_flatBlasLeafs);
+    m_buffers[static_cast<std::uint32_t>(Buffer::BlasNodeLink)]           = viewOf(m_flatBlasLinks);
+    m_buffers[static_cast<std::uint32_t>(Buffer::BlasNode)]               = viewOf(m_flatBlasNodes);
+    m_buffers[static_cast<std::uint32_t>(Buffer::TlasBlasPackedNodeOffset)] = viewOf(m_tlasBlasPackedNodeOffsets);
+    m_buffers[static_cast<std::uint32_t>(Buffer::BlasNormal)]             = viewOf(m_flatBlasNormals);
+    m_buffers[static_cast<std::uint32_t>(Buffer::BlasMaterial)]           = viewOf(m_flatBlasMaterials);
+}
+
+void AccelerationStructures::unmapBLAS() {
+    // Built buffers are viewed straight from their vectors, mapped ones from the cache.
+    if (getBuffer(Buffer::BlasNode).data == m_flatBlasNodes.data()) {
+        return;
+    }
+
+    copyView(getBuffer(Buffer::TlasBlasNodeOffset), m_tlasBlasNodeOffsets);
+    copyView(getBuffer(Buffer::TlasBlasGeometryOffset), m_tlasBlasGeometryOffsets);
+    copyView(getBuffer(Buffer::TlasBlasPackedNodeOffset), m_tlasBlasPackedNodeOffsets);
+    copyView(getBuffer(Buffer::BlasAABB), m_flatBlasAabbs);
+    copyView(getBuffer(Buffer::BlasTriangle), m_flatBlasTriangles);
+    copyView(getBuffer(Buffer::BlasChild), m_flatBlasChildren);
+    copyView(getBuffer(Buffer::BlasIndex), m_flatBlasIndices);
+    copyView(getBuffer(Buffer::BlasIsLeaf), m_flatBlasLeafs);
+    copyView(getBuffer(Buffer::BlasNodeLink), m_flatBlasLinks);
+    copyView(getBuffer(Buffer::BlasNode), m_flatBlasNodes);
+    copyView(getBuffer(Buffer::BlasNormal), m_flatBlasNormals);
+    copyView(getBuffer(Buffer::BlasMaterial), m_flatBlasMaterials);
+    // With no new BLAS this only points the views at the copies.
+    flattenBLAS(m_blas.size(), nullptr);
+}
+
+bool AccelerationStructures::saveCache(const std::string& path, std::uint64_t sourceHash) const {
+    CacheHeader header = {};
+    std::memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.version = CACHE_VERSION;
+    header.sourceHash = sourceHash;
+    header.bufferCount = BUFFER_COUNT;
+
+    std::uint64_t offset = (sizeof(CacheHeader) + CACHE_ALIGNMENT - 1) / CACHE_ALIGNMENT * CACHE_ALIGNMENT;
+    for (std::uint32_t i = 0; i < BUFFER_COUNT; i++) {
+        header.buffers[i].offset = offset;
+        header.buffers[i].size = m_buffers[i].size;
+        offset += (m_buffers[i].size + CACHE_ALIGNMENT - 1) / CACHE_ALIGNMENT * CACHE_ALIGNMENT;
+    }
+
+    std::string tempPath = path + ".tmp";
+    std::ofstream output(tempPath, std::ios::binary | std::ios::trunc);
+    if (!output) {
+        return false;
+    }
+
+    const char padding[CACHE_ALIGNMENT] = {};
+    output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    output.write(padding, header.buffers[0].offset - sizeof(header));
+    for (std::uint32_t i = 0; i < BUFFER_COUNT; i++) {
+        output.write(static_cast<const char*>(m_buffers[i].data), m_buffers[i].size);
+        std::uint64_t end = header.buffers[i].offset + m_buffers[i].size;
+        std::uint64_t next = (i + 1 < BUFFER_COUNT) ? header.buffers[i + 1].offset : offset;
+        output.write(padding, next - end);
+    }
+    output.close();
+
+    if (!output) {
+        std::remove(tempPath.c_str());
+        return false;
+    }
+    return std::rename(tempPath.c_str(), path.c_str()) == 0;
+}
+
+bool AccelerationStructures::loadCache(const std::string& path, std::uint64_t sourceHash) {
+    if (!m_cache.open(path)) {
+        return false;
+    }
+
+    const auto* base = static_cast<const std::uint8_t*>(m_cache.getData());
+    const auto* header = reinterpret_cast<const CacheHeader*>(base);
+    if (m_cache.getSize() < sizeof(CacheHeader) ||
+        std::memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != CACHE_VERSION ||
+        header->sourceHash != sourceHash ||
+        header->bufferCount != BUFFER_COUNT) {
+        m_cache.close();
+        return false;
+    }
 
-        m_tlasBlasGeometryOffsets.push_back(offsetGeometry);
-        offsetGeometry += blasBVH.primitives.size();
+    for (std::uint32_t i = 0; i < BUFFER_COUNT; i++) {
+        if (header->buffers[i].offset + header->buffers[i].size > m_cache.getSize()) {
+            m_cache.close();
+            return false;
+        }
+        m_buffers[i] = {base + header->buffers[i].offset, header->buffers[i].size};
     }
+
+    // Recover the instances and BLAS bounds so the TLAS can still be updated; the first
+    // update rebuilds it into memory while the BLAS buffers stay mapped. The BLASes are
+    // kept as flattened, empty trees, as after a build.
+    const auto& instanceBlas = getBuffer(Buffer::TlasInstanceBlas);
+    const float* objectToWorld = getBuffer(Buffer::TlasObjectToWorld).as<float>();
+    m_instances.resize(instanceBlas.count<std::uint32_t>());
+    for (std::uint32_t i = 0; i < m_instances.size(); i++) {
+        m_instances[i].blas = instanceBlas.as<std::uint32_t>()[i];
+        std::copy(objectToWorld + i * 12, objectToWorld + i * 12 + 12, m_instances[i].transform.begin());
+    }
+
+    const auto& packedOffsets = getBuffer(Buffer::TlasBlasPackedNodeOffset);
+    const float* blasNodes = getBuffer(Buffer::BlasNode).as<float>();
+    m_blas.resize(packedOffsets.count<std::uint32_t>());
+    m_blasAabbs.resize(packedOffsets.count<std::uint32_t>());
+    for (std::uint32_t blasId = 0; blasId < m_blasAabbs.size(); blasId++) {
+        const float* record = blasNodes + std::size_t(packedOffsets.as<std::uint32_t>()[blasId]) * 16;
+        auto& bbox = m_blasAabbs[blasId] = bvh::BoundingBox<float>::empty();
+        for (std::uint32_t side = 0; side < 2; side++) {
+            const float* child = record + side * 8;
+            std::uint32_t childIndex;
+            std::memcpy(&childIndex, &child[3], sizeof(childIndex));
+            if (childIndex != std::uint32_t(-1)) {
+                bbox.extend(bvh::BoundingBox<float>(bvh::Vector3<float>(child[0], child[1], child[2]), bvh::Vector3<float>(child[4], child[5], child[6])));
+            }
+        }
+    }
+
+    return true;
 }
@@ -1,42 +1,270 @@
 #pragma once
 
+#include "MappedFile.hpp"
+#include "ThreadPool.hpp"
+
 #include <bvh/bvh.hpp>
-#include <bvh/sweep_sah_builder.hpp>
+
+#include <array>
+#include <string>
 
 class AccelerationStructures {
 public:
+    static constexpr std::uint32_t MATERIAL_EMISSIVE = 1;
+
+    enum class Builder : std::uint32_t {
+        SweepSah,
+        BinnedSah,
+        // SBVH: splits triangle references at spatial planes, so long thin triangles stop
+        // inflating their nodes. A triangle may end up in several leaves.
+        SpatialSplit,
+        // LBVH: sorts the primitives along a Morton curve. Fastest to build, poorest SAH.
+        Linear,
+        Count
+    };
+
+    struct BuildOptions {
+        Builder       builder     = Builder::SweepSah;
+        // LBVH always builds single primitive leaves; above 1 they are collapsed afterwards
+        // wherever the SAH improves, up to this size.
+        std::uint32_t maxLeafSize = 1;
+    };
+
+    static const char* getBuilderName(Builder builder);
+    // Accepts the names returned by getBuilderName.
+    static bool parseBuilder(const std::string& name, Builder& builder);
+
+    // Indexed triangle mesh as handed over by the loader, three floats per vertex.
+    struct Mesh {
+        std::vector<float>         positions;
+        std::vector<float>         normals;
+        std::vector<std::uint32_t> indices;
+        std::uint32_t              material = 0;
+        BuildOptions               options;
+    };
+
+    // A placement of a BLAS in the scene. The transform is a row-major 3x4
+    // object to world matrix.
+    struct Instance {
+        std::uint32_t         blas;
+        std::array<float, 12> transform;
+    };
+
+    static constexpr std::array<float, 12> IDENTITY_TRANSFORM = {1.0f, 0.0f, 0.0f, 0.0f,
+                                                                 0.0f, 1.0f, 0.0f, 0.0f,
+                                                                 0.0f, 0.0f, 1.0f, 0.0f};
+
+    // The TLAS keeps its flattened arrays here so it can be refit. A BLAS is flattened straight
+    // into the shared buffers and only holds its tree while it is being built.
     struct BVH {
-        bvh::Bvh<float>                       bvh;
-        bvh::SweepSahBuilder<bvh::Bvh<float>> builder;
-        std::vector<float>                    aabbs;
-        std::vector<float>                    geometry;
-        std::vector<std::uint32_t>            children;
-        std::vector<std::uint32_t>            primitives;
-        std::vector<std::uint32_t>            leafs;
+        bvh::Bvh<float>            bvh;
+        std::vector<float>         aabbs;
+        std::vector<float>         geometry;
+        std::vector<std::uint32_t> children;
+        std::vector<std::uint32_t> primitives;
+        std::vector<std::uint32_t> leafs;
+        std::vector<std::uint32_t> links;
+        std::vector<float>         nodes;
+    };
+
+    // For the TLAS, triangles and references count instances.
+    struct BuildStats {
+        Builder       builder    = Builder::SweepSah;
+        std::uint32_t triangles  = 0;
+        // Leaf slots; more than triangles once SBVH splits references.
+        std::uint32_t references = 0;
+        std::uint32_t nodes      = 0;
+        float         sahCost    = 0.0f;
+        double        seconds    = 0.0;
+    };
+
+    // Flattened arrays as consumed by the tracers, every BLAS concatenated.
+    // The *Node buffers hold the packed layout (see packNodes), the rest the
+    // split aabbs/children/leafs layout; a tracer only needs one of the two.
+    // A split leaf's children entry is its first slot and the max.w of its aabb holds the
+    // slot count as uint bits.
+    // TLAS primitives are instances: the Tlas*Blas*Offset buffers are indexed by the BLAS id
+    // from TlasInstanceBlas, and TlasWorldToObject/TlasObjectToWorld hold 3x4 row-major
+    // transforms, three vec4 rows per instance.
+    // The *NodeLink buffers are indexed like the split layout and hold every node's parent in
+    // the upper 31 bits and its leaf flag in bit 0, for the stackless traversals. Siblings are
+    // allocated in pairs (2k + 1, 2k + 2), so the sibling needs no link of its own.
+    // BLAS triangles are stored in leaf slot order as p0, p1 - p0, p2 - p0, which is
+    // all the hit test reads. Indices, normals and materials are only needed for shading.
+    enum class Buffer : std::uint32_t {
+        TlasAABB,
+        TlasGeometry,
+        TlasChild,
+        TlasPrimitiveId,
+        TlasIsLeaf,
+        TlasBlasNodeOffset,
+        TlasBlasGeometryOffset,
+        BlasAABB,
+        BlasTriangle,
+        BlasChild,
+        BlasIndex,
+        BlasIsLeaf,
+        TlasNode,
+        BlasNode,
+        TlasBlasPackedNodeOffset,
+        BlasNormal,
+        BlasMaterial,
+        TlasInstanceBlas,
+        TlasWorldToObject,
+        TlasObjectToWorld,
+        TlasNodeLink,
+        BlasNodeLink,
+        Count
+    };
 
-        BVH() : builder(bvh) {
-            builder.max_leaf_size = 1;
-        }
+    struct BufferView {
+        const void* data = nullptr;
+        std::size_t size = 0;
+
+        template <typename T> const T* as() const { return static_cast<const T*>(data); }
+        template <typename T> std::size_t count() const { return size / sizeof(T); }
+    };
+
+    static constexpr std::uint32_t BUFFER_COUNT = static_cast<std::uint32_t>(Buffer::Count);
+
+    // A refit stops paying off once the tree's SAH cost grows this much past the last build.
+    static constexpr float TLAS_REBUILD_RATIO     = 1.3f;
+    static constexpr float SAH_TRAVERSAL_COST     = 1.0f;
+    static constexpr float SAH_INTERSECTION_COST  = 1.0f;
+
+    // Byte range of a buffer touched by updateTLAS; an empty range means unchanged.
+    struct DirtyRange {
+        std::size_t offset = 0;
+        std::size_t size   = 0;
+    };
+
+    struct TlasUpdate {
+        bool                                 rebuilt = false;
+        // Set when buffers changed size, so they need a full reupload instead of a subrange.
+        bool                                 resized = false;
+        float                                sahCost = 0.0f;
+        std::array<DirtyRange, BUFFER_COUNT> ranges;
     };
 
 private:
     BVH                                  m_tlas;
     std::vector<std::uint32_t>           m_tlasBlasNodeOffsets;
     std::vector<std::uint32_t>           m_tlasBlasGeometryOffsets;
+    std::vector<std::uint32_t>           m_tlasBlasPackedNodeOffsets;
+    std::vector<std::uint32_t>           m_tlasInstanceBlas;
+    std::vector<float>                   m_tlasWorldToObject;
+    std::vector<float>                   m_tlasObjectToWorld;
     std::vector<BVH>                     m_blas;
     std::vector<bvh::BoundingBox<float>> m_blasAabbs;
-    std::vector<bvh::Vector3<float>>     m_blasCenters;
+    std::vector<Instance>                m_instances;
+    std::vector<bvh::BoundingBox<float>> m_instanceAabbs;
+    std::vector<std::uint32_t>           m_dirtyInstances;
+    BuildOptions                         m_tlasOptions;
+    BuildStats                           m_tlasBuildStats;
+
+    std::vector<float>                   m_flatBlasAabbs;
+    std::vector<float>                   m_flatBlasTriangles;
+    std::vector<std::uint32_t>           m_flatBlasChildren;
+    std::vector<std::uint32_t>           m_flatBlasLeafs;
+    std::vector<std::uint32_t>           m_flatBlasLinks;
+    std::vector<float>                   m_flatBlasNodes;
+    std::vector<float>                   m_flatBlasNormals;
+    std::vector<std::uint32_t>           m_flatBlasIndices;
+    std::vector<std::uint32_t>           m_flatBlasMaterials;
+
+    std::array<BufferView, BUFFER_COUNT> m_buffers;
+    MappedFile                           m_cache;
+
+    static std::uint32_t packedRecordCount(const bvh::Bvh<float>& tree);
+    // Writes the split layout and links into arrays of node_count entries and the packed one
+    // into packedRecordCount records; the BVH overload sizes the target's own arrays first.
+    static void flattenNodes(const bvh::Bvh<float>& tree, float* aabbs, std::uint32_t* children, std::uint32_t* leafs, std::uint32_t* links,
+                             float* nodes, ThreadPool* pool);
+    static void flattenNodes(BVH& target, ThreadPool* pool);
+    // 64 bytes per pair of siblings, i.e. 32 bytes per node: both children's
+    // bounds with the child index and primitive count in the w components.
+    static void packNodes(const bvh::Bvh<float>& tree, float* nodes, ThreadPool* pool);
+    // Rewrites one node's aabb and its side of the packed record after its bounds changed.
+    static void flattenNode(BVH& target, std::uint32_t nodeId);
+    // Builds `tree` with the chosen builder and returns its leaf slot count. Only SBVH reads the
+    // triangles; without them it falls back to SweepSah.
+    static std::size_t buildTree(bvh::Bvh<float>& tree, const BuildOptions& options, const bvh::BoundingBox<float>* bboxes,
+                                 const bvh::Vector3<float>* centers, const Mesh* mesh, std::size_t count);
+    // Builds the tree over the mesh and fills in its stats; returns the BLAS bounds.
+    static bvh::BoundingBox<float> buildBLAS(BVH& blas, const Mesh& mesh, BuildStats& stats, ThreadPool* pool);
+    // Writes the mesh in leaf slot order to its range of the flat buffers.
+    void writeBLAS(const BVH& blas, const Mesh& mesh, std::uint32_t slotCount, std::uint32_t geometryOffset, std::uint32_t vertexOffset,
+                   ThreadPool* pool);
+    std::vector<BuildStats> appendBLAS(std::vector<Mesh>& meshes, ThreadPool* pool);
+    // Copies the BLAS buffers of a loaded cache into the vectors they are appended to.
+    void unmapBLAS();
+    // Appends the nodes of the BLASes from `first` on to the flat node buffers and frees their trees.
+    void flattenBLAS(std::size_t first, ThreadPool* pool);
+
+    void resizeInstances();
+    void writeInstance(std::uint32_t instance);
+    void rebuildTLAS(ThreadPool* pool);
+    // Recomputes the bounds bottom-up and returns the range of nodes that changed.
+    void refitTLAS(std::uint32_t& firstNode, std::uint32_t& lastNode);
 
 public:
     AccelerationStructures();
     ~AccelerationStructures();
 
-    void addBLAS(const std::vector<float>& triangles);
-    void buildTLAS();
+    // Sizes the flat BLAS buffers for that much more geometry, so meshes added in several
+    // batches are written in place instead of the buffers growing (and copying) per batch.
+    void reserveBLAS(std::size_t triangles, std::size_t vertices);
+    // Both return BLAS ids in order, starting at the current BLAS count. Every mesh is
+    // released as soon as it is written to the flat buffers.
+    std::uint32_t addBLAS(const Mesh& mesh);
+    // Builds one BLAS per mesh on the pool, each with its mesh's options, and returns per-mesh
+    // build statistics.
+    std::vector<BuildStats> addBLASBatch(std::vector<Mesh> meshes, ThreadPool& pool);
+    std::uint32_t addInstance(std::uint32_t blas, const std::array<float, 12>& transform = IDENTITY_TRANSFORM);
+    // Builds the TLAS over the instances; without any, every BLAS is placed once untransformed.
+    // Calling it again rebuilds from scratch over the current instances and BLASes.
+    void buildTLAS(ThreadPool* pool = nullptr);
+    // Used by every later TLAS build, including the rebuilds of updateTLAS. SBVH does not
+    // apply to instances and builds with SweepSah instead.
+    void setTlasBuildOptions(const BuildOptions& options) { m_tlasOptions = options; }
+    const BuildOptions& getTlasBuildOptions() const { return m_tlasOptions; }
+    // Stats of the last TLAS build; a refit does not change them.
+    const BuildStats& getTlasBuildStats() const { return m_tlasBuildStats; }
+
+    // Moves an instance; the change is applied by the next updateTLAS.
+    void setInstanceTransform(std::uint32_t instance, const std::array<float, 12>& transform);
+    // Refits the TLAS to the moved instances, or rebuilds it when the refit degraded the
+    // tree too far or instances were added. Buffer views may move on a rebuild, so CPU
+    // tracers have to be recreated afterwards; the returned ranges are what a GPU copy
+    // needs to reupload.
+    TlasUpdate updateTLAS(ThreadPool* pool = nullptr);
+
+    // A triangle with MATERIAL_EMISSIVE as placed by one instance; slot is its global
+    // BlasTriangle/BlasMaterial slot and area its world space area.
+    struct EmissiveTriangle {
+        std::uint32_t instance;
+        std::uint32_t slot;
+        float         area;
+    };
+
+    // Read from the buffers, so it works on a mapped cache too. Areas are those of the current transforms.
+    std::vector<EmissiveTriangle> getEmissiveTriangles() const;
+
+    // Normalized SAH cost of a tree, relative to its root's surface area.
+    static float computeSahCost(const bvh::Bvh<float>& tree);
+
+    // The cache stores every flattened buffer; once loaded, the views point
+    // straight into the mapped file and the build-time BVHs stay empty. BLASes
+    // added afterwards first copy the mapped BLAS buffers into memory.
+    bool saveCache(const std::string& path, std::uint64_t sourceHash) const;
+    bool loadCache(const std::string& path, std::uint64_t sourceHash);
 
     const BVH& getTLAS()              const { return m_tlas; }
     const std::vector<BVH>& getBLAS() const { return m_blas; }
+    const std::vector<Instance>& getInstances() const { return m_instances; }
+
+    const BufferView& getTlasBlasNodeOffsets() const { return getBuffer(Buffer::TlasBlasNodeOffset); }
+    const BufferView& getTlasBlasGeometryOffsets() const { return getBuffer(Buffer::TlasBlasGeometryOffset); }
 
-    const std::vector<std::uint32_t>& getTlasBlasNodeOffsets() const { return m_tlasBlasNodeOffsets; }
-    const std::vector<std::uint32_t>& getTlasBlasGeometryOffsets() const { return m_tlasBlasGeometryOffsets; }
+    const BufferView& getBuffer(Buffer buffer) const { return m_buffers[static_cast<std::uint32_t>(buffer)]; }
 };
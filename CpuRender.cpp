@@ -0,0 +1,506 @@
+#include "CpuRender.hpp"
+#include "SceneLoader.hpp"
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+namespace {
+    constexpr float M_PI_F = 3.141592653f;
+    // The connect segment stops short of the light point, as in extend.glsl.
+    constexpr float SHADOW_RAY_END = 1.0f - 1e-3f;
+
+    float intBitsToFloat(std::int32_t value) {
+        float result;
+        std::memcpy(&result, &value, sizeof(result));
+        return result;
+    }
+
+    std::int32_t floatBitsToInt(float value) {
+        std::int32_t result;
+        std::memcpy(&result, &value, sizeof(result));
+        return result;
+    }
+
+    float uintBitsToFloat(std::uint32_t value) {
+        float result;
+        std::memcpy(&result, &value, sizeof(result));
+        return result;
+    }
+
+    std::uint32_t floatBitsToUint(float value) {
+        std::uint32_t result;
+        std::memcpy(&result, &value, sizeof(result));
+        return result;
+    }
+
+    float fract(float x) {
+        return x - std::floor(x);
+    }
+
+    float rand(float n) {
+        return fract(std::sin(n) * 43758.5453123f);
+    }
+
+    glm::vec3 reflect(const glm::vec3& i, const glm::vec3& n) {
+        return i - 2.0f * glm::dot(n, i) * n;
+    }
+
+    glm::vec3 getPerpendicularVector(const glm::vec3& u) {
+        glm::vec3 a = glm::abs(u);
+        std::uint32_t xm = ((a.x - a.y) < 0 && (a.x - a.z) < 0) ? 1 : 0;
+        std::uint32_t ym = (a.y - a.z) < 0 ? (1 ^ xm) : 0;
+        std::uint32_t zm = 1 ^ (xm | ym);
+        return glm::cross(u, glm::vec3(float(xm), float(ym), float(zm)));
+    }
+
+    std::uint32_t pcgHash(std::uint32_t value) {
+        std::uint32_t state = value * 747796405u + 2891336453u;
+        std::uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+        return (word >> 22u) ^ word;
+    }
+
+    // getSeed of shade.glsl; every CPU frame is a first frame, as nothing accumulates.
+    float getSeed(std::uint32_t pixel, std::uint32_t iteration) {
+        const std::uint32_t frame = 0;
+        return float(pcgHash(pixel + pcgHash(iteration + pcgHash(frame))) >> 8) / 16777216.0f;
+    }
+
+    float ggxNormalDistribution(float NdotH, float roughness) {
+        float a2 = roughness * roughness;
+        float d = (NdotH * a2 - NdotH) * NdotH + 1.0f;
+        return a2 / (d * d * M_PI_F);
+    }
+
+    float schlickMaskingTerm(float NdotL, float NdotV, float roughness) {
+        float k = roughness * roughness / 2.0f;
+
+        float g_v = NdotV / (NdotV * (1.0f - k) + k);
+        float g_l = NdotL / (NdotL * (1.0f - k) + k);
+        return g_v * g_l;
+    }
+
+    glm::vec3 getGGXMicrofacet(float roughness, const glm::vec3& hitNorm, float seed) {
+        glm::vec2 randVal = glm::vec2(rand(seed + 0.1f), rand(seed + 0.2f));
+
+        glm::vec3 B = getPerpendicularVector(hitNorm);
+        glm::vec3 T = glm::cross(B, hitNorm);
+
+        float a2 = roughness * roughness;
+        float cosThetaH = std::sqrt(std::max(0.0f, (1.0f - randVal.x) / ((a2 - 1.0f) * randVal.x + 1.0f)));
+        float sinThetaH = std::sqrt(std::max(0.0f, 1.0f - cosThetaH * cosThetaH));
+        float phiH = randVal.y * M_PI_F * 2.0f;
+
+        return T * (sinThetaH * std::cos(phiH)) +
+               B * (sinThetaH * std::sin(phiH)) +
+               hitNorm * cosThetaH;
+    }
+}
+
+CpuRender::CpuRender(std::uint32_t width, std::uint32_t height, ThreadPool& pool, const Settings& settings) :
+    m_width(width),
+    m_height(height),
+    m_timer(0.0f),
+    m_settings(settings),
+    m_pool(pool),
+    m_sorter(pool),
+    m_viewInv(glm::inverse(glm::lookAt(glm::vec3(0.0f, 10.0f, 50.0f), glm::vec3(0.0f, 10.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f)))),
+    m_lightArea(0.0f),
+    m_counter(0),
+    m_shadowCounter(0),
+    m_shadowRayCount(0),
+    m_rayBufferRead(2 * width * height),
+    m_rayBufferWrite(2 * width * height),
+    m_intersectionBuffer(width * height),
+    m_shadowRays(m_settings.nextEventEstimation ? 2 * width * height : 0),
+    m_outColor(width * height, glm::vec4(0.0f))
+{
+    SceneLoader sceneLoader;
+    sceneLoader.setBuildOptions(m_settings.blasBuild);
+    m_accels.setTlasBuildOptions(m_settings.tlasBuild);
+    sceneLoader.load("sponza.obj", m_accels, m_pool);
+
+    m_tracer.emplace(m_accels, m_settings.layout, m_settings.traversal);
+    m_packetTracer.emplace(*m_tracer);
+
+    if (m_settings.nextEventEstimation) {
+        m_lights = m_accels.getEmissiveTriangles();
+        for (const auto& light : m_lights) {
+            m_lightArea += light.area;
+        }
+        float areaSum = 0.0f;
+        for (std::uint32_t i = 0; i < m_lights.size(); i++) {
+            areaSum += m_lights[i].area;
+            m_lightCdf.push_back(i + 1 == m_lights.size() ? 1.0f : areaSum / m_lightArea);
+        }
+    }
+}
+
+std::uint32_t CpuRender::generate(const Tile& tile) {
+    glm::vec4 origin = m_viewInv * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+
+    m_pool.parallelFor(tile.y, tile.y + tile.height, 1, [&](std::uint32_t rowBegin, std::uint32_t rowEnd) {
+        for (std::uint32_t y = rowBegin; y < rowEnd; y++) {
+            std::uint32_t offset = (y - tile.y) * tile.width;
+
+            for (std::uint32_t x = tile.x; x < tile.x + tile.width; x++) {
+                glm::vec2 xy = glm::vec2(2.0f * float(x * 2.0f - m_width) / float(m_width), 2.0f * float(y * 2.0f - m_height) / float(m_height));
+                xy.x *= float(m_width) / float(m_height);
+
+                glm::vec4 rayOrigin = origin;
+                glm::vec4 dir = m_viewInv * glm::vec4(glm::normalize(glm::vec3(xy.x, xy.y, -5.0f)), 0.0f);
+
+                rayOrigin.w = intBitsToFloat(x);
+                dir.w = intBitsToFloat(y);
+
+                m_rayBufferWrite[(offset + x - tile.x) * 2 + 0] = rayOrigin;
+                m_rayBufferWrite[(offset + x - tile.x) * 2 + 1] = dir;
+            }
+        }
+    });
+
+    return tile.width * tile.height;
+}
+
+void CpuRender::sortRays(std::uint32_t rayBufferSize) {
+    // The root of the split TLAS layout bounds the whole scene.
+    const float* root = m_accels.getBuffer(AccelerationStructures::Buffer::TlasAABB).as<float>();
+    m_sorter.sort(m_rayBufferWrite, rayBufferSize, glm::vec3(root[0], root[1], root[2]), glm::vec3(root[4], root[5], root[6]));
+}
+
+void CpuRender::extend(std::uint32_t rayBufferSize) {
+    std::uint32_t workgroupSizeX = 64;
+
+    std::swap(m_rayBufferRead, m_rayBufferWrite);
+
+    m_pool.parallelFor(0, rayBufferSize, workgroupSizeX, [&](std::uint32_t begin, std::uint32_t end) {
+        for (std::uint32_t rayId = begin; rayId < end; rayId++) {
+            CpuTracer::Ray ray;
+            ray.origin = glm::vec3(m_rayBufferRead[rayId * 2 + 0]);
+            ray.dir    = glm::vec3(m_rayBufferRead[rayId * 2 + 1]);
+            ray.invDir = CpuTracer::safeInvDir(ray.dir);
+
+            CpuTracer::Intersection isec = m_tracer->intersect(ray);
+
+            m_intersectionBuffer[rayId] = glm::vec4(uintBitsToFloat(isec.tlasPrimitiveSlot), uintBitsToFloat(isec.blasPrimitiveSlot), isec.barycentric.x, isec.barycentric.y);
+        }
+    });
+}
+
+void CpuRender::extendPackets(const Tile& tile) {
+    constexpr std::uint32_t PACKET_WIDTH = PacketTracer::PACKET_WIDTH;
+
+    std::swap(m_rayBufferRead, m_rayBufferWrite);
+
+    std::uint32_t packetsX = (tile.width + PACKET_WIDTH - 1) / PACKET_WIDTH;
+    std::uint32_t packetsY = (tile.height + PACKET_WIDTH - 1) / PACKET_WIDTH;
+
+    m_pool.parallelFor(0, packetsX * packetsY, 16, [&](std::uint32_t begin, std::uint32_t end) {
+        CpuTracer::Ray rays[PacketTracer::PACKET_SIZE];
+        CpuTracer::Intersection isecs[PacketTracer::PACKET_SIZE];
+        std::uint32_t rayIds[PacketTracer::PACKET_SIZE];
+
+        for (std::uint32_t packet = begin; packet < end; packet++) {
+            std::uint32_t packetX = packet % packetsX * PACKET_WIDTH;
+            std::uint32_t packetY = packet / packetsX * PACKET_WIDTH;
+
+            std::uint32_t count = 0;
+            for (std::uint32_t y = packetY; y < std::min(packetY + PACKET_WIDTH, tile.height); y++) {
+                for (std::uint32_t x = packetX; x < std::min(packetX + PACKET_WIDTH, tile.width); x++) {
+                    std::uint32_t rayId = y * tile.width + x;
+                    rays[count].origin = glm::vec3(m_rayBufferRead[rayId * 2 + 0]);
+                    rays[count].dir    = glm::vec3(m_rayBufferRead[rayId * 2 + 1]);
+                    rays[count].invDir = CpuTracer::safeInvDir(rays[count].dir);
+                    rayIds[count++] = rayId;
+                }
+            }
+
+            m_packetTracer->intersect(rays, count, isecs);
+
+            for (std::uint32_t i = 0; i < count; i++) {
+                const CpuTracer::Intersection& isec = isecs[i];
+                m_intersectionBuffer[rayIds[i]] = glm::vec4(uintBitsToFloat(isec.tlasPrimitiveSlot), uintBitsToFloat(isec.blasPrimitiveSlot), isec.barycentric.x, isec.barycentric.y);
+            }
+        }
+    });
+}
+
+std::uint32_t CpuRender::shade(std::uint32_t rayBufferSize, std::uint32_t iteration) {
+    std::uint32_t workgroupSizeX = 64;
+
+    m_counter = 0;
+    m_shadowCounter = 0;
+
+    const CpuTracer::Buffers& buffers = m_tracer->getBuffers();
+
+    m_pool.parallelFor(0, rayBufferSize, workgroupSizeX, [&](std::uint32_t begin, std::uint32_t end) {
+        std::vector<glm::vec4> nextRays;
+        nextRays.reserve(2 * (end - begin));
+        std::vector<glm::vec4> shadowRays;
+
+        for (std::uint32_t rayId = begin; rayId < end; rayId++) {
+            glm::vec4 rayData1 = m_rayBufferRead[rayId * 2 + 0];
+            glm::vec4 rayData2 = m_rayBufferRead[rayId * 2 + 1];
+
+            std::int32_t x = floatBitsToInt(rayData1.w);
+            std::int32_t y = floatBitsToInt(rayData2.w);
+
+            glm::vec4 isecData = m_intersectionBuffer[rayId];
+            CpuTracer::Intersection isec;
+            isec.tlasPrimitiveSlot = floatBitsToUint(isecData.x);
+            isec.blasPrimitiveSlot = floatBitsToUint(isecData.y);
+            isec.barycentric = glm::vec2(isecData.z, isecData.w);
+
+            float light = 0.0f;
+            if (isec.tlasPrimitiveSlot != CpuTracer::NULL_NODE && isec.blasPrimitiveSlot != CpuTracer::NULL_NODE) {
+                std::uint32_t tlasIndex = buffers.tlasPrimitives[isec.tlasPrimitiveSlot];
+                std::uint32_t blasGeometryOffset = buffers.tlasBlasGeometryOffsets[buffers.tlasInstanceBlas[tlasIndex]];
+                std::uint32_t slot = blasGeometryOffset + isec.blasPrimitiveSlot;
+
+                auto normalOf = [&](std::uint32_t corner) {
+                    const float* data = &buffers.blasNormals[std::size_t(buffers.blasIndices[std::size_t(slot) * 3 + corner]) * 3];
+                    return glm::vec3(data[0], data[1], data[2]);
+                };
+                auto triangle = [&](std::uint32_t row) {
+                    const float* data = &buffers.blasTriangles[(std::size_t(slot) * 3 + row) * 4];
+                    return glm::vec3(data[0], data[1], data[2]);
+                };
+
+                bool emissive = (buffers.blasMaterials[slot] & AccelerationStructures::MATERIAL_EMISSIVE) != 0;
+
+                float w = 1.0f - isec.barycentric.x - isec.barycentric.y;
+                glm::vec3 objectNormal = w * normalOf(0) + isec.barycentric.x * normalOf(1) + isec.barycentric.y * normalOf(2);
+                glm::vec3 objectPos = triangle(0) + isec.barycentric.x * triangle(1) + isec.barycentric.y * triangle(2);
+
+                // Positions go through the object to world matrix, normals through the transposed world to object one.
+                const float* objectToWorld = &buffers.tlasObjectToWorld[tlasIndex * 12];
+                const float* worldToObject = &buffers.tlasWorldToObject[tlasIndex * 12];
+                glm::vec3 pos, normal;
+                for (std::uint32_t i = 0; i < 3; i++) {
+                    pos[i] = objectToWorld[i * 4 + 0] * objectPos.x + objectToWorld[i * 4 + 1] * objectPos.y + objectToWorld[i * 4 + 2] * objectPos.z + objectToWorld[i * 4 + 3];
+                    normal[i] = worldToObject[0 * 4 + i] * objectNormal.x + worldToObject[1 * 4 + i] * objectNormal.y + worldToObject[2 * 4 + i] * objectNormal.z;
+                }
+                normal = glm::normalize(normal);
+
+                if (emissive) {
+                    light = 1.0f;
+                } else {
+                    float seed = getSeed(y * m_width + x, iteration);
+                    glm::vec3 newRayDirection = reflect(glm::vec3(rayData2), getGGXMicrofacet(0.1f, normal, seed));
+
+                    glm::vec3 newOrigin = pos + normal * 0.001f;
+                    if (m_settings.nextEventEstimation) {
+                        connectLight(newOrigin, normal, glm::vec3(rayData2), 0.1f, x, y, seed, shadowRays);
+                    }
+                    rayData1 = glm::vec4(newOrigin, rayData1.w);
+                    rayData2 = glm::vec4(newRayDirection, rayData2.w);
+
+                    nextRays.push_back(rayData1);
+                    nextRays.push_back(rayData2);
+                }
+            }
+
+            // Direct light after the first hit comes from connect, so bounces hitting a light add
+            // nothing and must not overwrite what connect added.
+            if (!m_settings.nextEventEstimation || iteration == 0) {
+                m_outColor[y * m_width + x] = glm::vec4(light, light, light, 1.0f);
+            }
+        }
+
+        std::uint32_t offset = m_counter.fetch_add(nextRays.size() / 2);
+        std::copy(nextRays.begin(), nextRays.end(), m_rayBufferWrite.begin() + offset * 2);
+
+        std::uint32_t shadowOffset = m_shadowCounter.fetch_add(shadowRays.size() / 2);
+        std::copy(shadowRays.begin(), shadowRays.end(), m_shadowRays.begin() + shadowOffset * 2);
+    });
+
+    return m_counter;
+}
+
+void CpuRender::connectLight(const glm::vec3& origin, const glm::vec3& normal, const glm::vec3& viewDir, float roughness,
+                             std::uint32_t x, std::uint32_t y, float seed, std::vector<glm::vec4>& shadowRays) const {
+    if (m_lights.empty()) {
+        return;
+    }
+
+    const CpuTracer::Buffers& buffers = m_tracer->getBuffers();
+
+    float u = rand(seed + 0.3f);
+    const AccelerationStructures::EmissiveTriangle& light = m_lights[std::min<std::size_t>(std::lower_bound(m_lightCdf.begin(), m_lightCdf.end(), u) - m_lightCdf.begin(), m_lights.size() - 1)];
+
+    glm::vec2 randVal = glm::vec2(rand(seed + 0.4f), rand(seed + 0.5f));
+    float sqrtX = std::sqrt(randVal.x);
+    glm::vec2 barycentric = glm::vec2(sqrtX * (1.0f - randVal.y), sqrtX * randVal.y);
+
+    auto triangle = [&](std::uint32_t row) {
+        const float* data = &buffers.blasTriangles[(std::size_t(light.slot) * 3 + row) * 4];
+        return glm::vec3(data[0], data[1], data[2]);
+    };
+    glm::vec3 objectPos = triangle(0) + barycentric.x * triangle(1) + barycentric.y * triangle(2);
+    glm::vec3 e1 = triangle(1);
+    glm::vec3 e2 = triangle(2);
+
+    const float* objectToWorld = &buffers.tlasObjectToWorld[light.instance * 12];
+    glm::vec3 lightPos, worldE1, worldE2;
+    for (std::uint32_t i = 0; i < 3; i++) {
+        const float* row = &objectToWorld[i * 4];
+        lightPos[i] = row[0] * objectPos.x + row[1] * objectPos.y + row[2] * objectPos.z + row[3];
+        worldE1[i] = row[0] * e1.x + row[1] * e1.y + row[2] * e1.z;
+        worldE2[i] = row[0] * e2.x + row[1] * e2.y + row[2] * e2.z;
+    }
+    glm::vec3 lightNormal = glm::normalize(glm::cross(worldE1, worldE2));
+
+    glm::vec3 toLight = lightPos - origin;
+    float dist2 = glm::dot(toLight, toLight);
+    glm::vec3 L = toLight / std::sqrt(dist2);
+    glm::vec3 V = -glm::normalize(viewDir);
+    float NdotL = glm::dot(normal, L);
+    float NdotV = glm::dot(normal, V);
+    float cosLight = std::abs(glm::dot(lightNormal, L));
+    if (NdotL <= 0.0f || NdotV <= 0.0f || cosLight <= 0.0f) {
+        return;
+    }
+
+    float NdotH = std::max(glm::dot(normal, glm::normalize(L + V)), 0.0f);
+    float brdfCos = ggxNormalDistribution(NdotH, roughness) * schlickMaskingTerm(NdotL, NdotV, roughness) / (4.0f * NdotV);
+    float radiance = brdfCos * cosLight * m_lightArea / dist2;
+
+    shadowRays.push_back(glm::vec4(origin, uintBitsToFloat(x | (y << 16))));
+    shadowRays.push_back(glm::vec4(toLight, radiance));
+}
+
+void CpuRender::connect(std::uint32_t shadowRayCount) {
+    std::uint32_t workgroupSizeX = 64;
+
+    m_pool.parallelFor(0, shadowRayCount, workgroupSizeX, [&](std::uint32_t begin, std::uint32_t end) {
+        for (std::uint32_t rayId = begin; rayId < end; rayId++) {
+            glm::vec4 rayData1 = m_shadowRays[rayId * 2 + 0];
+            glm::vec4 rayData2 = m_shadowRays[rayId * 2 + 1];
+
+            CpuTracer::Ray ray;
+            ray.origin = glm::vec3(rayData1);
+            ray.dir    = glm::vec3(rayData2);
+            ray.invDir = CpuTracer::safeInvDir(ray.dir);
+
+            if (!m_tracer->occluded(ray, SHADOW_RAY_END)) {
+                // Every pixel casts at most one shadow ray per bounce, so no other thread touches it.
+                std::uint32_t pixel = floatBitsToUint(rayData1.w);
+                glm::vec4& color = m_outColor[(pixel >> 16) * m_width + (pixel & 0xFFFFu)];
+                color = glm::vec4(glm::vec3(color) + glm::vec3(rayData2.w), 1.0f);
+            }
+        }
+    });
+}
+
+float CpuRender::measureCoherence(std::uint32_t rayBufferSize) const {
+    if (rayBufferSize < 2) {
+        return 1.0f;
+    }
+
+    std::atomic<std::uint32_t> coherentPairs(0);
+    m_pool.parallelFor(0, rayBufferSize - 1, 1 << 16, [&](std::uint32_t begin, std::uint32_t end) {
+        std::uint32_t localPairs = 0;
+        for (std::uint32_t rayId = begin; rayId < end; rayId++) {
+            const glm::vec4& a = m_intersectionBuffer[rayId];
+            const glm::vec4& b = m_intersectionBuffer[rayId + 1];
+            if (floatBitsToUint(a.x) == floatBitsToUint(b.x) &&
+                (floatBitsToUint(a.y) >> COHERENCE_SLOT_SHIFT) == (floatBitsToUint(b.y) >> COHERENCE_SLOT_SHIFT)) {
+                localPairs++;
+            }
+        }
+        coherentPairs += localPairs;
+    });
+
+    return float(coherentPairs) / float(rayBufferSize - 1);
+}
+
+std::uint32_t CpuRender::renderTile(const Tile& tile) {
+    std::uint32_t rays = generate(tile);
+    m_shadowRayCount = 0;
+
+    for (std::uint32_t i = 0; i < BOUNCES; i++) {
+        auto start = std::chrono::steady_clock::now();
+        bool sorted = m_settings.sortRays && i >= m_settings.sortFromBounce;
+        if (sorted) {
+            sortRays(rays);
+        }
+        auto sortEnd = std::chrono::steady_clock::now();
+
+        if (m_settings.packets && i == 0 && !sorted) {
+            extendPackets(tile);
+        } else {
+            extend(rays);
+        }
+        auto extendEnd = std::chrono::steady_clock::now();
+
+        if (m_settings.rayStats) {
+            double sortMs = std::chrono::duration<double, std::milli>(sortEnd - start).count();
+            double extendMs = std::chrono::duration<double, std::milli>(extendEnd - sortEnd).count();
+            std::cout << "bounce " << i << ": " << rays << " rays" << (sorted ? ", sort " : ", unsorted")
+                      << (sorted ? std::to_string(sortMs) + " ms" : std::string())
+                      << ", extend " << extendMs << " ms (" << rays / std::max(extendMs, 1e-3) / 1e3 << " Mrays/s)"
+                      << ", coherence " << measureCoherence(rays) * 100.0f << "%" << std::endl;
+        }
+
+        rays = shade(rays, i);
+
+        if (m_settings.nextEventEstimation) {
+            m_shadowRayCount += m_shadowCounter;
+            connect(m_shadowCounter);
+        }
+    }
+
+    return rays;
+}
+
+void CpuRender::render(float delta) {
+    m_timer += delta;
+
+    std::uint32_t rays = renderTile({0, 0, m_width, m_height});
+
+    std::cout << delta << "; " << rays;
+    if (m_settings.nextEventEstimation) {
+        std::cout << "; " << m_shadowRayCount << " shadow rays";
+    }
+    std::cout << std::endl;
+}
+
+bool CpuRender::writeImage(const std::string& path) const {
+    return writeImage(path, m_width, m_height, m_outColor);
+}
+
+bool CpuRender::writeImage(const std::string& path, std::uint32_t width, std::uint32_t height, const std::vector<glm::vec4>& colors) {
+    std::ofstream output(path, std::ios::binary);
+    if (!output) {
+        return false;
+    }
+
+    bool pfm = path.size() >= 4 && path.compare(path.size() - 4, 4, ".pfm") == 0;
+    if (pfm) {
+        // PFM stores rows bottom to top, same as the GL texture.
+        output << "PF\n" << width << " " << height << "\n-1.0\n";
+        for (const auto& color : colors) {
+            float rgb[3] = {color.x, color.y, color.z};
+            output.write(reinterpret_cast<const char*>(rgb), sizeof(rgb));
+        }
+    } else {
+        output << "P6\n" << width << " " << height << "\n255\n";
+        for (std::uint32_t y = height; y-- > 0;) {
+            for (std::uint32_t x = 0; x < width; x++) {
+                const glm::vec4& color = colors[y * width + x];
+                unsigned char rgb[3];
+                for (int c = 0; c < 3; c++) {
+                    rgb[c] = static_cast<unsigned char>(std::clamp(color[c], 0.0f, 1.0f) * 255.0f + 0.5f);
+                }
+                output.write(reinterpret_cast<const char*>(rgb), sizeof(rgb));
+            }
+        }
+    }
+
+    return bool(output);
+}
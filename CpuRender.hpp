@@ -0,0 +1,111 @@
+#pragma once
+
+#include "AccelerationStructures.hpp"
+#include "CpuTracer.hpp"
+#include "PacketTracer.hpp"
+#include "RaySorter.hpp"
+#include "ThreadPool.hpp"
+
+#include <glm/glm.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Headless mirror of Render: the generate/extend/shade stages of the GL compute
+// programs, run over the same ray buffer layout on a ThreadPool.
+class CpuRender {
+public:
+    struct Settings {
+        CpuTracer::NodeLayout layout    = CpuTracer::NodeLayout::Split;
+        CpuTracer::Traversal  traversal = CpuTracer::Traversal::Stack;
+        AccelerationStructures::BuildOptions blasBuild;
+        AccelerationStructures::BuildOptions tlasBuild;
+        // Sorts the ray buffer before every extend from this bounce on (see RaySorter).
+        bool          sortRays       = false;
+        std::uint32_t sortFromBounce = 1;
+        // Prints per-bounce sort and extend times and the hit coherence of the ray order.
+        bool          rayStats       = false;
+        // Traces the camera rays as PacketTracer packets instead of one by one.
+        bool          packets        = false;
+        // Samples the emissive triangles at every hit and traces shadow rays to them (see
+        // connect), like the GL renderer's default.
+        bool          nextEventEstimation = true;
+    };
+
+    // Extend/shade rounds per frame, shared with Render so both renderers trace the same paths.
+    static constexpr std::uint32_t BOUNCES = 2;
+
+    // Fraction of neighbouring rays that miss together or hit the same instance within
+    // the same block of leaf slots, which roughly means sharing the same BVH subtree.
+    static constexpr std::uint32_t COHERENCE_SLOT_SHIFT = 6;
+
+    // Pixel rectangle traced by one renderTile call. The random seeds depend only on the
+    // pixel, so a frame rendered tile by tile matches one rendered whole.
+    struct Tile {
+        std::uint32_t x;
+        std::uint32_t y;
+        std::uint32_t width;
+        std::uint32_t height;
+    };
+
+private:
+    std::uint32_t m_width;
+    std::uint32_t m_height;
+
+    float m_timer;
+
+    Settings    m_settings;
+    ThreadPool& m_pool;
+    RaySorter   m_sorter;
+
+    AccelerationStructures   m_accels;
+    std::optional<CpuTracer>    m_tracer;
+    std::optional<PacketTracer> m_packetTracer;
+    glm::mat4                m_viewInv;
+
+    // The light cdf of the GL renderer, over the same getEmissiveTriangles order.
+    std::vector<AccelerationStructures::EmissiveTriangle> m_lights;
+    std::vector<float>                                    m_lightCdf;
+    float                                                 m_lightArea;
+
+    std::atomic<std::uint32_t> m_counter;
+    std::atomic<std::uint32_t> m_shadowCounter;
+    std::uint32_t              m_shadowRayCount;
+    std::vector<glm::vec4>     m_rayBufferRead;
+    std::vector<glm::vec4>     m_rayBufferWrite;
+    std::vector<glm::vec4>     m_intersectionBuffer;
+    std::vector<glm::vec4>     m_shadowRays;
+    std::vector<glm::vec4>     m_outColor;
+
+    // Appends a shadow ray to a light sample, see connectLight in shade.glsl.
+    void connectLight(const glm::vec3& origin, const glm::vec3& normal, const glm::vec3& viewDir, float roughness,
+                      std::uint32_t x, std::uint32_t y, float seed, std::vector<glm::vec4>& shadowRays) const;
+
+public:
+    CpuRender(std::uint32_t width, std::uint32_t height, ThreadPool& pool, const Settings& settings);
+
+    // Camera rays in scanline order within the tile.
+    std::uint32_t generate(const Tile& tile);
+    void sortRays(std::uint32_t rayBufferSize);
+    void extend(std::uint32_t rayBufferSize);
+    // extend for the rays of generate, traced in PacketTracer::PACKET_WIDTH square blocks.
+    void extendPackets(const Tile& tile);
+    float measureCoherence(std::uint32_t rayBufferSize) const;
+    std::uint32_t shade(std::uint32_t rayBufferSize, std::uint32_t iteration);
+    // Traces the shadow rays of the last shade and adds the light of the unoccluded ones.
+    void connect(std::uint32_t shadowRayCount);
+    // Traces the tile's pixels and returns the rays left after the last bounce.
+    std::uint32_t renderTile(const Tile& tile);
+    void render(float delta);
+
+    std::uint32_t getWidth() const { return m_width; }
+    std::uint32_t getHeight() const { return m_height; }
+    const std::vector<glm::vec4>& getColors() const { return m_outColor; }
+
+    // Writes the color buffer as binary PPM, or as PFM when the path ends in ".pfm".
+    bool writeImage(const std::string& path) const;
+    static bool writeImage(const std::string& path, std::uint32_t width, std::uint32_t height, const std::vector<glm::vec4>& colors);
+};
@@ -0,0 +1,470 @@
+#include "CpuTracer.hpp"
+#include "WideBvh.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace {
+    glm::vec3 loadVec3(const float* buffer, std::uint32_t vec4Index) {
+        const float* data = &buffer[vec4Index * 4];
+        return glm::vec3(data[0], data[1], data[2]);
+    }
+
+    glm::vec2 aabbIntersect(const CpuTracer::Ray& ray, const glm::vec3& boxMin, const glm::vec3& boxMax) {
+        glm::vec3 tMin = (boxMin - ray.origin) * ray.invDir;
+        glm::vec3 tMax = (boxMax - ray.origin) * ray.invDir;
+        glm::vec3 t1 = glm::min(tMin, tMax);
+        glm::vec3 t2 = glm::max(tMin, tMax);
+        float tNear = std::max(std::max(t1.x, t1.y), t1.z);
+        float tFar = std::min(std::min(t2.x, t2.y), t2.z);
+        return glm::vec2(tNear, tFar);
+    }
+
+    void triIntersect(const CpuTracer::Ray& ray, const glm::vec3& v0, const glm::vec3& v1v0, const glm::vec3& v2v0, CpuTracer::Intersection& isec) {
+        glm::vec3 rov0 = ray.origin - v0;
+
+        glm::vec3 n = glm::cross(v1v0, v2v0);
+        glm::vec3 q = glm::cross(rov0, ray.dir);
+        float d = 1.0f / glm::dot(ray.dir, n);
+        float u = d * glm::dot(-q, v2v0);
+        float v = d * glm::dot( q, v1v0);
+        float t = d * glm::dot(-n, rov0);
+
+        if (u < 0.0f || v < 0.0f || (u + v) > 1.0f) t = -1.0f;
+
+        isec.dist = t;
+        isec.barycentric = glm::vec2(u, v);
+    }
+
+    // Slot count of a split layout leaf, kept as uint bits in the max.w of its box.
+    std::uint32_t leafCount(const float* aabbs, std::uint32_t node) {
+        std::uint32_t count;
+        std::memcpy(&count, &aabbs[node * 8 + 7], sizeof(count));
+        return count;
+    }
+
+    // C++ counterpart of INTERSECT_SLOTS in extend.glsl. Returns true when an any-hit
+    // traversal found its hit and has to stop, like ANY_HIT_RETURN.
+    template <typename LeafFunction>
+    bool intersectSlots(std::uint32_t first, std::uint32_t count, std::uint32_t CpuTracer::Intersection::* outChild,
+                        CpuTracer::Intersection& isec, bool anyHit, const LeafFunction& intersectLeaf) {
+        for (std::uint32_t i = 0; i < count; i++) {
+            CpuTracer::Intersection newIsec = isec;
+            intersectLeaf(first + i, newIsec);
+            if (newIsec.dist >= 0 && newIsec.dist < isec.dist) {
+                isec = newIsec;
+                isec.*outChild = first + i;
+                if (anyHit) return true;
+            }
+        }
+        return false;
+    }
+
+    // C++ counterpart of DECLARE_BVH_TRAVERSAL in extend.glsl, kept step for step
+    // identical so the CPU backend can serve as a reference for the GL one.
+    template <typename LeafFunction>
+    void traverse(const CpuTracer::Ray& ray,
+                  const std::uint32_t* children,
+                  const float* aabbs,
+                  const std::uint32_t* leafs,
+                  std::uint32_t nodeOffset,
+                  std::uint32_t CpuTracer::Intersection::* outChild,
+                  CpuTracer::Intersection& isec,
+                  bool anyHit,
+                  const LeafFunction& intersectLeaf) {
+        constexpr std::uint32_t NULL_NODE = CpuTracer::NULL_NODE;
+
+        if (leafs[nodeOffset] > 0) {
+            intersectSlots(children[nodeOffset], leafCount(aabbs, nodeOffset), outChild, isec, anyHit, intersectLeaf);
+            return;
+        }
+
+        std::uint32_t stack[32];
+        std::uint32_t stackIt = 0;
+        stack[stackIt++] = NULL_NODE;
+
+        std::uint32_t leftChild = children[nodeOffset];
+        while (leftChild != NULL_NODE) {
+            std::uint32_t rightChild = leftChild + 1;
+
+            glm::vec2 distLeft  = aabbIntersect(ray, loadVec3(aabbs, (nodeOffset + leftChild) * 2 + 0), loadVec3(aabbs, (nodeOffset + leftChild) * 2 + 1));
+            glm::vec2 distRight = aabbIntersect(ray, loadVec3(aabbs, (nodeOffset + rightChild) * 2 + 0), loadVec3(aabbs, (nodeOffset + rightChild) * 2 + 1));
+
+            if (distLeft.x <= std::min(distLeft.y, isec.dist) && distLeft.y >= 0.0f) {
+                if (leafs[nodeOffset + leftChild] > 0) {
+                    if (intersectSlots(children[nodeOffset + leftChild], leafCount(aabbs, nodeOffset + leftChild), outChild, isec, anyHit, intersectLeaf)) return;
+                    leftChild = NULL_NODE;
+                }
+            } else leftChild = NULL_NODE;
+
+            if (distRight.x <= std::min(distRight.y, isec.dist) && distRight.y >= 0.0f) {
+                if (leafs[nodeOffset + rightChild] > 0) {
+                    if (intersectSlots(children[nodeOffset + rightChild], leafCount(aabbs, nodeOffset + rightChild), outChild, isec, anyHit, intersectLeaf)) return;
+                    rightChild = NULL_NODE;
+                }
+            } else rightChild = NULL_NODE;
+
+            if (leftChild != NULL_NODE) {
+                if (rightChild != NULL_NODE) {
+                    if (distLeft.x > distRight.x) std::swap(leftChild, rightChild);
+                    if (stackIt == 32) break;
+                    stack[stackIt++] = children[nodeOffset + rightChild];
+                }
+                leftChild = children[nodeOffset + leftChild];
+            } else if (rightChild != NULL_NODE) {
+                leftChild = children[nodeOffset + rightChild];
+            } else {
+                leftChild = stack[--stackIt];
+            }
+        }
+    }
+
+    // Index of the near child of the pair starting at `first`, whose boxes are the consecutive
+    // vec4 pairs at `boxes`. Ties go left, like the stack order.
+    std::uint32_t nearChild(const CpuTracer::Ray& ray, std::uint32_t first, const float* boxes) {
+        glm::vec2 distLeft  = aabbIntersect(ray, loadVec3(boxes, 0), loadVec3(boxes, 1));
+        glm::vec2 distRight = aabbIntersect(ray, loadVec3(boxes, 2), loadVec3(boxes, 3));
+        return first + (distLeft.x > distRight.x ? 1 : 0);
+    }
+
+    std::uint32_t siblingOf(std::uint32_t node) {
+        return node + 1 - 2 * ((node - 1) & 1);
+    }
+
+    std::uint32_t firstOfPair(std::uint32_t node) {
+        return node - ((node - 1) & 1);
+    }
+
+    enum class TraversalState {
+        FromParent,
+        FromSibling,
+        FromChild
+    };
+
+    // C++ counterpart of DECLARE_STACKLESS_BVH_TRAVERSAL in extend.glsl. `links` is indexed
+    // like the split layout, so linkOffset is the node offset.
+    template <typename LeafFunction>
+    void traverseStackless(const CpuTracer::Ray& ray,
+                           const std::uint32_t* children,
+                           const float* aabbs,
+                           const std::uint32_t* links,
+                           std::uint32_t nodeOffset,
+                           std::uint32_t CpuTracer::Intersection::* outChild,
+                           CpuTracer::Intersection& isec,
+                           bool anyHit,
+                           const LeafFunction& intersectLeaf) {
+        auto intersectNodeLeaf = [&](std::uint32_t node) {
+            return intersectSlots(children[nodeOffset + node], leafCount(aabbs, nodeOffset + node), outChild, isec, anyHit, intersectLeaf);
+        };
+
+        if (links[nodeOffset] & 1) {
+            intersectNodeLeaf(0);
+            return;
+        }
+
+        auto nearChildOf = [&](std::uint32_t first) {
+            return nearChild(ray, first, &aabbs[(nodeOffset + first) * 8]);
+        };
+
+        std::uint32_t node = nearChildOf(children[nodeOffset]);
+        TraversalState state = TraversalState::FromParent;
+        while (true) {
+            if (state == TraversalState::FromChild) {
+                if (node == 0) return;
+                if (node == nearChildOf(firstOfPair(node))) {
+                    node = siblingOf(node);
+                    state = TraversalState::FromSibling;
+                } else {
+                    node = links[nodeOffset + node] >> 1;
+                }
+                continue;
+            }
+
+            glm::vec2 dist = aabbIntersect(ray, loadVec3(aabbs, (nodeOffset + node) * 2 + 0), loadVec3(aabbs, (nodeOffset + node) * 2 + 1));
+            if (dist.x <= std::min(dist.y, isec.dist) && dist.y >= 0.0f) {
+                if ((links[nodeOffset + node] & 1) == 0) {
+                    node = nearChildOf(children[nodeOffset + node]);
+                    state = TraversalState::FromParent;
+                    continue;
+                }
+                if (intersectNodeLeaf(node)) return;
+            }
+
+            if (state == TraversalState::FromParent) {
+                node = siblingOf(node);
+                state = TraversalState::FromSibling;
+            } else {
+                node = links[nodeOffset + node] >> 1;
+                state = TraversalState::FromChild;
+            }
+        }
+    }
+
+    // C++ counterpart of DECLARE_PACKED_STACKLESS_BVH_TRAVERSAL in extend.glsl.
+    template <typename LeafFunction>
+    void traversePackedStackless(const CpuTracer::Ray& ray,
+                                 const float* nodes,
+                                 const std::uint32_t* links,
+                                 std::uint32_t nodeOffset,
+                                 std::uint32_t linkOffset,
+                                 std::uint32_t CpuTracer::Intersection::* outChild,
+                                 CpuTracer::Intersection& isec,
+                                 bool anyHit,
+                                 const LeafFunction& intersectLeaf) {
+        auto nearChildOf = [&](std::uint32_t first) {
+            return nearChild(ray, first, &nodes[(nodeOffset + ((first - 1) >> 1)) * 16]);
+        };
+
+        bool rootIsLeaf = links[linkOffset] & 1;
+        std::uint32_t node = rootIsLeaf ? 1 : nearChildOf(1);
+        TraversalState state = TraversalState::FromParent;
+        while (true) {
+            if (state == TraversalState::FromChild) {
+                if (node == 0) return;
+                if (node == nearChildOf(firstOfPair(node))) {
+                    node = siblingOf(node);
+                    state = TraversalState::FromSibling;
+                } else {
+                    node = links[linkOffset + node] >> 1;
+                }
+                continue;
+            }
+
+            const float* side = &nodes[(nodeOffset + ((node - 1) >> 1)) * 16 + ((node - 1) & 1) * 8];
+            std::uint32_t child, count;
+            std::memcpy(&child, &side[3], sizeof(child));
+            std::memcpy(&count, &side[7], sizeof(count));
+
+            glm::vec2 dist = aabbIntersect(ray, loadVec3(side, 0), loadVec3(side, 1));
+            if (dist.x <= std::min(dist.y, isec.dist) && dist.y >= 0.0f) {
+                if (count == 0) {
+                    node = nearChildOf(child * 2 + 1);
+                    state = TraversalState::FromParent;
+                    continue;
+                }
+                if (intersectSlots(child, count, outChild, isec, anyHit, intersectLeaf)) return;
+            }
+            if (rootIsLeaf) return;
+
+            if (state == TraversalState::FromParent) {
+                node = siblingOf(node);
+                state = TraversalState::FromSibling;
+            } else {
+                node = links[linkOffset + node] >> 1;
+                state = TraversalState::FromChild;
+            }
+        }
+    }
+
+    // C++ counterpart of DECLARE_PACKED_BVH_TRAVERSAL in extend.glsl.
+    template <typename LeafFunction>
+    void traversePacked(const CpuTracer::Ray& ray,
+                        const float* nodes,
+                        std::uint32_t nodeOffset,
+                        std::uint32_t CpuTracer::Intersection::* outChild,
+                        CpuTracer::Intersection& isec,
+                        bool anyHit,
+                        const LeafFunction& intersectLeaf) {
+        constexpr std::uint32_t NULL_NODE = CpuTracer::NULL_NODE;
+
+        std::uint32_t stack[32];
+        std::uint32_t stackIt = 0;
+        stack[stackIt++] = NULL_NODE;
+
+        std::uint32_t node = 0;
+        while (node != NULL_NODE) {
+            const float* record = &nodes[(nodeOffset + node) * 16];
+
+            std::uint32_t leftChild, leftCount, rightChild, rightCount;
+            std::memcpy(&leftChild, &record[3], sizeof(leftChild));
+            std::memcpy(&leftCount, &record[7], sizeof(leftCount));
+            std::memcpy(&rightChild, &record[11], sizeof(rightChild));
+            std::memcpy(&rightCount, &record[15], sizeof(rightCount));
+
+            glm::vec2 distLeft  = aabbIntersect(ray, loadVec3(record, 0), loadVec3(record, 1));
+            glm::vec2 distRight = aabbIntersect(ray, loadVec3(record, 2), loadVec3(record, 3));
+
+            if (leftChild != NULL_NODE && distLeft.x <= std::min(distLeft.y, isec.dist) && distLeft.y >= 0.0f) {
+                if (leftCount > 0) {
+                    if (intersectSlots(leftChild, leftCount, outChild, isec, anyHit, intersectLeaf)) return;
+                    leftChild = NULL_NODE;
+                }
+            } else leftChild = NULL_NODE;
+
+            if (rightChild != NULL_NODE && distRight.x <= std::min(distRight.y, isec.dist) && distRight.y >= 0.0f) {
+                if (rightCount > 0) {
+                    if (intersectSlots(rightChild, rightCount, outChild, isec, anyHit, intersectLeaf)) return;
+                    rightChild = NULL_NODE;
+                }
+            } else rightChild = NULL_NODE;
+
+            if (leftChild != NULL_NODE) {
+                if (rightChild != NULL_NODE) {
+                    if (distLeft.x > distRight.x) std::swap(leftChild, rightChild);
+                    if (stackIt == 32) break;
+                    stack[stackIt++] = rightChild;
+                }
+                node = leftChild;
+            } else if (rightChild != NULL_NODE) {
+                node = rightChild;
+            } else {
+                node = stack[--stackIt];
+            }
+        }
+    }
+}
+
+CpuTracer::CpuTracer(const AccelerationStructures& accels, NodeLayout layout, Traversal traversal) :
+    m_layout(layout),
+    m_traversal(traversal)
+{
+    using Buffer = AccelerationStructures::Buffer;
+
+    m_buffers.tlasAABBs = accels.getBuffer(Buffer::TlasAABB).as<float>();
+    m_buffers.tlasGeometry = accels.getBuffer(Buffer::TlasGeometry).as<float>();
+    m_buffers.tlasChildren = accels.getBuffer(Buffer::TlasChild).as<std::uint32_t>();
+    m_buffers.tlasPrimitives = accels.getBuffer(Buffer::TlasPrimitiveId).as<std::uint32_t>();
+    m_buffers.tlasLeafs = accels.getBuffer(Buffer::TlasIsLeaf).as<std::uint32_t>();
+    m_buffers.tlasBlasNodeOffsets = accels.getBuffer(Buffer::TlasBlasNodeOffset).as<std::uint32_t>();
+    m_buffers.tlasBlasGeometryOffsets = accels.getBuffer(Buffer::TlasBlasGeometryOffset).as<std::uint32_t>();
+
+    m_buffers.blasAABBs = accels.getBuffer(Buffer::BlasAABB).as<float>();
+    m_buffers.blasTriangles = accels.getBuffer(Buffer::BlasTriangle).as<float>();
+    m_buffers.blasChildren = accels.getBuffer(Buffer::BlasChild).as<std::uint32_t>();
+    m_buffers.blasIndices = accels.getBuffer(Buffer::BlasIndex).as<std::uint32_t>();
+    m_buffers.blasLeafs = accels.getBuffer(Buffer::BlasIsLeaf).as<std::uint32_t>();
+
+    m_buffers.tlasNodes = accels.getBuffer(Buffer::TlasNode).as<float>();
+    m_buffers.blasNodes = accels.getBuffer(Buffer::BlasNode).as<float>();
+    m_buffers.tlasBlasPackedNodeOffsets = accels.getBuffer(Buffer::TlasBlasPackedNodeOffset).as<std::uint32_t>();
+
+    m_buffers.blasNormals = accels.getBuffer(Buffer::BlasNormal).as<float>();
+    m_buffers.blasMaterials = accels.getBuffer(Buffer::BlasMaterial).as<std::uint32_t>();
+
+    m_buffers.tlasInstanceBlas = accels.getBuffer(Buffer::TlasInstanceBlas).as<std::uint32_t>();
+    m_buffers.tlasWorldToObject = accels.getBuffer(Buffer::TlasWorldToObject).as<float>();
+    m_buffers.tlasObjectToWorld = accels.getBuffer(Buffer::TlasObjectToWorld).as<float>();
+
+    m_buffers.tlasLinks = accels.getBuffer(Buffer::TlasNodeLink).as<std::uint32_t>();
+    m_buffers.blasLinks = accels.getBuffer(Buffer::BlasNodeLink).as<std::uint32_t>();
+
+    if (m_layout == NodeLayout::Wide4) {
+        m_wide4 = std::make_unique<WideBvh<4>>(accels, m_buffers);
+    } else if (m_layout == NodeLayout::Wide8) {
+        m_wide8 = std::make_unique<WideBvh<8>>(accels, m_buffers);
+    }
+}
+
+CpuTracer::~CpuTracer() {
+}
+
+std::size_t CpuTracer::getWideNodeMemorySize() const {
+    if (m_wide4) {
+        return m_wide4->getMemorySize();
+    }
+    if (m_wide8) {
+        return m_wide8->getMemorySize();
+    }
+    return 0;
+}
+
+glm::vec3 CpuTracer::safeInvDir(const glm::vec3& dir) {
+    float ooeps = 1e-5f;
+    glm::vec3 invDir;
+    for (int i = 0; i < 3; i++) {
+        float d = dir[i];
+        invDir[i] = 1.0f / (std::abs(d) > ooeps ? d : (d < 0 ? -ooeps : ooeps));
+    }
+    return invDir;
+}
+
+CpuTracer::Ray CpuTracer::transformRay(const Ray& ray, const float* transform) {
+    glm::vec4 row0 = glm::vec4(transform[0], transform[1], transform[2],  transform[3]);
+    glm::vec4 row1 = glm::vec4(transform[4], transform[5], transform[6],  transform[7]);
+    glm::vec4 row2 = glm::vec4(transform[8], transform[9], transform[10], transform[11]);
+
+    Ray result;
+    result.origin = glm::vec3(glm::dot(row0, glm::vec4(ray.origin, 1.0f)), glm::dot(row1, glm::vec4(ray.origin, 1.0f)), glm::dot(row2, glm::vec4(ray.origin, 1.0f)));
+    result.dir = glm::vec3(glm::dot(row0, glm::vec4(ray.dir, 0.0f)), glm::dot(row1, glm::vec4(ray.dir, 0.0f)), glm::dot(row2, glm::vec4(ray.dir, 0.0f)));
+    result.invDir = safeInvDir(result.dir);
+    return result;
+}
+
+void CpuTracer::intersectBLAS(const Ray& ray, std::uint32_t blas, std::uint32_t geometryOffset, Intersection& isec, bool anyHit) const {
+    auto intersectLeaf = [&](std::uint32_t leafChild, Intersection& leafIsec) {
+        std::uint32_t triangle = (geometryOffset + leafChild) * 3;
+        glm::vec3 p0 = loadVec3(m_buffers.blasTriangles, triangle + 0);
+        glm::vec3 e1 = loadVec3(m_buffers.blasTriangles, triangle + 1);
+        glm::vec3 e2 = loadVec3(m_buffers.blasTriangles, triangle + 2);
+        triIntersect(ray, p0, e1, e2, leafIsec);
+    };
+
+    std::uint32_t nodeOffset = m_buffers.tlasBlasNodeOffsets[blas];
+    std::uint32_t packedNodeOffset = m_buffers.tlasBlasPackedNodeOffsets[blas];
+    bool stackless = m_traversal == Traversal::Stackless;
+    if (m_layout == NodeLayout::Packed && stackless) {
+        traversePackedStackless(ray, m_buffers.blasNodes, m_buffers.blasLinks, packedNodeOffset, nodeOffset, &Intersection::blasPrimitiveSlot, isec, anyHit, intersectLeaf);
+    } else if (m_layout == NodeLayout::Packed) {
+        traversePacked(ray, m_buffers.blasNodes, packedNodeOffset, &Intersection::blasPrimitiveSlot, isec, anyHit, intersectLeaf);
+    } else if (stackless) {
+        traverseStackless(ray, m_buffers.blasChildren, m_buffers.blasAABBs, m_buffers.blasLinks, nodeOffset, &Intersection::blasPrimitiveSlot, isec, anyHit, intersectLeaf);
+    } else {
+        traverse(ray, m_buffers.blasChildren, m_buffers.blasAABBs, m_buffers.blasLeafs, nodeOffset, &Intersection::blasPrimitiveSlot, isec, anyHit, intersectLeaf);
+    }
+}
+
+void CpuTracer::intersectTLAS(const Ray& ray, Intersection& isec, bool anyHit) const {
+    auto intersectLeaf = [&](std::uint32_t leafChild, Intersection& leafIsec) {
+        std::uint32_t index = m_buffers.tlasPrimitives[leafChild];
+        glm::vec2 isecAABB = aabbIntersect(ray, loadVec3(m_buffers.tlasGeometry, index * 2 + 0), loadVec3(m_buffers.tlasGeometry, index * 2 + 1));
+        if (isecAABB.x <= std::min(isecAABB.y, leafIsec.dist) && isecAABB.y >= 0.0f) {
+            std::uint32_t blas = m_buffers.tlasInstanceBlas[index];
+            intersectBLAS(transformRay(ray, &m_buffers.tlasWorldToObject[index * 12]), blas, m_buffers.tlasBlasGeometryOffsets[blas], leafIsec, anyHit);
+        }
+    };
+
+    bool stackless = m_traversal == Traversal::Stackless;
+    if (m_layout == NodeLayout::Packed && stackless) {
+        traversePackedStackless(ray, m_buffers.tlasNodes, m_buffers.tlasLinks, 0, 0, &Intersection::tlasPrimitiveSlot, isec, anyHit, intersectLeaf);
+    } else if (m_layout == NodeLayout::Packed) {
+        traversePacked(ray, m_buffers.tlasNodes, 0, &Intersection::tlasPrimitiveSlot, isec, anyHit, intersectLeaf);
+    } else if (stackless) {
+        traverseStackless(ray, m_buffers.tlasChildren, m_buffers.tlasAABBs, m_buffers.tlasLinks, 0, &Intersection::tlasPrimitiveSlot, isec, anyHit, intersectLeaf);
+    } else {
+        traverse(ray, m_buffers.tlasChildren, m_buffers.tlasAABBs, m_buffers.tlasLeafs, 0, &Intersection::tlasPrimitiveSlot, isec, anyHit, intersectLeaf);
+    }
+}
+
+CpuTracer::Intersection CpuTracer::intersect(const Ray& ray) const {
+    Intersection isec;
+    isec.dist = 1e10f;
+    isec.tlasPrimitiveSlot = NULL_NODE;
+    isec.blasPrimitiveSlot = NULL_NODE;
+    isec.barycentric = glm::vec2(0.0f);
+    if (m_wide4) {
+        m_wide4->intersect(ray, isec);
+    } else if (m_wide8) {
+        m_wide8->intersect(ray, isec);
+    } else {
+        intersectTLAS(ray, isec, false);
+    }
+    isec.dist = (isec.dist == 1e10f ? -1.0f : isec.dist);
+    return isec;
+}
+
+bool CpuTracer::occluded(const Ray& ray, float maxDist) const {
+    Intersection isec;
+    isec.dist = maxDist;
+    isec.tlasPrimitiveSlot = NULL_NODE;
+    isec.blasPrimitiveSlot = NULL_NODE;
+    isec.barycentric = glm::vec2(0.0f);
+    if (m_wide4) {
+        m_wide4->intersect(ray, isec);
+    } else if (m_wide8) {
+        m_wide8->intersect(ray, isec);
+    } else {
+        intersectTLAS(ray, isec, true);
+    }
+    return isec.tlasPrimitiveSlot != NULL_NODE;
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "AccelerationStructures.hpp"
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <memory>
+
+template <std::uint32_t Width> class WideBvh;
+
+class CpuTracer {
+public:
+    static constexpr std::uint32_t NULL_NODE = std::uint32_t(-1);
+
+    enum class NodeLayout {
+        Split,
+        Packed,
+        // Packed nodes collapsed into 4 or 8 wide nodes at construction, see WideBvh.
+        Wide4,
+        Wide8
+    };
+
+    // Split and Packed only; the wide trees are always traversed with a stack.
+    enum class Traversal {
+        Stack,
+        // Parent links instead of a stack, see DECLARE_STACKLESS_BVH_TRAVERSAL in extend.glsl.
+        Stackless
+    };
+
+    struct Ray {
+        glm::vec3 origin;
+        glm::vec3 dir;
+        glm::vec3 invDir;
+    };
+
+    struct Intersection {
+        std::uint32_t tlasPrimitiveSlot;
+        std::uint32_t blasPrimitiveSlot;
+        glm::vec2     barycentric;
+        float         dist;
+    };
+
+    // Same arrays the GL path uploads to its SSBOs, every BLAS concatenated.
+    struct Buffers {
+        const float*         tlasAABBs;
+        const float*         tlasGeometry;
+        const std::uint32_t* tlasChildren;
+        const std::uint32_t* tlasPrimitives;
+        const std::uint32_t* tlasLeafs;
+        const std::uint32_t* tlasBlasNodeOffsets;
+        const std::uint32_t* tlasBlasGeometryOffsets;
+
+        const float*         blasAABBs;
+        const float*         blasTriangles;
+        const std::uint32_t* blasChildren;
+        const std::uint32_t* blasIndices;
+        const std::uint32_t* blasLeafs;
+
+        const float*         tlasNodes;
+        const float*         blasNodes;
+        const std::uint32_t* tlasBlasPackedNodeOffsets;
+
+        const float*         blasNormals;
+        const std::uint32_t* blasMaterials;
+
+        const std::uint32_t* tlasInstanceBlas;
+        const float*         tlasWorldToObject;
+        const float*         tlasObjectToWorld;
+
+        const std::uint32_t* tlasLinks;
+        const std::uint32_t* blasLinks;
+    };
+
+private:
+    Buffers                     m_buffers;
+    NodeLayout                  m_layout;
+    Traversal                   m_traversal;
+    std::unique_ptr<WideBvh<4>> m_wide4;
+    std::unique_ptr<WideBvh<8>> m_wide8;
+
+    // anyHit stops at the first hit closer than isec.dist, like the SHADOW_RAYS variant of extend.glsl.
+    void intersectBLAS(const Ray& ray, std::uint32_t blas, std::uint32_t geometryOffset, Intersection& isec, bool anyHit) const;
+    void intersectTLAS(const Ray& ray, Intersection& isec, bool anyHit) const;
+
+public:
+    CpuTracer(const AccelerationStructures& accels, NodeLayout layout = NodeLayout::Split, Traversal traversal = Traversal::Stack);
+    ~CpuTracer();
+
+    // The wide trees keep a reference to m_buffers.
+    CpuTracer(const CpuTracer&) = delete;
+    CpuTracer& operator=(const CpuTracer&) = delete;
+
+    Intersection intersect(const Ray& ray) const;
+    // Whether anything is hit closer than maxDist along the unnormalized direction, the connect
+    // stage's shadow ray test. The wide trees look for the closest hit within the segment
+    // instead of stopping at the first one, which gives the same answer.
+    bool occluded(const Ray& ray, float maxDist) const;
+
+    const Buffers& getBuffers() const { return m_buffers; }
+    NodeLayout getLayout() const { return m_layout; }
+    Traversal getTraversal() const { return m_traversal; }
+    std::size_t getWideNodeMemorySize() const;
+
+    static glm::vec3 safeInvDir(const glm::vec3& dir);
+    // Applies a row-major 3x4 transform. The direction is not renormalized, so hit
+    // distances stay comparable across instances.
+    static Ray transformRay(const Ray& ray, const float* transform);
+};
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <chrono>
+
+// Seconds between calls, on a monotonic clock at its native resolution.
+class DeltaTime {
+private:
+    std::chrono::time_point<std::chrono::steady_clock> m_last;
+
+public:
+    DeltaTime() :
+        m_last(std::chrono::steady_clock::now())
+    { }
+
+    float get() {
+        auto now = std::chrono::steady_clock::now();
+        float delta = std::chrono::duration<float>(now - m_last).count();
+        m_last = now;
+        return delta;
+    }
+};
@@ -0,0 +1,174 @@
+#include "LocalSocket.hpp"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+namespace {
+    constexpr int LISTEN_BACKLOG = 64;
+
+    // Sending to a worker that just died must fail the call instead of raising SIGPIPE.
+#ifdef MSG_NOSIGNAL
+    constexpr int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+    constexpr int SEND_FLAGS = 0;
+#endif
+
+    struct MessageHeader {
+        std::uint32_t type;
+        std::uint32_t size;
+    };
+
+    bool makeAddress(const std::string& path, sockaddr_un& address) {
+        if (path.size() >= sizeof(address.sun_path)) {
+            return false;
+        }
+        std::memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        return true;
+    }
+
+    bool sendAll(int fd, const void* data, std::size_t size) {
+        const auto* bytes = static_cast<const std::uint8_t*>(data);
+        while (size > 0) {
+            ssize_t sent = ::send(fd, bytes, size, SEND_FLAGS);
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            if (sent <= 0) {
+                return false;
+            }
+            bytes += sent;
+            size -= sent;
+        }
+        return true;
+    }
+
+    bool receiveAll(int fd, void* data, std::size_t size) {
+        auto* bytes = static_cast<std::uint8_t*>(data);
+        while (size > 0) {
+            ssize_t received = ::recv(fd, bytes, size, 0);
+            if (received < 0 && errno == EINTR) {
+                continue;
+            }
+            if (received <= 0) {
+                return false;
+            }
+            bytes += received;
+            size -= received;
+        }
+        return true;
+    }
+}
+
+LocalSocket::LocalSocket() :
+    m_fd(-1)
+{ }
+
+LocalSocket::LocalSocket(int fd) :
+    m_fd(fd)
+{ }
+
+LocalSocket::~LocalSocket() {
+    close();
+}
+
+LocalSocket::LocalSocket(LocalSocket&& other) :
+    m_fd(other.m_fd)
+{
+    other.m_fd = -1;
+}
+
+LocalSocket& LocalSocket::operator=(LocalSocket&& other) {
+    if (this != &other) {
+        close();
+        m_fd = other.m_fd;
+        other.m_fd = -1;
+    }
+    return *this;
+}
+
+bool LocalSocket::listen(const std::string& path) {
+    close();
+
+    sockaddr_un address;
+    if (!makeAddress(path, address)) {
+        return false;
+    }
+
+    m_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (m_fd < 0) {
+        return false;
+    }
+
+    ::unlink(path.c_str());
+    if (::bind(m_fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 || ::listen(m_fd, LISTEN_BACKLOG) != 0) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+LocalSocket LocalSocket::accept() {
+    int fd;
+    do {
+        fd = ::accept(m_fd, nullptr, nullptr);
+    } while (fd < 0 && errno == EINTR);
+    return LocalSocket(fd);
+}
+
+bool LocalSocket::connect(const std::string& path, float timeoutSeconds) {
+    sockaddr_un address;
+    if (!makeAddress(path, address)) {
+        return false;
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<float>(timeoutSeconds);
+    while (true) {
+        close();
+        m_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (m_fd < 0) {
+            return false;
+        }
+        if (::connect(m_fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0) {
+            return true;
+        }
+        if (std::chrono::steady_clock::now() >= deadline) {
+            close();
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+}
+
+void LocalSocket::close() {
+    if (m_fd >= 0) {
+        ::close(m_fd);
+    }
+    m_fd = -1;
+}
+
+bool LocalSocket::send(std::uint32_t type, const void* data, std::size_t size) {
+    return send(type, data, size, nullptr, 0);
+}
+
+bool LocalSocket::send(std::uint32_t type, const void* header, std::size_t headerSize, const void* data, std::size_t size) {
+    MessageHeader message = {type, std::uint32_t(headerSize + size)};
+    return sendAll(m_fd, &message, sizeof(message)) && sendAll(m_fd, header, headerSize) && sendAll(m_fd, data, size);
+}
+
+bool LocalSocket::receive(std::uint32_t& type, std::vector<std::uint8_t>& data) {
+    MessageHeader message;
+    if (!receiveAll(m_fd, &message, sizeof(message))) {
+        return false;
+    }
+    type = message.type;
+    data.resize(message.size);
+    return receiveAll(m_fd, data.data(), data.size());
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Blocking Unix domain stream socket that carries typed, length-prefixed messages
+// between processes on the same machine.
+class LocalSocket {
+private:
+    int m_fd;
+
+public:
+    LocalSocket();
+    explicit LocalSocket(int fd);
+    ~LocalSocket();
+
+    LocalSocket(LocalSocket&& other);
+    LocalSocket& operator=(LocalSocket&& other);
+    LocalSocket(const LocalSocket&) = delete;
+    LocalSocket& operator=(const LocalSocket&) = delete;
+
+    // Replaces a stale socket file left at `path` by an earlier run.
+    bool listen(const std::string& path);
+    LocalSocket accept();
+    // Retries until something listens at `path` or the timeout runs out.
+    bool connect(const std::string& path, float timeoutSeconds);
+    void close();
+
+    bool isOpen() const { return m_fd >= 0; }
+    int getHandle() const { return m_fd; }
+
+    bool send(std::uint32_t type, const void* data, std::size_t size);
+    // Two buffers as one message, so a header and a payload need no extra copy.
+    bool send(std::uint32_t type, const void* header, std::size_t headerSize, const void* data, std::size_t size);
+    // Blocks until a whole message is in; false once the peer is gone.
+    bool receive(std::uint32_t& type, std::vector<std::uint8_t>& data);
+};
@@ -0,0 +1,48 @@
+#include "MappedFile.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile() :
+    m_data(nullptr),
+    m_size(0)
+{ }
+
+MappedFile::~MappedFile() {
+    close();
+}
+
+bool MappedFile::open(const std::string& path) {
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+
+    void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+
+    m_data = data;
+    m_size = info.st_size;
+    return true;
+}
+
+void MappedFile::close() {
+    if (m_data) {
+        munmap(const_cast<void*>(m_data), m_size);
+    }
+    m_data = nullptr;
+    m_size = 0;
+}
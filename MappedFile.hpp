@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+class MappedFile {
+private:
+    const void* m_data;
+    std::size_t m_size;
+
+public:
+    MappedFile();
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const std::string& path);
+    void close();
+
+    const void* getData() const { return m_data; }
+    std::size_t getSize() const { return m_size; }
+};
@@ -0,0 +1,518 @@
+#include "PacketTracer.hpp"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+namespace {
+    constexpr std::uint32_t NULL_NODE   = CpuTracer::NULL_NODE;
+    constexpr std::uint32_t PACKET_SIZE = PacketTracer::PACKET_SIZE;
+    constexpr std::uint32_t STACK_SIZE  = 64;
+    constexpr float         NO_HIT      = 1e10f;
+
+    // Rays stored component-wise, so consecutive rays fill the SIMD lanes.
+    struct alignas(32) PacketRays {
+        float originX[PACKET_SIZE], originY[PACKET_SIZE], originZ[PACKET_SIZE];
+        float invDirX[PACKET_SIZE], invDirY[PACKET_SIZE], invDirZ[PACKET_SIZE];
+        float dirX[PACKET_SIZE], dirY[PACKET_SIZE], dirZ[PACKET_SIZE];
+        // Bounds over the active rays, for the interval culling.
+        glm::vec3 originMin, originMax;
+        glm::vec3 invDirMin, invDirMax;
+    };
+
+    struct alignas(32) PacketHits {
+        float         dist[PACKET_SIZE], u[PACKET_SIZE], v[PACKET_SIZE];
+        std::uint32_t tlasSlot[PACKET_SIZE], blasSlot[PACKET_SIZE];
+    };
+
+    // Comparisons give all-ones lanes, like the SIMD compares.
+#if defined(__AVX2__)
+    struct Lanes {
+        static constexpr std::uint32_t COUNT = 8;
+        using Float = __m256;
+
+        static Float load(const float* p) { return _mm256_load_ps(p); }
+        static void store(float* p, Float a) { _mm256_store_ps(p, a); }
+        static Float set(float a) { return _mm256_set1_ps(a); }
+        static Float add(Float a, Float b) { return _mm256_add_ps(a, b); }
+        static Float sub(Float a, Float b) { return _mm256_sub_ps(a, b); }
+        static Float mul(Float a, Float b) { return _mm256_mul_ps(a, b); }
+        static Float div(Float a, Float b) { return _mm256_div_ps(a, b); }
+        static Float min(Float a, Float b) { return _mm256_min_ps(a, b); }
+        static Float max(Float a, Float b) { return _mm256_max_ps(a, b); }
+        static Float less(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+        static Float lessEqual(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+        static Float bitAnd(Float a, Float b) { return _mm256_and_ps(a, b); }
+        static Float bitOr(Float a, Float b) { return _mm256_or_ps(a, b); }
+        static Float andNot(Float a, Float b) { return _mm256_andnot_ps(a, b); }
+        static Float select(Float mask, Float a, Float b) { return _mm256_blendv_ps(b, a, mask); }
+        static std::uint32_t moveMask(Float a) { return _mm256_movemask_ps(a); }
+        static Float fromBits(std::uint32_t bits) {
+            const __m256i laneBits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+            return _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(bits), laneBits), laneBits));
+        }
+    };
+#elif defined(__SSE2__)
+    struct Lanes {
+        static constexpr std::uint32_t COUNT = 4;
+        using Float = __m128;
+
+        static Float load(const float* p) { return _mm_load_ps(p); }
+        static void store(float* p, Float a) { _mm_store_ps(p, a); }
+        static Float set(float a) { return _mm_set1_ps(a); }
+        static Float add(Float a, Float b) { return _mm_add_ps(a, b); }
+        static Float sub(Float a, Float b) { return _mm_sub_ps(a, b); }
+        static Float mul(Float a, Float b) { return _mm_mul_ps(a, b); }
+        static Float div(Float a, Float b) { return _mm_div_ps(a, b); }
+        static Float min(Float a, Float b) { return _mm_min_ps(a, b); }
+        static Float max(Float a, Float b) { return _mm_max_ps(a, b); }
+        static Float less(Float a, Float b) { return _mm_cmplt_ps(a, b); }
+        static Float lessEqual(Float a, Float b) { return _mm_cmple_ps(a, b); }
+        static Float bitAnd(Float a, Float b) { return _mm_and_ps(a, b); }
+        static Float bitOr(Float a, Float b) { return _mm_or_ps(a, b); }
+        static Float andNot(Float a, Float b) { return _mm_andnot_ps(a, b); }
+        static Float select(Float mask, Float a, Float b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+        static std::uint32_t moveMask(Float a) { return _mm_movemask_ps(a); }
+        static Float fromBits(std::uint32_t bits) {
+            const __m128i laneBits = _mm_setr_epi32(1, 2, 4, 8);
+            return _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(bits), laneBits), laneBits));
+        }
+    };
+#else
+    struct Lanes {
+        static constexpr std::uint32_t COUNT = 1;
+        using Float = float;
+
+        static std::uint32_t bitsOf(float a) { std::uint32_t bits; std::memcpy(&bits, &a, sizeof(bits)); return bits; }
+        static float fromRaw(std::uint32_t bits) { float a; std::memcpy(&a, &bits, sizeof(a)); return a; }
+        static float fromBool(bool value) { return fromRaw(value ? ~0u : 0u); }
+
+        static Float load(const float* p) { return *p; }
+        static void store(float* p, Float a) { *p = a; }
+        static Float set(float a) { return a; }
+        static Float add(Float a, Float b) { return a + b; }
+        static Float sub(Float a, Float b) { return a - b; }
+        static Float mul(Float a, Float b) { return a * b; }
+        static Float div(Float a, Float b) { return a / b; }
+        static Float min(Float a, Float b) { return a < b ? a : b; }
+        static Float max(Float a, Float b) { return a > b ? a : b; }
+        static Float less(Float a, Float b) { return fromBool(a < b); }
+        static Float lessEqual(Float a, Float b) { return fromBool(a <= b); }
+        static Float bitAnd(Float a, Float b) { return fromRaw(bitsOf(a) & bitsOf(b)); }
+        static Float bitOr(Float a, Float b) { return fromRaw(bitsOf(a) | bitsOf(b)); }
+        static Float andNot(Float a, Float b) { return fromRaw(~bitsOf(a) & bitsOf(b)); }
+        static Float select(Float mask, Float a, Float b) { return bitsOf(mask) ? a : b; }
+        static std::uint32_t moveMask(Float a) { return bitsOf(a) >> 31; }
+        static Float fromBits(std::uint32_t bits) { return fromBool(bits & 1); }
+    };
+#endif
+
+    constexpr std::uint32_t LANE_MASK = (1u << Lanes::COUNT) - 1;
+
+    struct Tree {
+        const std::uint32_t* children;
+        const float*         aabbs;
+        const std::uint32_t* leafs;
+        const std::uint32_t* links;
+        std::uint32_t        nodeOffset;
+    };
+
+    // Slot count of a split layout leaf, kept as uint bits in the max.w of its box.
+    std::uint32_t leafCount(const float* aabbs, std::uint32_t node) {
+        std::uint32_t count;
+        std::memcpy(&count, &aabbs[node * 8 + 7], sizeof(count));
+        return count;
+    }
+
+    template <typename Function>
+    void forEachRay(std::uint64_t mask, const Function& function) {
+        while (mask != 0) {
+            function(std::uint32_t(__builtin_ctzll(mask)));
+            mask &= mask - 1;
+        }
+    }
+
+    std::uint32_t octantOf(const glm::vec3& invDir) {
+        return (invDir.x < 0.0f ? 1 : 0) | (invDir.y < 0.0f ? 2 : 0) | (invDir.z < 0.0f ? 4 : 0);
+    }
+
+    void computeBounds(PacketRays& rays, std::uint64_t mask) {
+        rays.originMin = rays.invDirMin = glm::vec3(std::numeric_limits<float>::max());
+        rays.originMax = rays.invDirMax = glm::vec3(-std::numeric_limits<float>::max());
+        forEachRay(mask, [&](std::uint32_t ray) {
+            glm::vec3 origin(rays.originX[ray], rays.originY[ray], rays.originZ[ray]);
+            glm::vec3 invDir(rays.invDirX[ray], rays.invDirY[ray], rays.invDirZ[ray]);
+            rays.originMin = glm::min(rays.originMin, origin);
+            rays.originMax = glm::max(rays.originMax, origin);
+            rays.invDirMin = glm::min(rays.invDirMin, invDir);
+            rays.invDirMax = glm::max(rays.invDirMax, invDir);
+        });
+    }
+
+    void storeRay(PacketRays& rays, std::uint32_t lane, const CpuTracer::Ray& ray) {
+        rays.originX[lane] = ray.origin.x; rays.originY[lane] = ray.origin.y; rays.originZ[lane] = ray.origin.z;
+        rays.dirX[lane]    = ray.dir.x;    rays.dirY[lane]    = ray.dir.y;    rays.dirZ[lane]    = ray.dir.z;
+        rays.invDirX[lane] = ray.invDir.x; rays.invDirY[lane] = ray.invDir.y; rays.invDirZ[lane] = ray.invDir.z;
+    }
+
+    CpuTracer::Ray loadRay(const PacketRays& rays, std::uint32_t lane) {
+        CpuTracer::Ray ray;
+        ray.origin = glm::vec3(rays.originX[lane], rays.originY[lane], rays.originZ[lane]);
+        ray.dir    = glm::vec3(rays.dirX[lane], rays.dirY[lane], rays.dirZ[lane]);
+        ray.invDir = glm::vec3(rays.invDirX[lane], rays.invDirY[lane], rays.invDirZ[lane]);
+        return ray;
+    }
+
+    // Conservative test for the whole packet with interval arithmetic: every ray enters the
+    // box no earlier than `tNear` and leaves it no later than `tFar`.
+    bool frustumHit(const PacketRays& rays, const float* box) {
+        float tNear = -std::numeric_limits<float>::max();
+        float tFar = std::numeric_limits<float>::max();
+        for (std::uint32_t axis = 0; axis < 3; axis++) {
+            float planes[4] = {
+                box[axis] - rays.originMax[axis], box[axis] - rays.originMin[axis],
+                box[axis + 4] - rays.originMax[axis], box[axis + 4] - rays.originMin[axis]
+            };
+            float axisMin = std::numeric_limits<float>::max();
+            float axisMax = -std::numeric_limits<float>::max();
+            for (float plane : planes) {
+                float t0 = plane * rays.invDirMin[axis];
+                float t1 = plane * rays.invDirMax[axis];
+                axisMin = std::min(axisMin, std::min(t0, t1));
+                axisMax = std::max(axisMax, std::max(t0, t1));
+            }
+            tNear = std::max(tNear, axisMin);
+            tFar = std::min(tFar, axisMax);
+        }
+        return tNear <= tFar && tFar >= 0.0f;
+    }
+
+    // Entry and exit distance of one ray, the same slab test as aabbIntersect in CpuTracer.cpp.
+    glm::vec2 boxDistance(const PacketRays& rays, std::uint32_t ray, const float* box) {
+        glm::vec3 origin(rays.originX[ray], rays.originY[ray], rays.originZ[ray]);
+        glm::vec3 invDir(rays.invDirX[ray], rays.invDirY[ray], rays.invDirZ[ray]);
+        glm::vec3 tMin = (glm::vec3(box[0], box[1], box[2]) - origin) * invDir;
+        glm::vec3 tMax = (glm::vec3(box[4], box[5], box[6]) - origin) * invDir;
+        glm::vec3 t1 = glm::min(tMin, tMax);
+        glm::vec3 t2 = glm::max(tMin, tMax);
+        return glm::vec2(std::max(std::max(t1.x, t1.y), t1.z), std::min(std::min(t2.x, t2.y), t2.z));
+    }
+
+    bool boxHit(const glm::vec2& dist, float hitDist) {
+        return dist.x <= std::min(dist.y, hitDist) && dist.y >= 0.0f;
+    }
+
+    // Rays of `mask` that hit the box (two vec4s, like the split layout) before their closest hit.
+    std::uint64_t intersectBox(const PacketRays& rays, const PacketHits& hits, const float* box, std::uint64_t mask) {
+        using L = Lanes;
+        const L::Float minX = L::set(box[0]), minY = L::set(box[1]), minZ = L::set(box[2]);
+        const L::Float maxX = L::set(box[4]), maxY = L::set(box[5]), maxZ = L::set(box[6]);
+        const L::Float zero = L::set(0.0f);
+
+        std::uint64_t result = 0;
+        for (std::uint32_t lane = 0; lane < PACKET_SIZE; lane += L::COUNT) {
+            std::uint32_t bits = std::uint32_t(mask >> lane) & LANE_MASK;
+            if (bits == 0) {
+                continue;
+            }
+
+            L::Float ox = L::load(rays.originX + lane), oy = L::load(rays.originY + lane), oz = L::load(rays.originZ + lane);
+            L::Float ix = L::load(rays.invDirX + lane), iy = L::load(rays.invDirY + lane), iz = L::load(rays.invDirZ + lane);
+
+            L::Float t0x = L::mul(L::sub(minX, ox), ix), t1x = L::mul(L::sub(maxX, ox), ix);
+            L::Float t0y = L::mul(L::sub(minY, oy), iy), t1y = L::mul(L::sub(maxY, oy), iy);
+            L::Float t0z = L::mul(L::sub(minZ, oz), iz), t1z = L::mul(L::sub(maxZ, oz), iz);
+
+            L::Float tNear = L::max(L::max(L::min(t0x, t1x), L::min(t0y, t1y)), L::min(t0z, t1z));
+            L::Float tFar  = L::min(L::min(L::max(t0x, t1x), L::max(t0y, t1y)), L::max(t0z, t1z));
+
+            L::Float hit = L::bitAnd(L::lessEqual(tNear, L::min(tFar, L::load(hits.dist + lane))), L::lessEqual(zero, tFar));
+            result |= std::uint64_t(L::moveMask(hit) & bits) << lane;
+        }
+        return result;
+    }
+
+    // triIntersect from CpuTracer.cpp for every ray of `mask`. Returns the rays this triangle
+    // became the closest hit of.
+    std::uint64_t intersectTriangle(const PacketRays& rays, PacketHits& hits, const float* triangle, std::uint64_t mask) {
+        using L = Lanes;
+        glm::vec3 v0(triangle[0], triangle[1], triangle[2]);
+        glm::vec3 v1v0(triangle[4], triangle[5], triangle[6]);
+        glm::vec3 v2v0(triangle[8], triangle[9], triangle[10]);
+        glm::vec3 n = glm::cross(v1v0, v2v0);
+
+        const L::Float v0x = L::set(v0.x), v0y = L::set(v0.y), v0z = L::set(v0.z);
+        const L::Float e1x = L::set(v1v0.x), e1y = L::set(v1v0.y), e1z = L::set(v1v0.z);
+        const L::Float e2x = L::set(v2v0.x), e2y = L::set(v2v0.y), e2z = L::set(v2v0.z);
+        const L::Float nx = L::set(n.x), ny = L::set(n.y), nz = L::set(n.z);
+        const L::Float zero = L::set(0.0f), one = L::set(1.0f);
+
+        std::uint64_t result = 0;
+        for (std::uint32_t lane = 0; lane < PACKET_SIZE; lane += L::COUNT) {
+            std::uint32_t bits = std::uint32_t(mask >> lane) & LANE_MASK;
+            if (bits == 0) {
+                continue;
+            }
+
+            L::Float dx = L::load(rays.dirX + lane), dy = L::load(rays.dirY + lane), dz = L::load(rays.dirZ + lane);
+            L::Float rx = L::sub(L::load(rays.originX + lane), v0x);
+            L::Float ry = L::sub(L::load(rays.originY + lane), v0y);
+            L::Float rz = L::sub(L::load(rays.originZ + lane), v0z);
+
+            L::Float qx = L::sub(L::mul(ry, dz), L::mul(dy, rz));
+            L::Float qy = L::sub(L::mul(rz, dx), L::mul(dz, rx));
+            L::Float qz = L::sub(L::mul(rx, dy), L::mul(dx, ry));
+
+            L::Float d = L::div(one, L::add(L::add(L::mul(dx, nx), L::mul(dy, ny)), L::mul(dz, nz)));
+            L::Float u = L::mul(d, L::sub(zero, L::add(L::add(L::mul(qx, e2x), L::mul(qy, e2y)), L::mul(qz, e2z))));
+            L::Float v = L::mul(d, L::add(L::add(L::mul(qx, e1x), L::mul(qy, e1y)), L::mul(qz, e1z)));
+            L::Float t = L::mul(d, L::sub(zero, L::add(L::add(L::mul(nx, rx), L::mul(ny, ry)), L::mul(nz, rz))));
+
+            L::Float dist = L::load(hits.dist + lane);
+            L::Float outside = L::bitOr(L::bitOr(L::less(u, zero), L::less(v, zero)), L::less(one, L::add(u, v)));
+            L::Float closer = L::bitAnd(L::lessEqual(zero, t), L::less(t, dist));
+            L::Float better = L::bitAnd(L::andNot(outside, closer), L::fromBits(bits));
+
+            std::uint32_t won = L::moveMask(better);
+            if (won == 0) {
+                continue;
+            }
+            L::store(hits.dist + lane, L::select(better, t, dist));
+            L::store(hits.u + lane, L::select(better, u, L::load(hits.u + lane)));
+            L::store(hits.v + lane, L::select(better, v, L::load(hits.v + lane)));
+            result |= std::uint64_t(won) << lane;
+        }
+        return result;
+    }
+
+    template <typename LeafFunction>
+    void intersectLeafSlots(const Tree& tree, std::uint32_t index, std::uint64_t mask, const LeafFunction& intersectLeaf) {
+        std::uint32_t first = tree.children[index];
+        std::uint32_t count = leafCount(tree.aabbs, index);
+        for (std::uint32_t i = 0; i < count; i++) {
+            intersectLeaf(first + i, mask);
+        }
+    }
+
+    // traverseRay without a stack, following the parent links like traverseStackless in
+    // CpuTracer.cpp, but only within the subtree below the inner node `root`.
+    template <typename LeafFunction>
+    void traverseRayStackless(const PacketRays& rays, const PacketHits& hits, std::uint32_t ray, const Tree& tree, std::uint32_t root, const LeafFunction& intersectLeaf) {
+        std::uint64_t bit = std::uint64_t(1) << ray;
+
+        auto nearChildOf = [&](std::uint32_t first) {
+            glm::vec2 distLeft = boxDistance(rays, ray, &tree.aabbs[(tree.nodeOffset + first) * 8]);
+            glm::vec2 distRight = boxDistance(rays, ray, &tree.aabbs[(tree.nodeOffset + first + 1) * 8]);
+            return first + (distLeft.x > distRight.x ? 1 : 0);
+        };
+        auto siblingOf = [](std::uint32_t node) { return node + 1 - 2 * ((node - 1) & 1); };
+        auto parentOf = [&](std::uint32_t node) { return tree.links[tree.nodeOffset + node] >> 1; };
+
+        std::uint32_t node = nearChildOf(tree.children[tree.nodeOffset + root]);
+        bool fromParent = true;
+        while (true) {
+            std::uint32_t index = tree.nodeOffset + node;
+            if (boxHit(boxDistance(rays, ray, &tree.aabbs[index * 8]), hits.dist[ray])) {
+                if (tree.leafs[index] == 0) {
+                    node = nearChildOf(tree.children[index]);
+                    fromParent = true;
+                    continue;
+                }
+                intersectLeafSlots(tree, index, bit, intersectLeaf);
+            }
+
+            if (fromParent) {
+                node = siblingOf(node);
+                fromParent = false;
+                continue;
+            }
+
+            // Climb while coming back from the far child of a pair; the near one goes on to its sibling.
+            node = parentOf(node);
+            while (node != root && node != nearChildOf(node - ((node - 1) & 1))) {
+                node = parentOf(node);
+            }
+            if (node == root) return;
+            node = siblingOf(node);
+        }
+    }
+
+    // One ray of the packet through the subtree below `root`, whose box it is known to hit.
+    template <typename LeafFunction>
+    void traverseRay(const PacketRays& rays, const PacketHits& hits, std::uint32_t ray, const Tree& tree, std::uint32_t root, const LeafFunction& intersectLeaf) {
+        std::uint64_t bit = std::uint64_t(1) << ray;
+
+        std::uint32_t stack[STACK_SIZE];
+        std::uint32_t stackIt = 0;
+
+        std::uint32_t node = root;
+        while (true) {
+            std::uint32_t index = tree.nodeOffset + node;
+            if (tree.leafs[index] > 0) {
+                intersectLeafSlots(tree, index, bit, intersectLeaf);
+            } else {
+                std::uint32_t leftChild = tree.children[index];
+                std::uint32_t rightChild = leftChild + 1;
+                glm::vec2 distLeft = boxDistance(rays, ray, &tree.aabbs[(tree.nodeOffset + leftChild) * 8]);
+                glm::vec2 distRight = boxDistance(rays, ray, &tree.aabbs[(tree.nodeOffset + rightChild) * 8]);
+                bool hitLeft = boxHit(distLeft, hits.dist[ray]);
+                bool hitRight = boxHit(distRight, hits.dist[ray]);
+
+                if (hitLeft && hitRight) {
+                    if (distLeft.x > distRight.x) std::swap(leftChild, rightChild);
+                    // A deeper tree than the stack holds is finished without it, instead of dropping hits.
+                    if (stackIt == STACK_SIZE) {
+                        traverseRayStackless(rays, hits, ray, tree, root, intersectLeaf);
+                        return;
+                    }
+                    stack[stackIt++] = rightChild;
+                    node = leftChild;
+                    continue;
+                }
+                if (hitLeft || hitRight) {
+                    node = hitLeft ? leftChild : rightChild;
+                    continue;
+                }
+            }
+
+            if (stackIt == 0) return;
+            node = stack[--stackIt];
+        }
+    }
+
+    // Walks the tree with the rays of `mask`. Every node is culled for the whole packet first,
+    // then the rays that still hit it go on together, or one by one once few are left.
+    template <typename LeafFunction>
+    void traversePacket(const PacketRays& rays, const PacketHits& hits, std::uint64_t mask, const Tree& tree, const LeafFunction& intersectLeaf) {
+        struct Entry {
+            std::uint32_t node;
+            std::uint64_t mask;
+        };
+
+        Entry stack[STACK_SIZE];
+        std::uint32_t stackIt = 0;
+        stack[stackIt++] = {0, mask};
+
+        while (stackIt > 0) {
+            Entry entry = stack[--stackIt];
+            std::uint32_t index = tree.nodeOffset + entry.node;
+            const float* box = &tree.aabbs[index * 8];
+            if (!frustumHit(rays, box)) {
+                continue;
+            }
+
+            std::uint64_t active = intersectBox(rays, hits, box, entry.mask);
+            if (active == 0) {
+                continue;
+            }
+
+            if (tree.leafs[index] > 0) {
+                intersectLeafSlots(tree, index, active, intersectLeaf);
+                continue;
+            }
+
+            if (std::uint32_t(__builtin_popcountll(active)) <= PacketTracer::SINGLE_RAY_LIMIT || stackIt + 2 > STACK_SIZE) {
+                forEachRay(active, [&](std::uint32_t ray) {
+                    traverseRay(rays, hits, ray, tree, entry.node, intersectLeaf);
+                });
+                continue;
+            }
+
+            // Near child first, as the first active ray sees them.
+            std::uint32_t leftChild = tree.children[index];
+            std::uint32_t rightChild = leftChild + 1;
+            std::uint32_t firstRay = __builtin_ctzll(active);
+            if (boxDistance(rays, firstRay, &tree.aabbs[(tree.nodeOffset + leftChild) * 8]).x >
+                boxDistance(rays, firstRay, &tree.aabbs[(tree.nodeOffset + rightChild) * 8]).x) {
+                std::swap(leftChild, rightChild);
+            }
+            stack[stackIt++] = {rightChild, active};
+            stack[stackIt++] = {leftChild, active};
+        }
+    }
+
+    void intersectBLAS(const CpuTracer::Buffers& buffers, const PacketRays& rays, std::uint64_t mask, std::uint32_t blas,
+                       std::uint32_t tlasSlot, PacketHits& hits) {
+        std::uint32_t geometryOffset = buffers.tlasBlasGeometryOffsets[blas];
+        Tree tree = {buffers.blasChildren, buffers.blasAABBs, buffers.blasLeafs, buffers.blasLinks, buffers.tlasBlasNodeOffsets[blas]};
+
+        traversePacket(rays, hits, mask, tree, [&](std::uint32_t slot, std::uint64_t leafMask) {
+            std::uint64_t won = intersectTriangle(rays, hits, &buffers.blasTriangles[std::size_t(geometryOffset + slot) * 12], leafMask);
+            forEachRay(won, [&](std::uint32_t ray) {
+                hits.tlasSlot[ray] = tlasSlot;
+                hits.blasSlot[ray] = slot;
+            });
+        });
+    }
+
+    void intersectTLAS(const CpuTracer::Buffers& buffers, const PacketRays& rays, std::uint64_t mask, PacketHits& hits) {
+        Tree tree = {buffers.tlasChildren, buffers.tlasAABBs, buffers.tlasLeafs, buffers.tlasLinks, 0};
+
+        traversePacket(rays, hits, mask, tree, [&](std::uint32_t slot, std::uint64_t leafMask) {
+            std::uint32_t index = buffers.tlasPrimitives[slot];
+            std::uint64_t active = intersectBox(rays, hits, &buffers.tlasGeometry[index * 8], leafMask);
+            if (active == 0) {
+                return;
+            }
+
+            // The instance transform is affine, so the packet stays a packet in object space.
+            PacketRays objectRays;
+            CpuTracer::Ray firstRay = CpuTracer::transformRay(loadRay(rays, __builtin_ctzll(active)), &buffers.tlasWorldToObject[index * 12]);
+            for (std::uint32_t lane = 0; lane < PACKET_SIZE; lane++) {
+                bool transform = (active >> lane) & 1;
+                storeRay(objectRays, lane, transform ? CpuTracer::transformRay(loadRay(rays, lane), &buffers.tlasWorldToObject[index * 12]) : firstRay);
+            }
+            computeBounds(objectRays, active);
+
+            intersectBLAS(buffers, objectRays, active, buffers.tlasInstanceBlas[index], slot, hits);
+        });
+    }
+}
+
+PacketTracer::PacketTracer(const CpuTracer& tracer) :
+    m_tracer(tracer)
+{ }
+
+bool PacketTracer::intersect(const CpuTracer::Ray* rays, std::uint32_t count, CpuTracer::Intersection* isecs) const {
+    count = std::min(count, PACKET_SIZE);
+    if (count == 0) {
+        return true;
+    }
+
+    // Rays going into different octants share too few nodes, and their intervals cull nothing.
+    std::uint32_t octant = octantOf(rays[0].invDir);
+    for (std::uint32_t i = 1; i < count; i++) {
+        if (octantOf(rays[i].invDir) != octant) {
+            for (std::uint32_t j = 0; j < count; j++) {
+                isecs[j] = m_tracer.intersect(rays[j]);
+            }
+            return false;
+        }
+    }
+
+    PacketRays packet;
+    PacketHits hits;
+    for (std::uint32_t lane = 0; lane < PACKET_SIZE; lane++) {
+        storeRay(packet, lane, rays[lane < count ? lane : 0]);
+        hits.dist[lane] = NO_HIT;
+        hits.u[lane] = hits.v[lane] = 0.0f;
+        hits.tlasSlot[lane] = hits.blasSlot[lane] = NULL_NODE;
+    }
+
+    std::uint64_t mask = count == PACKET_SIZE ? ~std::uint64_t(0) : (std::uint64_t(1) << count) - 1;
+    computeBounds(packet, mask);
+
+    intersectTLAS(m_tracer.getBuffers(), packet, mask, hits);
+
+    for (std::uint32_t i = 0; i < count; i++) {
+        isecs[i].tlasPrimitiveSlot = hits.tlasSlot[i];
+        isecs[i].blasPrimitiveSlot = hits.blasSlot[i];
+        isecs[i].barycentric = glm::vec2(hits.u[i], hits.v[i]);
+        isecs[i].dist = hits.dist[i] == NO_HIT ? -1.0f : hits.dist[i];
+    }
+    return true;
+}
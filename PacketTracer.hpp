@@ -0,0 +1,30 @@
+#pragma once
+
+#include "CpuTracer.hpp"
+
+#include <cstdint>
+
+// Traces a block of coherent rays, such as an 8x8 tile of camera rays, through the
+// split layout as one packet. A node is first culled against interval bounds of the
+// whole packet, then box-tested for the rays still active with SIMD lanes, and leaf
+// triangles are tested against all active rays at once. Hits are the ones CpuTracer
+// finds, bit for bit unless the compiler contracts its scalar math into FMAs.
+//
+// Packets whose directions do not share an octant go through the CpuTracer ray by ray,
+// and subtrees that only a few rays of a packet reach are finished one ray at a time.
+class PacketTracer {
+public:
+    static constexpr std::uint32_t PACKET_WIDTH = 8;
+    static constexpr std::uint32_t PACKET_SIZE  = PACKET_WIDTH * PACKET_WIDTH;
+    // Subtrees entered by this many rays or fewer are finished one ray at a time.
+    static constexpr std::uint32_t SINGLE_RAY_LIMIT = 4;
+
+private:
+    const CpuTracer& m_tracer;
+
+public:
+    explicit PacketTracer(const CpuTracer& tracer);
+
+    // Up to PACKET_SIZE rays. Returns false when they were traced one by one instead.
+    bool intersect(const CpuTracer::Ray* rays, std::uint32_t count, CpuTracer::Intersection* isecs) const;
+};
@@ -0,0 +1,106 @@
+#include "RaySorter.hpp"
+
+#include <algorithm>
+#include <array>
+
+namespace {
+    constexpr std::uint32_t SORT_GRAIN = 1 << 16;
+
+    // Spreads the low ten bits of v so that two zero bits follow each of them.
+    std::uint32_t expandBits(std::uint32_t v) {
+        v = (v | (v << 16)) & 0x030000FF;
+        v = (v | (v <<  8)) & 0x0300F00F;
+        v = (v | (v <<  4)) & 0x030C30C3;
+        v = (v | (v <<  2)) & 0x09249249;
+        return v;
+    }
+}
+
+std::uint32_t RaySorter::computeKey(const glm::vec3& origin, const glm::vec3& dir, const glm::vec3& sceneMin, const glm::vec3& sceneScale) {
+    constexpr float cellMax = float((1 << MORTON_BITS_PER_AXIS) - 1);
+
+    std::uint32_t cell[3];
+    for (std::uint32_t axis = 0; axis < 3; axis++) {
+        cell[axis] = std::uint32_t(std::clamp((origin[axis] - sceneMin[axis]) * sceneScale[axis], 0.0f, cellMax));
+    }
+
+    std::uint32_t octant = (dir.x < 0.0f ? 1 : 0) | (dir.y < 0.0f ? 2 : 0) | (dir.z < 0.0f ? 4 : 0);
+    std::uint32_t morton = (expandBits(cell[0]) << 2) | (expandBits(cell[1]) << 1) | expandBits(cell[2]);
+    return (octant << (3 * MORTON_BITS_PER_AXIS)) | morton;
+}
+
+RaySorter::RaySorter(ThreadPool& pool) :
+    m_pool(pool)
+{ }
+
+void RaySorter::sort(std::vector<glm::vec4>& rays, std::uint32_t count, const glm::vec3& sceneMin, const glm::vec3& sceneMax) {
+    if (count < 2) {
+        return;
+    }
+
+    glm::vec3 sceneScale = glm::vec3(float(1 << MORTON_BITS_PER_AXIS)) / glm::max(sceneMax - sceneMin, glm::vec3(1e-6f));
+
+    m_items.resize(count);
+    m_scratch.resize(count);
+    m_sortedRays.resize(rays.size());
+
+    m_pool.parallelFor(0, count, SORT_GRAIN, [&](std::uint32_t begin, std::uint32_t end) {
+        for (std::uint32_t i = begin; i < end; i++) {
+            std::uint64_t key = computeKey(glm::vec3(rays[i * 2 + 0]), glm::vec3(rays[i * 2 + 1]), sceneMin, sceneScale);
+            m_items[i] = (key << 32) | i;
+        }
+    });
+
+    // LSD radix sort: every chunk counts its digits, the counts are turned into per-chunk
+    // output offsets in (digit, chunk) order, and each chunk scatters its items stably.
+    std::uint32_t chunkCount = (count + SORT_GRAIN - 1) / SORT_GRAIN;
+    std::vector<std::array<std::uint32_t, BUCKETS>> offsets(chunkCount);
+
+    for (std::uint32_t shift = 0; shift < KEY_BITS; shift += DIGIT_BITS) {
+        auto digitOf = [shift](std::uint64_t item) {
+            return std::uint32_t(item >> (32 + shift)) & (BUCKETS - 1);
+        };
+
+        m_pool.parallelFor(0, chunkCount, 1, [&](std::uint32_t chunkBegin, std::uint32_t chunkEnd) {
+            for (std::uint32_t chunk = chunkBegin; chunk < chunkEnd; chunk++) {
+                auto& histogram = offsets[chunk];
+                histogram.fill(0);
+                std::uint32_t end = std::min(count, (chunk + 1) * SORT_GRAIN);
+                for (std::uint32_t i = chunk * SORT_GRAIN; i < end; i++) {
+                    histogram[digitOf(m_items[i])]++;
+                }
+            }
+        });
+
+        std::uint32_t sum = 0;
+        for (std::uint32_t digit = 0; digit < BUCKETS; digit++) {
+            for (auto& histogram : offsets) {
+                std::uint32_t digitCount = histogram[digit];
+                histogram[digit] = sum;
+                sum += digitCount;
+            }
+        }
+
+        m_pool.parallelFor(0, chunkCount, 1, [&](std::uint32_t chunkBegin, std::uint32_t chunkEnd) {
+            for (std::uint32_t chunk = chunkBegin; chunk < chunkEnd; chunk++) {
+                auto& offset = offsets[chunk];
+                std::uint32_t end = std::min(count, (chunk + 1) * SORT_GRAIN);
+                for (std::uint32_t i = chunk * SORT_GRAIN; i < end; i++) {
+                    m_scratch[offset[digitOf(m_items[i])]++] = m_items[i];
+                }
+            }
+        });
+
+        std::swap(m_items, m_scratch);
+    }
+
+    m_pool.parallelFor(0, count, SORT_GRAIN, [&](std::uint32_t begin, std::uint32_t end) {
+        for (std::uint32_t i = begin; i < end; i++) {
+            std::uint32_t source = std::uint32_t(m_items[i]);
+            m_sortedRays[i * 2 + 0] = rays[source * 2 + 0];
+            m_sortedRays[i * 2 + 1] = rays[source * 2 + 1];
+        }
+    });
+
+    std::swap(rays, m_sortedRays);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "ThreadPool.hpp"
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+// Reorders a ray buffer (origin and direction vec4 per ray, as in the ray buffers)
+// so that neighbouring rays traverse similar parts of the BVH. The key has the
+// direction octant in the top bits, so rays agree on the child visiting order,
+// followed by a Morton code of the origin quantized to the scene bounds.
+// raykeys.glsl computes the same key for the GL pipeline.
+class RaySorter {
+public:
+    static constexpr std::uint32_t MORTON_BITS_PER_AXIS = 9;
+    static constexpr std::uint32_t KEY_BITS             = 3 + 3 * MORTON_BITS_PER_AXIS;
+
+    static std::uint32_t computeKey(const glm::vec3& origin, const glm::vec3& dir, const glm::vec3& sceneMin, const glm::vec3& sceneScale);
+
+private:
+    static constexpr std::uint32_t DIGIT_BITS = 10;
+    static constexpr std::uint32_t BUCKETS    = 1 << DIGIT_BITS;
+
+    ThreadPool& m_pool;
+
+    // Key in the upper half, ray index in the lower one.
+    std::vector<std::uint64_t> m_items;
+    std::vector<std::uint64_t> m_scratch;
+    std::vector<glm::vec4>     m_sortedRays;
+
+public:
+    explicit RaySorter(ThreadPool& pool);
+
+    // Sorts the first `count` rays of `rays` in place.
+    void sort(std::vector<glm::vec4>& rays, std::uint32_t count, const glm::vec3& sceneMin, const glm::vec3& sceneMax);
+};
@@ -0,0 +1,166 @@
+#include "SceneLoader.hpp"
+#include "DeltaTime.hpp"
+#include "MappedFile.hpp"
+
+#include <assimp/scene.h>
+#include <assimp/mesh.h>
+#include <assimp/postprocess.h>
+
+#include <algorithm>
+#include <array>
+#include <iostream>
+#include <vector>
+
+namespace {
+    constexpr std::uint64_t MESH_CHUNK_TRIANGLES = 1 << 20;
+    constexpr std::uint64_t FNV_OFFSET_BASIS     = 14695981039346656037ull;
+    constexpr std::uint64_t FNV_PRIME            = 1099511628211ull;
+
+    // Folds the build options into the source hash, so a cache built differently is not reused.
+    std::uint64_t hashOptions(std::uint64_t hash, const AccelerationStructures::BuildOptions& options) {
+        for (std::uint32_t value : {static_cast<std::uint32_t>(options.builder), options.maxLeafSize}) {
+            for (std::uint32_t byte = 0; byte < 4; byte++) {
+                hash = (hash ^ ((value >> (byte * 8)) & 0xff)) * FNV_PRIME;
+            }
+        }
+        return hash;
+    }
+
+    void printBuildStats(const char* name, const AccelerationStructures::BuildStats& stats) {
+        std::cout << name << ": " << stats.triangles << " primitives (" << stats.references << " references) in " << stats.seconds
+                  << " seconds (" << stats.triangles / std::max(stats.seconds, 1e-9) << " primitives/s), "
+                  << AccelerationStructures::getBuilderName(stats.builder) << ", " << stats.nodes << " nodes, SAH " << stats.sahCost << std::endl;
+    }
+
+    // Every node referencing a mesh becomes an instance of that mesh's BLAS.
+    void collectInstances(const aiNode* node, const aiMatrix4x4& parentTransform, std::uint32_t firstBlas,
+                          std::vector<AccelerationStructures::Instance>& instances) {
+        aiMatrix4x4 transform = parentTransform * node->mTransformation;
+        std::array<float, 12> rows = {transform.a1, transform.a2, transform.a3, transform.a4,
+                                      transform.b1, transform.b2, transform.b3, transform.b4,
+                                      transform.c1, transform.c2, transform.c3, transform.c4};
+
+        for (std::uint32_t i = 0; i < node->mNumMeshes; i++) {
+            instances.push_back({firstBlas + node->mMeshes[i], rows});
+        }
+        for (std::uint32_t i = 0; i < node->mNumChildren; i++) {
+            collectInstances(node->mChildren[i], transform, firstBlas, instances);
+        }
+    }
+}
+
+std::uint64_t SceneLoader::hashFile(const std::string& path) {
+    MappedFile file;
+    if (!file.open(path)) {
+        return 0;
+    }
+
+    // FNV-1a
+    std::uint64_t hash = FNV_OFFSET_BASIS;
+    const auto* data = static_cast<const std::uint8_t*>(file.getData());
+    for (std::size_t i = 0; i < file.getSize(); i++) {
+        hash = (hash ^ data[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+SceneLoader::Stats SceneLoader::load(const std::string& path, AccelerationStructures& accels, ThreadPool& pool, bool useCache) {
+    Stats loadStats;
+    std::string cachePath = path + ".accel";
+    std::uint64_t sourceHash = useCache ? hashOptions(hashOptions(hashFile(path), m_blasOptions), accels.getTlasBuildOptions()) : 0;
+
+    DeltaTime cacheTime;
+    if (useCache && accels.loadCache(cachePath, sourceHash)) {
+        loadStats.cached = true;
+        loadStats.importSeconds = cacheTime.get();
+        std::cout << "Acceleration structures mapped from " << cachePath << " in " << loadStats.importSeconds << " seconds" << std::endl;
+        return loadStats;
+    }
+
+    // Joining identical vertices lets triangles share their indexed attributes.
+    const aiScene* scene = m_importer.ReadFile(path, aiProcess_Triangulate | aiProcess_JoinIdenticalVertices);
+
+    std::uint64_t sceneTriangles = 0;
+    std::uint64_t sceneVertices = 0;
+    for (std::uint32_t meshId = 0; meshId < scene->mNumMeshes; meshId++) {
+        sceneTriangles += scene->mMeshes[meshId]->mNumFaces;
+        sceneVertices += scene->mMeshes[meshId]->mNumVertices;
+    }
+    accels.reserveBLAS(sceneTriangles, sceneVertices);
+
+    std::vector<AccelerationStructures::Instance> instances;
+    collectInstances(scene->mRootNode, aiMatrix4x4(), accels.getBLAS().size(), instances);
+    loadStats.importSeconds = cacheTime.get();
+
+    // Meshes are converted and built a chunk at a time, so besides the imported scene only
+    // one chunk's copy exists outside the final buffers.
+    std::vector<AccelerationStructures::BuildStats>& stats = loadStats.blas;
+    std::vector<AccelerationStructures::Mesh> meshes;
+    std::uint64_t chunkTriangles = 0;
+    double totalBlasBuildTime = 0.0;
+    for (std::uint32_t meshId = 0; meshId < scene->mNumMeshes; meshId++) {
+        const aiMesh* mesh = scene->mMeshes[meshId];
+        AccelerationStructures::Mesh& target = meshes.emplace_back();
+
+        target.material = (meshId == scene->mNumMeshes - 1) ? AccelerationStructures::MATERIAL_EMISSIVE : 0;
+        target.options = m_blasOptions;
+
+        target.positions.reserve(mesh->mNumVertices * 3);
+        target.normals.reserve(mesh->mNumVertices * 3);
+        for (std::uint32_t vertexId = 0; vertexId < mesh->mNumVertices; vertexId++) {
+            const aiVector3D* vertex = &mesh->mVertices[vertexId];
+            target.positions.insert(target.positions.end(), {vertex->x, vertex->y, vertex->z});
+
+            const aiVector3D* normal = &mesh->mNormals[vertexId];
+            target.normals.insert(target.normals.end(), {normal->x, normal->y, normal->z});
+        }
+
+        target.indices.reserve(mesh->mNumFaces * 3);
+        for (std::uint32_t faceId = 0; faceId < mesh->mNumFaces; faceId++) {
+            const aiFace* face = &mesh->mFaces[faceId];
+            if (face->mNumIndices != 3) {
+                continue;
+            }
+            target.indices.insert(target.indices.end(), face->mIndices, face->mIndices + face->mNumIndices);
+        }
+
+        chunkTriangles += mesh->mNumFaces;
+        if (chunkTriangles >= MESH_CHUNK_TRIANGLES || meshId + 1 == scene->mNumMeshes) {
+            DeltaTime blasTime;
+            auto chunkStats = accels.addBLASBatch(std::move(meshes), pool);
+            totalBlasBuildTime += blasTime.get();
+            stats.insert(stats.end(), chunkStats.begin(), chunkStats.end());
+            meshes.clear();
+            chunkTriangles = 0;
+        }
+    }
+
+    m_importer.FreeScene();
+    loadStats.blasSeconds = totalBlasBuildTime;
+
+    std::uint64_t totalTriangles = 0;
+    for (std::uint32_t meshId = 0; meshId < stats.size(); meshId++) {
+        printBuildStats(("BLAS " + std::to_string(meshId)).c_str(), stats[meshId]);
+        totalTriangles += stats[meshId].triangles;
+    }
+    loadStats.triangles = totalTriangles;
+    std::cout << "BLAS built in " << totalBlasBuildTime << " seconds (" << totalTriangles / std::max(totalBlasBuildTime, 1e-3)
+              << " triangles/s on " << pool.getThreadCount() << " threads)" << std::endl;
+
+    for (const auto& instance : instances) {
+        accels.addInstance(instance.blas, instance.transform);
+    }
+
+    DeltaTime deltaTime;
+    accels.buildTLAS(&pool);
+    loadStats.tlasSeconds = deltaTime.get();
+    loadStats.tlas = accels.getTlasBuildStats();
+    printBuildStats("TLAS", loadStats.tlas);
+    std::cout << "TLAS built in " << loadStats.tlasSeconds << " seconds (" << instances.size() << " instances of "
+              << stats.size() << " meshes)" << std::endl;
+
+    if (useCache && !accels.saveCache(cachePath, sourceHash)) {
+        std::cout << "Failed to write " << cachePath << std::endl;
+    }
+    return loadStats;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "AccelerationStructures.hpp"
+#include "ThreadPool.hpp"
+
+#include <assimp/Importer.hpp>
+
+#include <string>
+#include <vector>
+
+class SceneLoader {
+private:
+    Assimp::Importer                     m_importer;
+    AccelerationStructures::BuildOptions m_blasOptions;
+
+    static std::uint64_t hashFile(const std::string& path);
+
+public:
+    struct Stats {
+        bool          cached        = false;
+        std::uint64_t triangles     = 0;
+        double        importSeconds = 0.0;
+        double        blasSeconds   = 0.0;
+        double        tlasSeconds   = 0.0;
+        // Per-BLAS and TLAS build reports; left empty when the cache was used.
+        std::vector<AccelerationStructures::BuildStats> blas;
+        AccelerationStructures::BuildStats              tlas;
+    };
+
+    // Applied to every mesh of the next load. The TLAS options are the ones set on the
+    // AccelerationStructures; both are part of the cache hash.
+    void setBuildOptions(const AccelerationStructures::BuildOptions& options) { m_blasOptions = options; }
+
+    // Reuses "<path>.accel" when its hash matches the source file, otherwise
+    // imports and builds the scene and writes that cache for the next run.
+    // Without useCache the cache is neither read nor written, e.g. to time the builders.
+    Stats load(const std::string& path, AccelerationStructures& accels, ThreadPool& pool, bool useCache = true);
+};
@@ -0,0 +1,134 @@
+#include "ThreadPool.hpp"
+
+#include <algorithm>
+
+namespace {
+    constexpr std::uint32_t NO_WORKER = std::uint32_t(-1);
+    thread_local std::uint32_t t_workerIndex = NO_WORKER;
+    thread_local const ThreadPool* t_workerPool = nullptr;
+}
+
+ThreadPool::ThreadPool(std::uint32_t threadCount) :
+    m_pending(0),
+    m_nextQueue(0),
+    m_running(true)
+{
+    threadCount = std::max<std::uint32_t>(threadCount, 1);
+
+    for (std::uint32_t i = 0; i < threadCount; i++) {
+        m_queues.push_back(std::make_unique<Queue>());
+    }
+
+    for (std::uint32_t i = 0; i < threadCount; i++) {
+        m_threads.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(m_wakeMutex);
+        m_running = false;
+    }
+    m_wake.notify_all();
+
+    for (auto& thread : m_threads) {
+        thread.join();
+    }
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+    std::uint32_t queueId = (t_workerPool == this) ? t_workerIndex : m_nextQueue++ % m_queues.size();
+
+    {
+        std::lock_guard<std::mutex> lock(m_queues[queueId]->mutex);
+        m_queues[queueId]->tasks.push_back(std::move(task));
+    }
+
+    m_pending++;
+    {
+        std::lock_guard<std::mutex> lock(m_wakeMutex);
+    }
+    m_wake.notify_one();
+}
+
+bool ThreadPool::runPending(std::uint32_t self) {
+    std::function<void()> task;
+
+    if (self != NO_WORKER) {
+        Queue& own = *m_queues[self];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+        }
+    }
+
+    for (std::uint32_t i = 1; !task && i <= m_queues.size(); i++) {
+        std::uint32_t victim = (self == NO_WORKER ? i : self + i) % m_queues.size();
+        Queue& other = *m_queues[victim];
+        std::lock_guard<std::mutex> lock(other.mutex);
+        if (!other.tasks.empty()) {
+            task = std::move(other.tasks.front());
+            other.tasks.pop_front();
+        }
+    }
+
+    if (!task) {
+        return false;
+    }
+
+    m_pending--;
+    task();
+    return true;
+}
+
+void ThreadPool::workerLoop(std::uint32_t index) {
+    t_workerIndex = index;
+    t_workerPool = this;
+
+    while (true) {
+        if (runPending(index)) {
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(m_wakeMutex);
+        m_wake.wait(lock, [this]() { return !m_running || m_pending > 0; });
+        if (!m_running && m_pending == 0) {
+            break;
+        }
+    }
+}
+
+void ThreadPool::parallelFor(std::uint32_t begin, std::uint32_t end, std::uint32_t grain,
+                             const std::function<void(std::uint32_t, std::uint32_t)>& body) {
+    if (begin >= end) {
+        return;
+    }
+
+    grain = std::max<std::uint32_t>(grain, 1);
+    std::uint32_t chunks = (end - begin + grain - 1) / grain;
+    if (chunks == 1) {
+        body(begin, end);
+        return;
+    }
+
+    std::atomic<std::uint32_t> remaining(chunks);
+    for (std::uint32_t chunk = 1; chunk < chunks; chunk++) {
+        std::uint32_t chunkBegin = begin + chunk * grain;
+        std::uint32_t chunkEnd = std::min(chunkBegin + grain, end);
+        submit([&body, &remaining, chunkBegin, chunkEnd]() {
+            body(chunkBegin, chunkEnd);
+            remaining--;
+        });
+    }
+
+    body(begin, std::min(begin + grain, end));
+    remaining--;
+
+    std::uint32_t self = (t_workerPool == this) ? t_workerIndex : NO_WORKER;
+    while (remaining > 0) {
+        if (!runPending(self)) {
+            std::this_thread::yield();
+        }
+    }
+}
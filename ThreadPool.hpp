@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+private:
+    struct Queue {
+        std::mutex                        mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> m_queues;
+    std::vector<std::thread>            m_threads;
+    std::atomic<std::uint32_t>          m_pending;
+    std::atomic<std::uint32_t>          m_nextQueue;
+    std::atomic<bool>                   m_running;
+    std::mutex                          m_wakeMutex;
+    std::condition_variable             m_wake;
+
+    void workerLoop(std::uint32_t index);
+    bool runPending(std::uint32_t self);
+
+public:
+    explicit ThreadPool(std::uint32_t threadCount = std::thread::hardware_concurrency());
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    void submit(std::function<void()> task);
+
+    // Splits [begin, end) into chunks of at most `grain` items and runs them on the pool.
+    // The calling thread helps with pending work until every chunk has finished,
+    // so nested calls from inside a task are fine.
+    void parallelFor(std::uint32_t begin, std::uint32_t end, std::uint32_t grain,
+                     const std::function<void(std::uint32_t, std::uint32_t)>& body);
+
+    std::uint32_t getThreadCount() const { return m_threads.size(); }
+};
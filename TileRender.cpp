@@ -0,0 +1,330 @@
+#include "TileRender.hpp"
+#include "DeltaTime.hpp"
+
+#include <poll.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+extern char** environ;
+
+namespace {
+    constexpr float CONNECT_TIMEOUT_SECONDS = 30.0f;
+    constexpr int   POLL_TIMEOUT_MS         = 1000;
+
+    bool sameTile(const CpuRender::Tile& a, const CpuRender::Tile& b) {
+        return a.x == b.x && a.y == b.y && a.width == b.width && a.height == b.height;
+    }
+}
+
+TileCompositor::TileCompositor(std::uint32_t width, std::uint32_t height, const Settings& settings) :
+    m_width(width),
+    m_height(height),
+    m_settings(settings),
+    m_remainingTiles(0),
+    m_frame(0),
+    m_nextWorkerId(0),
+    m_colors(width * height, glm::vec4(0.0f))
+{
+    std::uint32_t tileSize = std::max(m_settings.tileSize, 1u);
+    for (std::uint32_t y = 0; y < m_height; y += tileSize) {
+        for (std::uint32_t x = 0; x < m_width; x += tileSize) {
+            m_tiles.push_back({x, y, std::min(tileSize, m_width - x), std::min(tileSize, m_height - y)});
+        }
+    }
+}
+
+TileCompositor::~TileCompositor() {
+    for (auto& worker : m_workers) {
+        worker.socket.send(static_cast<std::uint32_t>(Message::Done), nullptr, 0);
+        worker.socket.close();
+    }
+    m_workers.clear();
+
+    if (m_listener.isOpen()) {
+        m_listener.close();
+        ::unlink(m_settings.socketPath.c_str());
+    }
+
+    for (pid_t child : m_children) {
+        int status;
+        ::waitpid(child, &status, 0);
+    }
+}
+
+bool TileCompositor::start() {
+    if (!m_listener.listen(m_settings.socketPath)) {
+        std::cout << "Failed to listen on " << m_settings.socketPath << std::endl;
+        return false;
+    }
+    std::cout << "Compositor listening on " << m_settings.socketPath << ", " << m_tiles.size() << " tiles" << std::endl;
+
+    spawnWorkers();
+    return true;
+}
+
+void TileCompositor::spawnWorkers() {
+    std::vector<std::string> args = {m_settings.executable, "--tile-worker", m_settings.socketPath};
+    args.insert(args.end(), m_settings.workerArgs.begin(), m_settings.workerArgs.end());
+
+    std::vector<char*> argv;
+    for (auto& arg : args) {
+        argv.push_back(&arg[0]);
+    }
+    argv.push_back(nullptr);
+
+    for (std::uint32_t i = 0; i < m_settings.workers; i++) {
+        pid_t pid;
+        if (::posix_spawnp(&pid, argv[0], nullptr, nullptr, argv.data(), environ) != 0) {
+            std::cout << "Failed to start worker " << m_settings.executable << std::endl;
+            continue;
+        }
+        m_children.push_back(pid);
+    }
+}
+
+bool TileCompositor::hasLiveChildren() {
+    m_children.erase(std::remove_if(m_children.begin(), m_children.end(), [](pid_t child) {
+        int status;
+        return ::waitpid(child, &status, WNOHANG) == child;
+    }), m_children.end());
+    return !m_children.empty();
+}
+
+void TileCompositor::acceptWorker() {
+    Worker worker;
+    worker.socket = m_listener.accept();
+    if (!worker.socket.isOpen()) {
+        return;
+    }
+
+    std::uint32_t type;
+    std::vector<std::uint8_t> message;
+    TileHello hello;
+    if (!worker.socket.receive(type, message) || type != static_cast<std::uint32_t>(Message::Hello) || message.size() != sizeof(hello)) {
+        return;
+    }
+    std::memcpy(&hello, message.data(), sizeof(hello));
+    if (hello.width != m_width || hello.height != m_height) {
+        std::cout << "Rejected a " << hello.width << "x" << hello.height << " worker" << std::endl;
+        return;
+    }
+
+    worker.id = m_nextWorkerId++;
+    m_workers.push_back(std::move(worker));
+}
+
+void TileCompositor::dealTiles() {
+    m_orphanTiles.clear();
+    m_remainingTiles = m_tiles.size();
+
+    std::uint32_t tileCount = m_tiles.size();
+    if (m_workers.empty()) {
+        for (std::uint32_t i = 0; i < tileCount; i++) {
+            m_orphanTiles.push_back(i);
+        }
+        return;
+    }
+
+    std::uint32_t workerCount = m_workers.size();
+    for (std::uint32_t w = 0; w < workerCount; w++) {
+        m_workers[w].tiles.clear();
+        m_workers[w].busyTile = NO_TILE;
+        for (std::uint32_t i = w * tileCount / workerCount; i < (w + 1) * tileCount / workerCount; i++) {
+            m_workers[w].tiles.push_back(i);
+        }
+    }
+}
+
+std::uint32_t TileCompositor::nextTile(Worker& worker) {
+    if (worker.tiles.empty()) {
+        if (!m_orphanTiles.empty()) {
+            worker.tiles.swap(m_orphanTiles);
+        } else {
+            auto victim = std::max_element(m_workers.begin(), m_workers.end(), [](const Worker& a, const Worker& b) {
+                return a.tiles.size() < b.tiles.size();
+            });
+            if (victim == m_workers.end() || victim->tiles.empty()) {
+                return NO_TILE;
+            }
+
+            std::size_t count = (victim->tiles.size() + 1) / 2;
+            worker.tiles.assign(victim->tiles.end() - count, victim->tiles.end());
+            victim->tiles.erase(victim->tiles.end() - count, victim->tiles.end());
+            worker.stats.stolenTiles += count;
+        }
+    }
+
+    std::uint32_t tile = worker.tiles.front();
+    worker.tiles.pop_front();
+    return tile;
+}
+
+bool TileCompositor::sendNextTile(Worker& worker) {
+    std::uint32_t tile = nextTile(worker);
+    if (tile == NO_TILE) {
+        return true;
+    }
+
+    worker.busyTile = tile;
+    TileRequest request = {m_frame, m_tiles[tile]};
+    return worker.socket.send(static_cast<std::uint32_t>(Message::Tile), &request, sizeof(request));
+}
+
+bool TileCompositor::receiveResult(Worker& worker) {
+    std::uint32_t type;
+    std::vector<std::uint8_t> message;
+    if (!worker.socket.receive(type, message) || type != static_cast<std::uint32_t>(Message::Result) || message.size() < sizeof(TileResult)) {
+        return false;
+    }
+
+    TileResult result;
+    std::memcpy(&result, message.data(), sizeof(result));
+    const CpuRender::Tile& tile = result.request.tile;
+    if (worker.busyTile == NO_TILE || result.request.frame != m_frame || !sameTile(tile, m_tiles[worker.busyTile]) ||
+        message.size() != sizeof(result) + std::size_t(tile.width) * tile.height * sizeof(glm::vec4)) {
+        return false;
+    }
+
+    const std::uint8_t* pixels = message.data() + sizeof(result);
+    for (std::uint32_t row = 0; row < tile.height; row++) {
+        std::memcpy(&m_colors[(tile.y + row) * m_width + tile.x], pixels + std::size_t(row) * tile.width * sizeof(glm::vec4), tile.width * sizeof(glm::vec4));
+    }
+
+    worker.busyTile = NO_TILE;
+    worker.stats.tiles++;
+    worker.stats.seconds += result.seconds;
+    m_remainingTiles--;
+    return true;
+}
+
+void TileCompositor::dropWorker(std::size_t index) {
+    Worker& worker = m_workers[index];
+    std::cout << "Worker " << worker.id << " disconnected" << std::endl;
+
+    m_orphanTiles.insert(m_orphanTiles.end(), worker.tiles.begin(), worker.tiles.end());
+    if (worker.busyTile != NO_TILE) {
+        m_orphanTiles.push_front(worker.busyTile);
+    }
+    m_workers.erase(m_workers.begin() + index);
+}
+
+void TileCompositor::feedIdleWorkers() {
+    for (std::size_t i = m_workers.size(); i-- > 0;) {
+        if (m_workers[i].busyTile == NO_TILE && !sendNextTile(m_workers[i])) {
+            dropWorker(i);
+            // The dropped worker's tiles may go to one checked already.
+            i = m_workers.size();
+        }
+    }
+}
+
+bool TileCompositor::renderFrame() {
+    m_frame++;
+    dealTiles();
+    feedIdleWorkers();
+
+    std::vector<pollfd> fds;
+    while (m_remainingTiles > 0) {
+        // Workers first, so indices still match after a new one is accepted.
+        fds.clear();
+        for (const auto& worker : m_workers) {
+            fds.push_back({worker.socket.getHandle(), POLLIN, 0});
+        }
+        fds.push_back({m_listener.getHandle(), POLLIN, 0});
+
+        int ready = ::poll(fds.data(), fds.size(), POLL_TIMEOUT_MS);
+        if (ready < 0 && errno != EINTR) {
+            return false;
+        }
+        if (ready <= 0) {
+            // Without spawned workers the compositor waits for ones started by hand.
+            if (m_workers.empty() && m_settings.workers > 0 && !hasLiveChildren()) {
+                std::cout << "All workers exited with " << m_remainingTiles << " tiles left" << std::endl;
+                return false;
+            }
+            continue;
+        }
+
+        for (std::size_t i = m_workers.size(); i-- > 0;) {
+            if (fds[i].revents != 0 && !receiveResult(m_workers[i])) {
+                dropWorker(i);
+            }
+        }
+        if (fds.back().revents & POLLIN) {
+            acceptWorker();
+        }
+
+        feedIdleWorkers();
+    }
+
+    return true;
+}
+
+void TileCompositor::printStats() const {
+    for (const auto& worker : m_workers) {
+        std::cout << "worker " << worker.id << ": " << worker.stats.tiles << " tiles, " << worker.stats.stolenTiles << " stolen, "
+                  << worker.stats.seconds << " s rendering" << std::endl;
+    }
+}
+
+TileWorker::TileWorker(CpuRender& render) :
+    m_render(render)
+{ }
+
+bool TileWorker::run(const std::string& socketPath) {
+    LocalSocket socket;
+    if (!socket.connect(socketPath, CONNECT_TIMEOUT_SECONDS)) {
+        std::cout << "Failed to connect to " << socketPath << std::endl;
+        return false;
+    }
+
+    std::uint32_t width = m_render.getWidth();
+    std::uint32_t height = m_render.getHeight();
+    TileCompositor::TileHello hello = {width, height};
+    if (!socket.send(static_cast<std::uint32_t>(TileCompositor::Message::Hello), &hello, sizeof(hello))) {
+        return false;
+    }
+
+    std::uint32_t type;
+    std::vector<std::uint8_t> message;
+    std::vector<glm::vec4> pixels;
+    while (socket.receive(type, message)) {
+        if (type == static_cast<std::uint32_t>(TileCompositor::Message::Done)) {
+            return true;
+        }
+
+        TileCompositor::TileResult result;
+        if (type != static_cast<std::uint32_t>(TileCompositor::Message::Tile) || message.size() != sizeof(result.request)) {
+            return false;
+        }
+        std::memcpy(&result.request, message.data(), sizeof(result.request));
+
+        const CpuRender::Tile& tile = result.request.tile;
+        if (tile.width == 0 || tile.height == 0 || tile.x + tile.width > width || tile.y + tile.height > height) {
+            return false;
+        }
+
+        DeltaTime renderTime;
+        m_render.renderTile(tile);
+        result.seconds = renderTime.get();
+
+        const std::vector<glm::vec4>& colors = m_render.getColors();
+        pixels.resize(std::size_t(tile.width) * tile.height);
+        for (std::uint32_t row = 0; row < tile.height; row++) {
+            std::copy_n(colors.begin() + (tile.y + row) * width + tile.x, tile.width, pixels.begin() + std::size_t(row) * tile.width);
+        }
+
+        if (!socket.send(static_cast<std::uint32_t>(TileCompositor::Message::Result), &result, sizeof(result), pixels.data(), pixels.size() * sizeof(glm::vec4))) {
+            return false;
+        }
+    }
+
+    // The compositor went away without a Done.
+    return false;
+}
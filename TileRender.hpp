@@ -0,0 +1,126 @@
+#pragma once
+
+#include "CpuRender.hpp"
+#include "LocalSocket.hpp"
+
+#include <glm/glm.hpp>
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+// Renders CpuRender frames across processes. The compositor listens on a local socket,
+// hands tiles to BvhTestCpu --tile-worker processes and assembles what they send back.
+// Workers map the acceleration structure cache read-only, so the compositor loads the
+// scene once before spawning them to make sure that cache exists.
+//
+// Each worker has a deque of tiles, dealt as contiguous scanline blocks so it stays in
+// one part of the scene. It is fed from the front of its own deque and, once that runs
+// dry, steals the back half of the fullest deque. A worker that disconnects has its
+// tiles, including the one in flight, taken over the same way.
+class TileCompositor {
+public:
+    enum class Message : std::uint32_t {
+        Hello = 1, // worker -> compositor: TileHello
+        Tile,      // compositor -> worker: TileRequest
+        Result,    // worker -> compositor: TileResult followed by the tile's pixels
+        Done,      // compositor -> worker: no more frames
+    };
+
+    struct TileHello {
+        std::uint32_t width;
+        std::uint32_t height;
+    };
+
+    struct TileRequest {
+        std::uint32_t frame;
+        CpuRender::Tile tile;
+    };
+
+    struct TileResult {
+        TileRequest request;
+        float       seconds;
+    };
+
+    struct Settings {
+        std::uint32_t tileSize = 64;
+        // Processes spawned by the compositor; more can join with --tile-worker <socket>.
+        std::uint32_t workers  = 2;
+        std::string   socketPath;
+        // Started as <executable> --tile-worker <socketPath> <workerArgs...>.
+        std::string              executable;
+        std::vector<std::string> workerArgs;
+    };
+
+    struct WorkerStats {
+        std::uint32_t tiles       = 0;
+        std::uint32_t stolenTiles = 0;
+        double        seconds     = 0.0;
+    };
+
+private:
+    static constexpr std::uint32_t NO_TILE = ~0u;
+
+    struct Worker {
+        std::uint32_t             id;
+        LocalSocket               socket;
+        std::deque<std::uint32_t> tiles;
+        std::uint32_t             busyTile = NO_TILE;
+        WorkerStats               stats;
+    };
+
+    std::uint32_t m_width;
+    std::uint32_t m_height;
+    Settings      m_settings;
+
+    LocalSocket                  m_listener;
+    std::vector<pid_t>           m_children;
+    std::vector<Worker>          m_workers;
+    // Tiles nobody holds yet: the whole frame before a worker connected, or the ones a
+    // disconnected worker left behind.
+    std::deque<std::uint32_t>    m_orphanTiles;
+    std::vector<CpuRender::Tile> m_tiles;
+    std::uint32_t                m_remainingTiles;
+    std::uint32_t                m_frame;
+    std::uint32_t                m_nextWorkerId;
+    std::vector<glm::vec4>       m_colors;
+
+    void spawnWorkers();
+    bool hasLiveChildren();
+    void acceptWorker();
+    void dealTiles();
+    std::uint32_t nextTile(Worker& worker);
+    bool sendNextTile(Worker& worker);
+    bool receiveResult(Worker& worker);
+    void dropWorker(std::size_t index);
+    void feedIdleWorkers();
+
+public:
+    TileCompositor(std::uint32_t width, std::uint32_t height, const Settings& settings);
+    // Tells the workers to quit and waits for the spawned ones.
+    ~TileCompositor();
+
+    TileCompositor(const TileCompositor&) = delete;
+    TileCompositor& operator=(const TileCompositor&) = delete;
+
+    bool start();
+    // Blocks until every tile of the frame is in; false when no worker is left to render it.
+    bool renderFrame();
+    void printStats() const;
+
+    const std::vector<glm::vec4>& getColors() const { return m_colors; }
+};
+
+// Worker side: renders the tiles a TileCompositor sends until it says Done or goes away.
+class TileWorker {
+private:
+    CpuRender& m_render;
+
+public:
+    explicit TileWorker(CpuRender& render);
+
+    bool run(const std::string& socketPath);
+};
@@ -0,0 +1,352 @@
+#include "WideBvh.hpp"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+namespace {
+    constexpr std::uint32_t NULL_NODE = CpuTracer::NULL_NODE;
+
+    // Tests every lane of `node` against the ray, writes the entry distances and
+    // returns a bit mask of the lanes hit in front of `tMax`.
+    template <std::uint32_t Width>
+    std::uint32_t intersectChildren(const WideNode<Width>& node, const CpuTracer::Ray& ray, float tMax, float* dist) {
+        std::uint32_t mask = 0;
+        std::uint32_t lane = 0;
+
+#if defined(__AVX2__)
+        {
+            const __m256 ox = _mm256_set1_ps(ray.origin.x), oy = _mm256_set1_ps(ray.origin.y), oz = _mm256_set1_ps(ray.origin.z);
+            const __m256 ix = _mm256_set1_ps(ray.invDir.x), iy = _mm256_set1_ps(ray.invDir.y), iz = _mm256_set1_ps(ray.invDir.z);
+            const __m256 zero = _mm256_setzero_ps(), far = _mm256_set1_ps(tMax);
+
+            for (; lane + 8 <= Width; lane += 8) {
+                __m256 t0x = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.minX + lane), ox), ix);
+                __m256 t1x = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.maxX + lane), ox), ix);
+                __m256 t0y = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.minY + lane), oy), iy);
+                __m256 t1y = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.maxY + lane), oy), iy);
+                __m256 t0z = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.minZ + lane), oz), iz);
+                __m256 t1z = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.maxZ + lane), oz), iz);
+
+                __m256 tNear = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(t0x, t1x), _mm256_min_ps(t0y, t1y)), _mm256_min_ps(t0z, t1z));
+                __m256 tFar  = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(t0x, t1x), _mm256_max_ps(t0y, t1y)), _mm256_max_ps(t0z, t1z));
+
+                __m256 hit = _mm256_and_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ),
+                             _mm256_and_ps(_mm256_cmp_ps(tFar, zero, _CMP_GE_OQ), _mm256_cmp_ps(tNear, far, _CMP_LT_OQ)));
+
+                _mm256_storeu_ps(dist + lane, tNear);
+                mask |= std::uint32_t(_mm256_movemask_ps(hit)) << lane;
+            }
+        }
+#endif
+
+#if defined(__SSE2__)
+        {
+            const __m128 ox = _mm_set1_ps(ray.origin.x), oy = _mm_set1_ps(ray.origin.y), oz = _mm_set1_ps(ray.origin.z);
+            const __m128 ix = _mm_set1_ps(ray.invDir.x), iy = _mm_set1_ps(ray.invDir.y), iz = _mm_set1_ps(ray.invDir.z);
+            const __m128 zero = _mm_setzero_ps(), far = _mm_set1_ps(tMax);
+
+            for (; lane + 4 <= Width; lane += 4) {
+                __m128 t0x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.minX + lane), ox), ix);
+                __m128 t1x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.maxX + lane), ox), ix);
+                __m128 t0y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.minY + lane), oy), iy);
+                __m128 t1y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.maxY + lane), oy), iy);
+                __m128 t0z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.minZ + lane), oz), iz);
+                __m128 t1z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.maxZ + lane), oz), iz);
+
+                __m128 tNear = _mm_max_ps(_mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)), _mm_min_ps(t0z, t1z));
+                __m128 tFar  = _mm_min_ps(_mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)), _mm_max_ps(t0z, t1z));
+
+                __m128 hit = _mm_and_ps(_mm_cmple_ps(tNear, tFar), _mm_and_ps(_mm_cmpge_ps(tFar, zero), _mm_cmplt_ps(tNear, far)));
+
+                _mm_storeu_ps(dist + lane, tNear);
+                mask |= std::uint32_t(_mm_movemask_ps(hit)) << lane;
+            }
+        }
+#endif
+
+        for (; lane < Width; lane++) {
+            glm::vec3 t0 = (glm::vec3(node.minX[lane], node.minY[lane], node.minZ[lane]) - ray.origin) * ray.invDir;
+            glm::vec3 t1 = (glm::vec3(node.maxX[lane], node.maxY[lane], node.maxZ[lane]) - ray.origin) * ray.invDir;
+            glm::vec3 tMin = glm::min(t0, t1);
+            glm::vec3 tMaxLane = glm::max(t0, t1);
+            float tNear = std::max(std::max(tMin.x, tMin.y), tMin.z);
+            float tFar = std::min(std::min(tMaxLane.x, tMaxLane.y), tMaxLane.z);
+
+            dist[lane] = tNear;
+            if (tNear <= tFar && tFar >= 0.0f && tNear < tMax) {
+                mask |= 1u << lane;
+            }
+        }
+
+        return mask;
+    }
+
+    bool aabbHit(const CpuTracer::Ray& ray, const float* aabb, float tMax) {
+        glm::vec3 t0 = (glm::vec3(aabb[0], aabb[1], aabb[2]) - ray.origin) * ray.invDir;
+        glm::vec3 t1 = (glm::vec3(aabb[4], aabb[5], aabb[6]) - ray.origin) * ray.invDir;
+        glm::vec3 tMin = glm::min(t0, t1);
+        glm::vec3 tMaxAxis = glm::max(t0, t1);
+        float tNear = std::max(std::max(tMin.x, tMin.y), tMin.z);
+        float tFar = std::min(std::min(tMaxAxis.x, tMaxAxis.y), tMaxAxis.z);
+        return tNear <= tFar && tFar >= 0.0f && tNear < tMax;
+    }
+
+    float halfArea(const float* bounds) {
+        float x = bounds[3] - bounds[0], y = bounds[4] - bounds[1], z = bounds[5] - bounds[2];
+        return x * y + y * z + z * x;
+    }
+}
+
+template <std::uint32_t Width>
+WideBvh<Width>::WideBvh(const AccelerationStructures& accels, const CpuTracer::Buffers& buffers, std::uint32_t maxLeafSize) :
+    m_buffers(buffers),
+    m_maxLeafSize(std::max<std::uint32_t>(maxLeafSize, 1))
+{
+    using Buffer = AccelerationStructures::Buffer;
+    constexpr std::uint32_t RECORD_SIZE = 16 * sizeof(float);
+
+    std::uint32_t blasCount = accels.getBuffer(Buffer::TlasBlasPackedNodeOffset).count<std::uint32_t>();
+    std::uint32_t blasRecordCount = accels.getBuffer(Buffer::BlasNode).size / RECORD_SIZE;
+
+    m_tlasRoot = collapseTree(buffers.tlasNodes, 0, accels.getBuffer(Buffer::TlasNode).size / RECORD_SIZE);
+
+    m_blasRoots.resize(blasCount);
+    for (std::uint32_t blasId = 0; blasId < blasCount; blasId++) {
+        std::uint32_t first = buffers.tlasBlasPackedNodeOffsets[blasId];
+        std::uint32_t last = (blasId + 1 < blasCount) ? buffers.tlasBlasPackedNodeOffsets[blasId + 1] : blasRecordCount;
+        m_blasRoots[blasId] = collapseTree(buffers.blasNodes, first, last - first);
+    }
+}
+
+template <std::uint32_t Width>
+typename WideBvh<Width>::BinaryChild WideBvh<Width>::readChild(const float* tree, std::uint32_t record, std::uint32_t side) {
+    const float* data = &tree[record * 16 + side * 8];
+    BinaryChild child;
+    child.bounds[0] = data[0]; child.bounds[1] = data[1]; child.bounds[2] = data[2];
+    child.bounds[3] = data[4]; child.bounds[4] = data[5]; child.bounds[5] = data[6];
+    std::memcpy(&child.child, &data[3], sizeof(child.child));
+    std::memcpy(&child.count, &data[7], sizeof(child.count));
+    return child;
+}
+
+template <std::uint32_t Width>
+std::uint32_t WideBvh<Width>::collapseTree(const float* nodes, std::uint32_t first, std::uint32_t count) {
+    const float* tree = &nodes[first * 16];
+
+    // Children always sit in later records than their parents, so one backwards
+    // pass gives the primitive range below every record.
+    std::vector<Subtree> subtrees(count);
+    for (std::uint32_t record = count; record-- > 0;) {
+        Subtree merged = {0, 0, true};
+        for (std::uint32_t side = 0; side < 2; side++) {
+            BinaryChild child = readChild(tree, record, side);
+            if (child.child == NULL_NODE) {
+                continue;
+            }
+
+            Subtree subtree = child.count > 0 ? Subtree{child.child, child.count, true} : subtrees[child.child];
+            if (merged.count == 0) {
+                merged = subtree;
+            } else {
+                bool adjacent = merged.first + merged.count == subtree.first || subtree.first + subtree.count == merged.first;
+                merged.contiguous = merged.contiguous && subtree.contiguous && adjacent;
+                merged.first = std::min(merged.first, subtree.first);
+                merged.count += subtree.count;
+            }
+        }
+        subtrees[record] = merged;
+    }
+
+    std::vector<BinaryChild> lanes;
+    for (std::uint32_t side = 0; side < 2; side++) {
+        BinaryChild child = readChild(tree, 0, side);
+        if (child.child != NULL_NODE) {
+            lanes.push_back(child);
+        }
+    }
+
+    return collapseNode(tree, subtrees, std::move(lanes));
+}
+
+template <std::uint32_t Width>
+std::uint32_t WideBvh<Width>::collapseNode(const float* tree, const std::vector<Subtree>& subtrees, std::vector<BinaryChild> lanes) {
+    auto fitsLeaf = [&](const BinaryChild& lane) {
+        const Subtree& subtree = subtrees[lane.child];
+        return subtree.contiguous && subtree.count <= m_maxLeafSize;
+    };
+
+    // Open the largest inner child until the node is full; children small enough
+    // to become a leaf are kept whole.
+    while (lanes.size() < Width) {
+        std::int32_t best = -1;
+        float bestArea = -1.0f;
+        for (std::uint32_t i = 0; i < lanes.size(); i++) {
+            if (lanes[i].count == 0 && !fitsLeaf(lanes[i]) && halfArea(lanes[i].bounds) > bestArea) {
+                best = i;
+                bestArea = halfArea(lanes[i].bounds);
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+
+        std::uint32_t record = lanes[best].child;
+        lanes.erase(lanes.begin() + best);
+        for (std::uint32_t side = 0; side < 2; side++) {
+            BinaryChild child = readChild(tree, record, side);
+            if (child.child != NULL_NODE) {
+                lanes.push_back(child);
+            }
+        }
+    }
+
+    std::uint32_t nodeId = m_nodes.size();
+    m_nodes.emplace_back();
+    {
+        WideNode<Width>& node = m_nodes[nodeId];
+        for (std::uint32_t lane = 0; lane < Width; lane++) {
+            node.minX[lane] = node.minY[lane] = node.minZ[lane] = std::numeric_limits<float>::infinity();
+            node.maxX[lane] = node.maxY[lane] = node.maxZ[lane] = -std::numeric_limits<float>::infinity();
+            node.child[lane] = NULL_NODE;
+            node.count[lane] = 0;
+        }
+    }
+
+    for (std::uint32_t lane = 0; lane < lanes.size(); lane++) {
+        const BinaryChild& child = lanes[lane];
+
+        std::uint32_t first = child.child;
+        std::uint32_t count = child.count;
+        if (count == 0) {
+            if (fitsLeaf(child)) {
+                first = subtrees[child.child].first;
+                count = subtrees[child.child].count;
+            } else {
+                std::vector<BinaryChild> grandChildren;
+                for (std::uint32_t side = 0; side < 2; side++) {
+                    BinaryChild grandChild = readChild(tree, child.child, side);
+                    if (grandChild.child != NULL_NODE) {
+                        grandChildren.push_back(grandChild);
+                    }
+                }
+                first = collapseNode(tree, subtrees, std::move(grandChildren));
+            }
+        }
+
+        // The recursion may have grown m_nodes, so look the node up again.
+        WideNode<Width>& node = m_nodes[nodeId];
+        node.minX[lane] = child.bounds[0]; node.minY[lane] = child.bounds[1]; node.minZ[lane] = child.bounds[2];
+        node.maxX[lane] = child.bounds[3]; node.maxY[lane] = child.bounds[4]; node.maxZ[lane] = child.bounds[5];
+        node.child[lane] = first;
+        node.count[lane] = count;
+    }
+
+    return nodeId;
+}
+
+template <std::uint32_t Width>
+template <typename LeafFunction>
+void WideBvh<Width>::traverse(const CpuTracer::Ray& ray, std::uint32_t root, CpuTracer::Intersection& isec, const LeafFunction& intersectLeaf) const {
+    struct Entry {
+        std::uint32_t child;
+        std::uint32_t count;
+        float         dist;
+    };
+
+    constexpr std::uint32_t STACK_SIZE = 64 * Width;
+    Entry stack[STACK_SIZE];
+    std::uint32_t stackIt = 0;
+    stack[stackIt++] = {root, 0, -std::numeric_limits<float>::infinity()};
+
+    while (stackIt > 0) {
+        Entry entry = stack[--stackIt];
+        if (entry.dist >= isec.dist) {
+            continue;
+        }
+        if (entry.count > 0) {
+            intersectLeaf(entry.child, entry.count, isec);
+            continue;
+        }
+
+        const WideNode<Width>& node = m_nodes[entry.child];
+        float dist[Width];
+        std::uint32_t mask = intersectChildren(node, ray, isec.dist, dist);
+
+        // Sort the hit lanes near to far and push them in reverse, so the nearest is popped first.
+        std::uint32_t order[Width];
+        std::uint32_t hitCount = 0;
+        while (mask) {
+            std::uint32_t lane = __builtin_ctz(mask);
+            mask &= mask - 1;
+            if (node.child[lane] == NULL_NODE) {
+                continue;
+            }
+
+            std::uint32_t i = hitCount++;
+            for (; i > 0 && dist[order[i - 1]] < dist[lane]; i--) {
+                order[i] = order[i - 1];
+            }
+            order[i] = lane;
+        }
+
+        for (std::uint32_t i = 0; i < hitCount && stackIt < STACK_SIZE; i++) {
+            std::uint32_t lane = order[i];
+            stack[stackIt++] = {node.child[lane], node.count[lane], dist[lane]};
+        }
+    }
+}
+
+template <std::uint32_t Width>
+void WideBvh<Width>::intersectBLAS(const CpuTracer::Ray& ray, std::uint32_t root, std::uint32_t geometryOffset, CpuTracer::Intersection& isec) const {
+    traverse(ray, root, isec, [&](std::uint32_t first, std::uint32_t count, CpuTracer::Intersection& leafIsec) {
+        for (std::uint32_t slot = first; slot < first + count; slot++) {
+            const float* triangle = &m_buffers.blasTriangles[std::size_t(geometryOffset + slot) * 3 * 4];
+            glm::vec3 v0(triangle[0], triangle[1], triangle[2]);
+            glm::vec3 v1v0(triangle[4], triangle[5], triangle[6]);
+            glm::vec3 v2v0(triangle[8], triangle[9], triangle[10]);
+            glm::vec3 rov0 = ray.origin - v0;
+
+            glm::vec3 n = glm::cross(v1v0, v2v0);
+            glm::vec3 q = glm::cross(rov0, ray.dir);
+            float d = 1.0f / glm::dot(ray.dir, n);
+            float u = d * glm::dot(-q, v2v0);
+            float v = d * glm::dot( q, v1v0);
+            float t = d * glm::dot(-n, rov0);
+
+            if (u >= 0.0f && v >= 0.0f && (u + v) <= 1.0f && t >= 0.0f && t < leafIsec.dist) {
+                leafIsec.dist = t;
+                leafIsec.barycentric = glm::vec2(u, v);
+                leafIsec.blasPrimitiveSlot = slot;
+            }
+        }
+    });
+}
+
+template <std::uint32_t Width>
+void WideBvh<Width>::intersect(const CpuTracer::Ray& ray, CpuTracer::Intersection& isec) const {
+    traverse(ray, m_tlasRoot, isec, [&](std::uint32_t first, std::uint32_t count, CpuTracer::Intersection& leafIsec) {
+        for (std::uint32_t slot = first; slot < first + count; slot++) {
+            std::uint32_t index = m_buffers.tlasPrimitives[slot];
+            if (!aabbHit(ray, &m_buffers.tlasGeometry[index * 8], leafIsec.dist)) {
+                continue;
+            }
+
+            std::uint32_t blas = m_buffers.tlasInstanceBlas[index];
+            CpuTracer::Ray objectRay = CpuTracer::transformRay(ray, &m_buffers.tlasWorldToObject[index * 12]);
+
+            float dist = leafIsec.dist;
+            intersectBLAS(objectRay, m_blasRoots[blas], m_buffers.tlasBlasGeometryOffsets[blas], leafIsec);
+            if (leafIsec.dist < dist) {
+                leafIsec.tlasPrimitiveSlot = slot;
+            }
+        }
+    });
+}
+
+template class WideBvh<4>;
+template class WideBvh<8>;
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "AccelerationStructures.hpp"
+#include "CpuTracer.hpp"
+
+#include <cstdint>
+#include <vector>
+
+// Collapsed BVH for the CPU tracer: every node holds up to Width children with
+// their bounds stored component-wise, so one SIMD sequence tests all of them.
+// Leaves cover a contiguous range of primitive slots, the same slots the binary
+// layouts use, so the geometry buffers are shared as they are.
+template <std::uint32_t Width>
+struct alignas(32) WideNode {
+    float         minX[Width], minY[Width], minZ[Width];
+    float         maxX[Width], maxY[Width], maxZ[Width];
+    // Inner child: node index and a zero count. Leaf: first primitive slot and count.
+    // Unused lanes have a NULL_NODE child.
+    std::uint32_t child[Width];
+    std::uint32_t count[Width];
+};
+
+template <std::uint32_t Width>
+class WideBvh {
+private:
+    struct BinaryChild {
+        float         bounds[6];
+        std::uint32_t child;
+        std::uint32_t count;
+    };
+
+    struct Subtree {
+        std::uint32_t first;
+        std::uint32_t count;
+        bool          contiguous;
+    };
+
+    const CpuTracer::Buffers&    m_buffers;
+    std::uint32_t                m_maxLeafSize;
+    std::vector<WideNode<Width>> m_nodes;
+    std::uint32_t                m_tlasRoot;
+    std::vector<std::uint32_t>   m_blasRoots;
+
+    static BinaryChild readChild(const float* tree, std::uint32_t record, std::uint32_t side);
+
+    // Collapses the tree stored in `nodes` (packed layout, records [first, first + count))
+    // and returns the index of its root node.
+    std::uint32_t collapseTree(const float* nodes, std::uint32_t first, std::uint32_t count);
+    std::uint32_t collapseNode(const float* tree, const std::vector<Subtree>& subtrees, std::vector<BinaryChild> lanes);
+
+    void intersectBLAS(const CpuTracer::Ray& ray, std::uint32_t root, std::uint32_t geometryOffset, CpuTracer::Intersection& isec) const;
+
+    template <typename LeafFunction>
+    void traverse(const CpuTracer::Ray& ray, std::uint32_t root, CpuTracer::Intersection& isec, const LeafFunction& intersectLeaf) const;
+
+public:
+    // Collapses the packed TLAS and BLAS nodes, so it works the same for freshly
+    // built and cache-mapped structures. `buffers` has to outlive the tree.
+    WideBvh(const AccelerationStructures& accels, const CpuTracer::Buffers& buffers, std::uint32_t maxLeafSize = Width);
+
+    void intersect(const CpuTracer::Ray& ray, CpuTracer::Intersection& isec) const;
+
+    std::size_t getNodeCount() const { return m_nodes.size(); }
+    std::size_t getMemorySize() const { return m_nodes.size() * sizeof(WideNode<Width>); }
+};
@@ -0,0 +1,52 @@
+#version 430
+
+uniform ivec2 u_screenSize;
+
+layout(local_size_x = 8, local_size_y = 8) in;
+
+// shade.glsl leaves this frame's sample with alpha 1 in the pixels that got a camera ray, or with
+// PATH_REGENERATION a tally vec4(radiance sum, sum of squares, 0, paths) of the paths it finished.
+layout(rgba32f, binding = 0)           uniform image2D samples;
+layout(rgba32f, binding = 1) writeonly uniform image2D outColor;
+
+// Per pixel: mean and sample count, then the sum of squared differences from the mean (Welford).
+layout(std430, binding = 15) buffer Accumulation { vec4 accumulation[]; };
+
+void main() {
+    ivec2 pixelCoords = ivec2(gl_GlobalInvocationID.xy);
+    if (pixelCoords.x >= u_screenSize.x || pixelCoords.y >= u_screenSize.y) {
+        return;
+    }
+
+    vec4 value = imageLoad(samples, pixelCoords);
+    if (value.a == 0.0) {
+        return;
+    }
+    imageStore(samples, pixelCoords, vec4(0.0));
+
+    uint pixel = uint(pixelCoords.y * u_screenSize.x + pixelCoords.x);
+    vec4 meanAndCount = accumulation[pixel * 2 + 0];
+    vec3 m2 = accumulation[pixel * 2 + 1].xyz;
+
+#ifdef PATH_REGENERATION
+    // Chan's update, folding in the tallied paths as one batch.
+    float batchCount = value.a;
+    vec3 batchMean = vec3(value.r / batchCount);
+    vec3 batchM2 = vec3(max(value.g - value.r * batchMean.r, 0.0));
+
+    float samplesCount = meanAndCount.w + batchCount;
+    vec3 delta = batchMean - meanAndCount.xyz;
+    vec3 mean = meanAndCount.xyz + delta * (batchCount / samplesCount);
+    m2 += batchM2 + delta * delta * (meanAndCount.w * batchCount / samplesCount);
+#else
+    float samplesCount = meanAndCount.w + 1.0;
+    vec3 delta = value.rgb - meanAndCount.xyz;
+    vec3 mean = meanAndCount.xyz + delta / samplesCount;
+    m2 += delta * (value.rgb - mean);
+#endif
+
+    accumulation[pixel * 2 + 0] = vec4(mean, samplesCount);
+    accumulation[pixel * 2 + 1] = vec4(m2, 0.0);
+
+    imageStore(outColor, pixelCoords, vec4(mean, 1.0));
+}
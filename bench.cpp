@@ -0,0 +1,677 @@
+#include "AccelerationStructures.hpp"
+#include "CpuTracer.hpp"
+#include "PacketTracer.hpp"
+#include "SceneLoader.hpp"
+#include "ThreadPool.hpp"
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+    std::vector<CpuTracer::Ray> makePrimaryRays(std::uint32_t width, std::uint32_t height) {
+        glm::mat4 viewInv = glm::inverse(glm::lookAt(glm::vec3(0.0f, 10.0f, 50.0f), glm::vec3(0.0f, 10.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f)));
+        glm::vec3 origin = glm::vec3(viewInv * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
+
+        std::vector<CpuTracer::Ray> rays;
+        rays.reserve(width * height);
+        for (std::uint32_t y = 0; y < height; y++) {
+            for (std::uint32_t x = 0; x < width; x++) {
+                glm::vec2 xy = glm::vec2(2.0f * float(x * 2.0f - width) / float(width), 2.0f * float(y * 2.0f - height) / float(height));
+                xy.x *= float(width) / float(height);
+
+                CpuTracer::Ray ray;
+                ray.origin = origin;
+                ray.dir = glm::vec3(viewInv * glm::vec4(glm::normalize(glm::vec3(xy.x, xy.y, -5.0f)), 0.0f));
+                ray.invDir = CpuTracer::safeInvDir(ray.dir);
+                rays.push_back(ray);
+            }
+        }
+        return rays;
+    }
+
+    std::vector<CpuTracer::Ray> makeRandomRays(const AccelerationStructures& accels, std::uint32_t count) {
+        const float* root = accels.getBuffer(AccelerationStructures::Buffer::TlasAABB).as<float>();
+        glm::vec3 boundsMin(root[0], root[1], root[2]);
+        glm::vec3 boundsMax(root[4], root[5], root[6]);
+
+        std::mt19937 rng(42);
+        std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+        std::normal_distribution<float> normal(0.0f, 1.0f);
+
+        std::vector<CpuTracer::Ray> rays(count);
+        for (auto& ray : rays) {
+            ray.origin = boundsMin + (boundsMax - boundsMin) * glm::vec3(unit(rng), unit(rng), unit(rng));
+            ray.dir = glm::normalize(glm::vec3(normal(rng), normal(rng), normal(rng)));
+            ray.invDir = CpuTracer::safeInvDir(ray.dir);
+        }
+        return rays;
+    }
+
+    // Diffuse bounces off the first hit of every ray that hits, like the second extend of a frame.
+    std::vector<CpuTracer::Ray> makeSecondaryRays(const CpuTracer& tracer, const std::vector<CpuTracer::Ray>& primaryRays) {
+        const auto& buffers = tracer.getBuffers();
+        std::mt19937 rng(43);
+        std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+        std::vector<CpuTracer::Ray> rays;
+        rays.reserve(primaryRays.size());
+        for (const auto& primary : primaryRays) {
+            CpuTracer::Intersection isec = tracer.intersect(primary);
+            if (isec.dist < 0.0f) continue;
+
+            std::uint32_t tlasIndex = buffers.tlasPrimitives[isec.tlasPrimitiveSlot];
+            std::uint32_t slot = buffers.tlasBlasGeometryOffsets[buffers.tlasInstanceBlas[tlasIndex]] + isec.blasPrimitiveSlot;
+            const float* e1 = &buffers.blasTriangles[(slot * 3 + 1) * 4];
+            const float* e2 = &buffers.blasTriangles[(slot * 3 + 2) * 4];
+            glm::vec3 objectNormal = glm::cross(glm::vec3(e1[0], e1[1], e1[2]), glm::vec3(e2[0], e2[1], e2[2]));
+
+            const float* worldToObject = &buffers.tlasWorldToObject[tlasIndex * 12];
+            glm::vec3 normal;
+            for (std::uint32_t i = 0; i < 3; i++) {
+                normal[i] = worldToObject[0 * 4 + i] * objectNormal.x + worldToObject[1 * 4 + i] * objectNormal.y + worldToObject[2 * 4 + i] * objectNormal.z;
+            }
+            normal = glm::normalize(normal);
+            if (glm::dot(normal, primary.dir) > 0.0f) normal = -normal;
+
+            // Cosine weighted around the normal.
+            glm::vec3 tangent = glm::normalize(glm::cross(std::abs(normal.x) > 0.5f ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(1.0f, 0.0f, 0.0f), normal));
+            glm::vec3 bitangent = glm::cross(normal, tangent);
+            float r = std::sqrt(unit(rng));
+            float phi = 2.0f * 3.14159265f * unit(rng);
+
+            CpuTracer::Ray ray;
+            ray.origin = primary.origin + primary.dir * isec.dist + normal * 0.001f;
+            ray.dir = tangent * (r * std::cos(phi)) + bitangent * (r * std::sin(phi)) + normal * std::sqrt(std::max(0.0f, 1.0f - r * r));
+            ray.invDir = CpuTracer::safeInvDir(ray.dir);
+            rays.push_back(ray);
+        }
+        return rays;
+    }
+
+    // Random triangles in the camera's view, a stand-in for scenes of any size.
+    AccelerationStructures::Mesh makeSyntheticMesh(std::uint32_t triangleCount) {
+        std::mt19937 rng(triangleCount);
+        std::uniform_real_distribution<float> position(-20.0f, 20.0f);
+        std::uniform_real_distribution<float> offset(-1.0f, 1.0f);
+
+        // Keeps the triangle area roughly constant relative to the scene as it grows.
+        float size = 8.0f / std::cbrt(float(triangleCount));
+
+        AccelerationStructures::Mesh mesh;
+        mesh.positions.reserve(triangleCount * 9);
+        mesh.normals.reserve(triangleCount * 9);
+        mesh.indices.reserve(triangleCount * 3);
+        for (std::uint32_t i = 0; i < triangleCount; i++) {
+            glm::vec3 center(position(rng), position(rng) * 0.5f + 10.0f, position(rng));
+            for (std::uint32_t corner = 0; corner < 3; corner++) {
+                glm::vec3 vertex = center + size * glm::vec3(offset(rng), offset(rng), offset(rng));
+                mesh.positions.insert(mesh.positions.end(), {vertex.x, vertex.y, vertex.z});
+                mesh.normals.insert(mesh.normals.end(), {0.0f, 1.0f, 0.0f});
+                mesh.indices.push_back(i * 3 + corner);
+            }
+        }
+        return mesh;
+    }
+
+    struct TraceResult {
+        double        raysPerSecond = 0.0;
+        std::uint32_t hits          = 0;
+    };
+
+    TraceResult traceRays(const CpuTracer& tracer, const std::vector<CpuTracer::Ray>& rays, ThreadPool& pool, std::uint32_t repetitions) {
+        TraceResult result;
+        std::atomic<std::uint32_t> hits(0);
+
+        auto start = std::chrono::steady_clock::now();
+        for (std::uint32_t repetition = 0; repetition < repetitions; repetition++) {
+            hits = 0;
+            pool.parallelFor(0, rays.size(), 256, [&](std::uint32_t begin, std::uint32_t end) {
+                std::uint32_t localHits = 0;
+                for (std::uint32_t i = begin; i < end; i++) {
+                    if (tracer.intersect(rays[i]).dist >= 0.0f) localHits++;
+                }
+                hits += localHits;
+            });
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        result.raysPerSecond = double(rays.size()) * repetitions / seconds;
+        result.hits = hits;
+        return result;
+    }
+
+    // Traces a width wide image of rays in scanline order as PacketTracer::PACKET_WIDTH square packets.
+    TraceResult tracePackets(const PacketTracer& tracer, const std::vector<CpuTracer::Ray>& rays, std::uint32_t width, ThreadPool& pool,
+                             std::uint32_t repetitions) {
+        constexpr std::uint32_t PACKET_WIDTH = PacketTracer::PACKET_WIDTH;
+
+        TraceResult result;
+        std::atomic<std::uint32_t> hits(0);
+
+        std::uint32_t height = rays.size() / width;
+        std::uint32_t packetsX = (width + PACKET_WIDTH - 1) / PACKET_WIDTH;
+        std::uint32_t packetsY = (height + PACKET_WIDTH - 1) / PACKET_WIDTH;
+
+        auto start = std::chrono::steady_clock::now();
+        for (std::uint32_t repetition = 0; repetition < repetitions; repetition++) {
+            hits = 0;
+            pool.parallelFor(0, packetsX * packetsY, 16, [&](std::uint32_t begin, std::uint32_t end) {
+                CpuTracer::Ray packetRays[PacketTracer::PACKET_SIZE];
+                CpuTracer::Intersection isecs[PacketTracer::PACKET_SIZE];
+                std::uint32_t localHits = 0;
+                for (std::uint32_t packet = begin; packet < end; packet++) {
+                    std::uint32_t packetX = packet % packetsX * PACKET_WIDTH;
+                    std::uint32_t packetY = packet / packetsX * PACKET_WIDTH;
+
+                    std::uint32_t count = 0;
+                    for (std::uint32_t y = packetY; y < std::min(packetY + PACKET_WIDTH, height); y++) {
+                        for (std::uint32_t x = packetX; x < std::min(packetX + PACKET_WIDTH, width); x++) {
+                            packetRays[count++] = rays[y * width + x];
+                        }
+                    }
+
+                    tracer.intersect(packetRays, count, isecs);
+                    for (std::uint32_t i = 0; i < count; i++) {
+                        if (isecs[i].dist >= 0.0f) localHits++;
+                    }
+                }
+                hits += localHits;
+            });
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        result.raysPerSecond = double(rays.size()) * repetitions / seconds;
+        result.hits = hits;
+        return result;
+    }
+
+    struct RaySetReport {
+        std::string name;
+        std::size_t count = 0;
+        std::vector<std::pair<std::string, TraceResult>> tracers;
+    };
+
+    struct SceneReport {
+        std::string name;
+        SceneLoader::Stats build;
+        std::size_t instances = 0;
+        std::vector<std::pair<std::string, std::size_t>> memory;
+        std::vector<RaySetReport> raySets;
+    };
+
+    struct BuilderReport {
+        AccelerationStructures::BuildOptions blas;
+        std::uint32_t references   = 0;
+        std::uint32_t nodes        = 0;
+        // Triangle weighted mean over the BLASes.
+        float         blasSahCost  = 0.0f;
+        double        blasSeconds  = 0.0;
+        AccelerationStructures::BuildStats tlas;
+        TraceResult   primary;
+    };
+
+    struct DeepBlasReport {
+        std::uint32_t quads = 0;
+        std::uint32_t depth = 0;
+        std::size_t   rays  = 0;
+        std::vector<std::pair<std::string, TraceResult>> tracers;
+    };
+
+    struct DynamicTlasReport {
+        std::size_t   instances     = 0;
+        std::uint32_t frames        = 0;
+        std::uint32_t rebuilds      = 0;
+        double        buildSeconds  = 0.0;
+        double        updateSeconds = 0.0;
+    };
+
+    std::size_t bufferBytes(const AccelerationStructures& accels, std::initializer_list<AccelerationStructures::Buffer> buffers) {
+        std::size_t bytes = 0;
+        for (auto buffer : buffers) {
+            bytes += accels.getBuffer(buffer).size;
+        }
+        return bytes;
+    }
+
+    SceneReport benchScene(const std::string& name, const SceneLoader::Stats& build, const AccelerationStructures& accels, ThreadPool& pool,
+                           std::uint32_t repetitions) {
+        SceneReport report;
+        report.name = name;
+        report.build = build;
+        report.instances = accels.getInstances().size();
+
+        std::cout << "== " << name << ": " << build.triangles << " triangles, " << report.instances << " instances, BLAS "
+                  << build.blasSeconds * 1e3 << " ms, TLAS " << build.tlasSeconds * 1e3 << " ms" << std::endl;
+
+        CpuTracer splitTracer(accels, CpuTracer::NodeLayout::Split);
+        CpuTracer packedTracer(accels, CpuTracer::NodeLayout::Packed);
+        CpuTracer wide4Tracer(accels, CpuTracer::NodeLayout::Wide4);
+        CpuTracer wide8Tracer(accels, CpuTracer::NodeLayout::Wide8);
+        CpuTracer splitStacklessTracer(accels, CpuTracer::NodeLayout::Split, CpuTracer::Traversal::Stackless);
+        CpuTracer packedStacklessTracer(accels, CpuTracer::NodeLayout::Packed, CpuTracer::Traversal::Stackless);
+        PacketTracer packetTracer(splitTracer);
+
+        using Buffer = AccelerationStructures::Buffer;
+        report.memory = {
+            {"splitNodes",   bufferBytes(accels, {Buffer::TlasAABB, Buffer::TlasChild, Buffer::TlasIsLeaf, Buffer::TlasBlasNodeOffset,
+                                                  Buffer::BlasAABB, Buffer::BlasChild, Buffer::BlasIsLeaf})},
+            {"packedNodes",  bufferBytes(accels, {Buffer::TlasNode, Buffer::TlasBlasPackedNodeOffset, Buffer::BlasNode})},
+            {"wide4Nodes",   wide4Tracer.getWideNodeMemorySize()},
+            {"wide8Nodes",   wide8Tracer.getWideNodeMemorySize()},
+            {"nodeLinks",    bufferBytes(accels, {Buffer::TlasNodeLink, Buffer::BlasNodeLink})},
+            {"intersection", bufferBytes(accels, {Buffer::BlasTriangle})},
+            {"shading",      bufferBytes(accels, {Buffer::BlasIndex, Buffer::BlasNormal, Buffer::BlasMaterial})},
+            {"instances",    bufferBytes(accels, {Buffer::TlasGeometry, Buffer::TlasPrimitiveId, Buffer::TlasBlasGeometryOffset, Buffer::TlasInstanceBlas,
+                                                  Buffer::TlasWorldToObject, Buffer::TlasObjectToWorld})}
+        };
+
+        std::cout << "Memory:";
+        for (const auto& [category, bytes] : report.memory) {
+            std::cout << " " << category << " " << bytes;
+        }
+        std::cout << " bytes" << std::endl;
+
+        std::vector<std::pair<std::string, const CpuTracer*>> tracers = {
+            {"split", &splitTracer}, {"packed", &packedTracer}, {"wide4", &wide4Tracer}, {"wide8", &wide8Tracer},
+            {"splitStackless", &splitStacklessTracer}, {"packedStackless", &packedStacklessTracer}
+        };
+
+        constexpr std::uint32_t PRIMARY_WIDTH = 1600;
+        std::vector<CpuTracer::Ray> primaryRays = makePrimaryRays(PRIMARY_WIDTH, 900);
+        std::vector<CpuTracer::Ray> secondaryRays = makeSecondaryRays(splitTracer, primaryRays);
+        std::vector<std::pair<std::string, std::vector<CpuTracer::Ray>>> raySets;
+        raySets.emplace_back("primary", std::move(primaryRays));
+        raySets.emplace_back("secondary", std::move(secondaryRays));
+        raySets.emplace_back("random", makeRandomRays(accels, 1 << 20));
+
+        for (const auto& [setName, rays] : raySets) {
+            RaySetReport& setReport = report.raySets.emplace_back();
+            setReport.name = setName;
+            setReport.count = rays.size();
+
+            auto addResult = [&](const std::string& tracerName, const TraceResult& result) {
+                const TraceResult& split = setReport.tracers.empty() ? result : setReport.tracers[0].second;
+
+                std::cout << " " << tracerName << " " << result.raysPerSecond / 1e6 << " Mrays/s";
+                if (&split != &result) {
+                    std::cout << " (" << result.raysPerSecond / split.raysPerSecond << "x)";
+                    if (result.hits != split.hits) {
+                        std::cout << " [hit count mismatch: " << result.hits << " vs " << split.hits << "]";
+                    }
+                }
+                setReport.tracers.emplace_back(tracerName, result);
+            };
+
+            std::cout << setName << " rays (" << rays.size() << "):";
+            for (const auto& [tracerName, tracer] : tracers) {
+                addResult(tracerName, traceRays(*tracer, rays, pool, repetitions));
+            }
+            // Only the camera rays form an image to cut into packets.
+            if (setName == "primary") {
+                addResult("packets", tracePackets(packetTracer, rays, PRIMARY_WIDTH, pool, repetitions));
+            }
+            std::cout << std::endl;
+        }
+
+        return report;
+    }
+
+    std::string jsonString(const std::string& value) {
+        std::string escaped = "\"";
+        for (char c : value) {
+            if (c == '"' || c == '\\') escaped += '\\';
+            escaped += c;
+        }
+        return escaped + "\"";
+    }
+
+    // One object per run; the layout is meant to stay stable so runs can be compared over time.
+    bool writeJson(const std::string& path, std::uint32_t threads, std::uint32_t repetitions, const std::vector<SceneReport>& scenes,
+                   const std::vector<BuilderReport>& builders, const DeepBlasReport& deepBlas, const DynamicTlasReport& dynamicTlas) {
+        std::ofstream output(path);
+        if (!output) {
+            return false;
+        }
+        output.precision(9);
+
+        output << "{\n  \"threads\": " << threads << ",\n  \"repetitions\": " << repetitions << ",\n  \"scenes\": [";
+        for (std::size_t sceneId = 0; sceneId < scenes.size(); sceneId++) {
+            const SceneReport& scene = scenes[sceneId];
+            output << (sceneId ? "," : "") << "\n    {\n"
+                   << "      \"name\": " << jsonString(scene.name) << ",\n"
+                   << "      \"triangles\": " << scene.build.triangles << ",\n"
+                   << "      \"instances\": " << scene.instances << ",\n"
+                   << "      \"importSeconds\": " << scene.build.importSeconds << ",\n"
+                   << "      \"blasBuildSeconds\": " << scene.build.blasSeconds << ",\n"
+                   << "      \"tlasBuildSeconds\": " << scene.build.tlasSeconds << ",\n"
+                   << "      \"memoryBytes\": {";
+            for (std::size_t i = 0; i < scene.memory.size(); i++) {
+                output << (i ? ", " : "") << jsonString(scene.memory[i].first) << ": " << scene.memory[i].second;
+            }
+            output << "},\n      \"rays\": {";
+            for (std::size_t setId = 0; setId < scene.raySets.size(); setId++) {
+                const RaySetReport& set = scene.raySets[setId];
+                output << (setId ? "," : "") << "\n        " << jsonString(set.name) << ": {\"count\": " << set.count;
+                for (const auto& [tracerName, result] : set.tracers) {
+                    output << ", " << jsonString(tracerName) << ": {\"raysPerSecond\": " << result.raysPerSecond << ", \"hits\": " << result.hits << "}";
+                }
+                output << "}";
+            }
+            output << "\n      }\n    }";
+        }
+        output << "\n  ],\n  \"builders\": [";
+        for (std::size_t i = 0; i < builders.size(); i++) {
+            const BuilderReport& builder = builders[i];
+            output << (i ? "," : "") << "\n    {\"builder\": " << jsonString(AccelerationStructures::getBuilderName(builder.blas.builder))
+                   << ", \"maxLeafSize\": " << builder.blas.maxLeafSize << ", \"references\": " << builder.references
+                   << ", \"nodes\": " << builder.nodes << ", \"blasSahCost\": " << builder.blasSahCost << ", \"blasBuildSeconds\": " << builder.blasSeconds
+                   << ", \"tlasNodes\": " << builder.tlas.nodes << ", \"tlasSahCost\": " << builder.tlas.sahCost << ", \"tlasBuildSeconds\": " << builder.tlas.seconds
+                   << ", \"primary\": {\"raysPerSecond\": " << builder.primary.raysPerSecond << ", \"hits\": " << builder.primary.hits << "}}";
+        }
+        output << "\n  ],\n  \"deepBlas\": {\"quads\": " << deepBlas.quads << ", \"depth\": " << deepBlas.depth << ", \"rays\": " << deepBlas.rays;
+        for (const auto& [tracerName, result] : deepBlas.tracers) {
+            output << ", " << jsonString(tracerName) << ": {\"raysPerSecond\": " << result.raysPerSecond << ", \"hits\": " << result.hits << "}";
+        }
+        output << "},\n  \"dynamicTlas\": {\"instances\": " << dynamicTlas.instances << ", \"frames\": " << dynamicTlas.frames
+               << ", \"buildSeconds\": " << dynamicTlas.buildSeconds << ", \"updateSecondsPerFrame\": " << dynamicTlas.updateSeconds / std::max(dynamicTlas.frames, 1u)
+               << ", \"rebuilds\": " << dynamicTlas.rebuilds << "}\n}\n";
+        return bool(output);
+    }
+
+    // Rebuilds the scene with every builder and traces its primary rays, so build time can be
+    // weighed against SAH cost and the trace speed it buys.
+    std::vector<BuilderReport> benchBuilders(const std::string& scene, ThreadPool& pool, std::uint32_t repetitions) {
+        using Builder = AccelerationStructures::Builder;
+        const std::vector<AccelerationStructures::BuildOptions> configurations = {
+            {Builder::SweepSah, 1}, {Builder::BinnedSah, 1}, {Builder::SpatialSplit, 1}, {Builder::Linear, 1},
+            {Builder::SweepSah, 4}, {Builder::Linear, 4}
+        };
+        std::vector<CpuTracer::Ray> rays = makePrimaryRays(1600, 900);
+
+        std::vector<BuilderReport> reports;
+        for (const auto& options : configurations) {
+            AccelerationStructures accels;
+            accels.setTlasBuildOptions(options);
+            SceneLoader sceneLoader;
+            sceneLoader.setBuildOptions(options);
+            SceneLoader::Stats stats = sceneLoader.load(scene, accels, pool, false);
+
+            BuilderReport& report = reports.emplace_back();
+            report.blas = options;
+            report.blasSeconds = stats.blasSeconds;
+            report.tlas = stats.tlas;
+            double weightedCost = 0.0;
+            for (const auto& blas : stats.blas) {
+                report.references += blas.references;
+                report.nodes += blas.nodes;
+                weightedCost += double(blas.sahCost) * blas.triangles;
+            }
+            report.blasSahCost = float(weightedCost / std::max<std::uint64_t>(stats.triangles, 1));
+
+            CpuTracer tracer(accels, CpuTracer::NodeLayout::Packed);
+            report.primary = traceRays(tracer, rays, pool, repetitions);
+
+            std::cout << "Builder " << AccelerationStructures::getBuilderName(options.builder) << " (leaf size " << options.maxLeafSize << "): BLAS "
+                      << report.blasSeconds * 1e3 << " ms, " << report.nodes << " nodes, " << report.references << " references, SAH "
+                      << report.blasSahCost << ", TLAS SAH " << report.tlas.sahCost << ", primary " << report.primary.raysPerSecond / 1e6
+                      << " Mrays/s, " << report.primary.hits << " hits" << std::endl;
+        }
+        return reports;
+    }
+
+    // A row of quads along x, every one farther and larger than the one before, so each quad's
+    // box holds the nearer ones. That keeps SAH splitting a few far quads off at a time and makes
+    // the BLAS far deeper than its triangle count needs. A ray along the row reaches the nearest
+    // quad, which every ray hits, last; the stack traversals give up past 32 pending subtrees.
+    DeepBlasReport benchDeepBlas(ThreadPool& pool, std::uint32_t repetitions) {
+        const std::uint32_t quads = 40;
+        const std::uint32_t raysPerSide = 256;
+
+        AccelerationStructures accels;
+        AccelerationStructures::Mesh row;
+        for (std::uint32_t quad = 0; quad < quads; quad++) {
+            float x = std::pow(2.5f, float(quad));
+            for (std::uint32_t corner = 0; corner < 4; corner++) {
+                row.positions.insert(row.positions.end(), {x, (corner & 1) ? x : -x, (corner & 2) ? x : -x});
+                row.normals.insert(row.normals.end(), {-1.0f, 0.0f, 0.0f});
+            }
+            std::uint32_t first = quad * 4;
+            row.indices.insert(row.indices.end(), {first + 0, first + 1, first + 3, first + 0, first + 3, first + 2});
+        }
+        accels.addBLAS(row);
+
+        accels.addInstance(0, AccelerationStructures::IDENTITY_TRANSFORM);
+        accels.buildTLAS(&pool);
+
+        DeepBlasReport report;
+        report.quads = quads;
+
+        // Depth of the deepest node, following the parent links up to the root.
+        const auto& linkView = accels.getBuffer(AccelerationStructures::Buffer::BlasNodeLink);
+        const std::uint32_t* links = linkView.as<std::uint32_t>();
+        for (std::uint32_t node = 0; node < linkView.size / sizeof(std::uint32_t); node++) {
+            std::uint32_t depth = 0;
+            for (std::uint32_t parent = node; parent != 0; parent = links[parent] >> 1) {
+                depth++;
+            }
+            report.depth = std::max(report.depth, depth);
+        }
+
+        std::vector<CpuTracer::Ray> rays;
+        for (std::uint32_t y = 0; y < raysPerSide; y++) {
+            for (std::uint32_t z = 0; z < raysPerSide; z++) {
+                CpuTracer::Ray ray;
+                ray.origin = glm::vec3(-1.0f, (y + 0.5f) / raysPerSide * 1.8f - 0.9f, (z + 0.5f) / raysPerSide * 1.8f - 0.9f);
+                ray.dir = glm::vec3(1.0f, 0.0f, 0.0f);
+                ray.invDir = CpuTracer::safeInvDir(ray.dir);
+                rays.push_back(ray);
+            }
+        }
+        report.rays = rays.size();
+
+        CpuTracer splitTracer(accels, CpuTracer::NodeLayout::Split);
+        CpuTracer packedTracer(accels, CpuTracer::NodeLayout::Packed);
+        CpuTracer splitStacklessTracer(accels, CpuTracer::NodeLayout::Split, CpuTracer::Traversal::Stackless);
+        CpuTracer packedStacklessTracer(accels, CpuTracer::NodeLayout::Packed, CpuTracer::Traversal::Stackless);
+        PacketTracer packetTracer(splitTracer);
+        std::vector<std::pair<std::string, const CpuTracer*>> tracers = {
+            {"split", &splitTracer}, {"packed", &packedTracer}, {"splitStackless", &splitStacklessTracer}, {"packedStackless", &packedStacklessTracer}
+        };
+
+        std::cout << "Deep BLAS (" << quads << " quads, depth " << report.depth << ", " << rays.size() << " rays):";
+        for (const auto& [tracerName, tracer] : tracers) {
+            TraceResult result = traceRays(*tracer, rays, pool, repetitions);
+            std::cout << " " << tracerName << " " << result.raysPerSecond / 1e6 << " Mrays/s, " << result.hits << " hits";
+            report.tracers.emplace_back(tracerName, result);
+        }
+        // The rays are a raysPerSide wide image, so the packets are square blocks of the grid.
+        TraceResult packets = tracePackets(packetTracer, rays, raysPerSide, pool, repetitions);
+        std::cout << " packets " << packets.raysPerSecond / 1e6 << " Mrays/s, " << packets.hits << " hits";
+        report.tracers.emplace_back("packets", packets);
+        std::cout << std::endl;
+
+        return report;
+    }
+
+    // Thousands of instances of one cube on a grid, every one of them moved each frame.
+    DynamicTlasReport benchDynamicTlas(ThreadPool& pool) {
+        const std::uint32_t gridSize = 64;
+        const std::uint32_t frames = 100;
+
+        AccelerationStructures accels;
+        AccelerationStructures::Mesh cube;
+        for (std::uint32_t corner = 0; corner < 8; corner++) {
+            cube.positions.insert(cube.positions.end(), {float(corner & 1), float((corner >> 1) & 1), float((corner >> 2) & 1)});
+            cube.normals.insert(cube.normals.end(), {0.0f, 1.0f, 0.0f});
+        }
+        cube.indices = {0, 1, 3, 0, 3, 2, 4, 6, 7, 4, 7, 5, 0, 4, 5, 0, 5, 1,
+                        2, 3, 7, 2, 7, 6, 0, 2, 6, 0, 6, 4, 1, 5, 7, 1, 7, 3};
+        accels.addBLAS(cube);
+
+        std::vector<std::array<float, 12>> transforms;
+        for (std::uint32_t z = 0; z < gridSize; z++) {
+            for (std::uint32_t x = 0; x < gridSize; x++) {
+                auto transform = AccelerationStructures::IDENTITY_TRANSFORM;
+                transform[3] = x * 3.0f;
+                transform[11] = z * 3.0f;
+                transforms.push_back(transform);
+                accels.addInstance(0, transform);
+            }
+        }
+
+        auto buildStart = std::chrono::steady_clock::now();
+        accels.buildTLAS(&pool);
+        double buildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - buildStart).count();
+
+        std::mt19937 rng(7);
+        std::uniform_real_distribution<float> jitter(-0.5f, 0.5f);
+        std::uint32_t rebuilds = 0;
+        double updateSeconds = 0.0;
+        for (std::uint32_t frame = 0; frame < frames; frame++) {
+            for (std::uint32_t i = 0; i < transforms.size(); i++) {
+                auto transform = transforms[i];
+                transform[7] += jitter(rng);
+                transform[3] += jitter(rng) * 0.1f * frame;
+                accels.setInstanceTransform(i, transform);
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            auto update = accels.updateTLAS(&pool);
+            updateSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            rebuilds += update.rebuilt;
+        }
+
+        std::cout << "Dynamic TLAS (" << transforms.size() << " instances): build " << buildSeconds * 1e3 << " ms, update "
+                  << updateSeconds / frames * 1e3 << " ms per frame, " << rebuilds << " rebuilds in " << frames << " frames" << std::endl;
+
+        return {transforms.size(), frames, rebuilds, buildSeconds, updateSeconds};
+    }
+
+    // With several instances per TLAS leaf a rebuild can change the node count, which has to
+    // show up as a resized update or the renderer uploads into buffers of the old size.
+    bool checkTlasResize(ThreadPool& pool) {
+        const std::uint32_t instances = 256;
+        const std::uint32_t frames = 16;
+
+        AccelerationStructures accels;
+        accels.setTlasBuildOptions({AccelerationStructures::Builder::SweepSah, 4});
+        AccelerationStructures::Mesh triangle;
+        triangle.positions = {0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f};
+        triangle.normals = {0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f};
+        triangle.indices = {0, 1, 2};
+        accels.addBLAS(triangle);
+
+        std::mt19937 rng(11);
+        std::uniform_real_distribution<float> position(0.0f, 100.0f);
+        for (std::uint32_t i = 0; i < instances; i++) {
+            auto transform = AccelerationStructures::IDENTITY_TRANSFORM;
+            transform[3] = i * 2.0f;
+            accels.addInstance(0, transform);
+        }
+        accels.buildTLAS(&pool);
+
+        // Scattering every instance makes the refit far worse than a fresh build, so each frame rebuilds.
+        std::uint32_t resizes = 0;
+        bool consistent = true;
+        for (std::uint32_t frame = 0; frame < frames; frame++) {
+            for (std::uint32_t i = 0; i < instances; i++) {
+                auto transform = AccelerationStructures::IDENTITY_TRANSFORM;
+                transform[3] = position(rng);
+                transform[7] = position(rng) * (frame % 2 ? 1.0f : 0.01f);
+                transform[11] = position(rng);
+                accels.setInstanceTransform(i, transform);
+            }
+
+            std::size_t nodeBytes = accels.getBuffer(AccelerationStructures::Buffer::TlasAABB).size;
+            auto update = accels.updateTLAS(&pool);
+            bool resized = accels.getBuffer(AccelerationStructures::Buffer::TlasAABB).size != nodeBytes;
+            resizes += resized;
+            for (std::uint32_t buffer = 0; buffer < AccelerationStructures::BUFFER_COUNT; buffer++) {
+                const auto& range = update.ranges[buffer];
+                consistent &= range.offset + range.size <= accels.getBuffer(AccelerationStructures::Buffer(buffer)).size;
+            }
+            consistent &= !resized || (update.rebuilt && update.resized);
+        }
+
+        std::cout << "TLAS resize (" << instances << " instances, leaf size 4): " << resizes << " of " << frames
+                  << " rebuilds changed the node count, " << (consistent ? "all flagged" : "NOT flagged as resized") << std::endl;
+        return consistent;
+    }
+
+}
+
+// BvhBench [scene] [repetitions] [--json results.json] [--synthetic-max triangles]
+// Builds are always timed from scratch, the scene cache is not used.
+int main(int argc, char** argv) {
+    std::vector<std::string> positional;
+    std::string jsonPath;
+    std::uint32_t syntheticMax = 1 << 20;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--json" && i + 1 < argc) {
+            jsonPath = argv[++i];
+        } else if (arg == "--synthetic-max" && i + 1 < argc) {
+            syntheticMax = std::atoi(argv[++i]);
+        } else {
+            positional.push_back(arg);
+        }
+    }
+
+    std::string scene = positional.size() > 0 ? positional[0] : "sponza.obj";
+    std::uint32_t repetitions = positional.size() > 1 ? std::atoi(positional[1].c_str()) : 4;
+
+    ThreadPool pool;
+    std::vector<SceneReport> reports;
+
+    {
+        AccelerationStructures accels;
+        SceneLoader sceneLoader;
+        SceneLoader::Stats stats = sceneLoader.load(scene, accels, pool, false);
+        reports.push_back(benchScene(scene, stats, accels, pool, repetitions));
+    }
+
+    for (std::uint32_t triangles = 1 << 14; triangles <= syntheticMax; triangles *= 4) {
+        std::vector<AccelerationStructures::Mesh> meshes;
+        meshes.push_back(makeSyntheticMesh(triangles));
+
+        AccelerationStructures accels;
+        SceneLoader::Stats stats;
+        stats.triangles = triangles;
+
+        auto blasStart = std::chrono::steady_clock::now();
+        accels.addBLASBatch(std::move(meshes), pool);
+        auto tlasStart = std::chrono::steady_clock::now();
+        accels.buildTLAS(&pool);
+        auto tlasEnd = std::chrono::steady_clock::now();
+        stats.blasSeconds = std::chrono::duration<double>(tlasStart - blasStart).count();
+        stats.tlasSeconds = std::chrono::duration<double>(tlasEnd - tlasStart).count();
+
+        reports.push_back(benchScene("synthetic-" + std::to_string(triangles), stats, accels, pool, repetitions));
+    }
+
+    std::vector<BuilderReport> builders = benchBuilders(scene, pool, repetitions);
+    DeepBlasReport deepBlas = benchDeepBlas(pool, repetitions);
+    DynamicTlasReport dynamicTlas = benchDynamicTlas(pool);
+    if (!checkTlasResize(pool)) {
+        return 1;
+    }
+
+    if (!jsonPath.empty()) {
+        if (!writeJson(jsonPath, pool.getThreadCount(), repetitions, reports, builders, deepBlas, dynamicTlas)) {
+            std::cout << "Failed to write " << jsonPath << std::endl;
+            return 1;
+        }
+        std::cout << "Wrote " << jsonPath << std::endl;
+    }
+}
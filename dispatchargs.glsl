@@ -0,0 +1,23 @@
+#version 430
+
+// Turns rayCounts[u_countIndex] into glDispatchComputeIndirect arguments, so the passes
+// reading that ray buffer can be dispatched without reading the count back.
+// Record u_countIndex holds the 64 wide extend/shade groups followed by the 256 wide sort blocks.
+uniform uint u_countIndex;
+
+layout(local_size_x = 1) in;
+
+layout(std430, binding = 31) readonly  buffer RayCounts    { uint rayCounts[];    };
+layout(std430, binding = 0)  writeonly buffer DispatchArgs { uint dispatchArgs[]; };
+
+void main() {
+    uint count = rayCounts[u_countIndex];
+    uint base = u_countIndex * 6u;
+
+    dispatchArgs[base + 0u] = (count + 63u) / 64u;
+    dispatchArgs[base + 1u] = 1u;
+    dispatchArgs[base + 2u] = 1u;
+    dispatchArgs[base + 3u] = (count + 255u) / 256u;
+    dispatchArgs[base + 4u] = 1u;
+    dispatchArgs[base + 5u] = 1u;
+}
@@ -3,27 +3,110 @@
 #define NULL uint(-1)
 #define swap(a, b) (a ^= b, b ^= a, a ^= b)
 
-uniform uint u_raysCount;
+uniform uint u_countIndex;
 
 layout(local_size_x = 64) in;
 
+// Many implementations allow only 16 storage blocks per compute shader, so each node
+// layout declares just the buffers it reads.
+#ifdef SHADOW_RAYS
+// Built with SHADOW_RAYS this is the connect stage: an any-hit traversal of the shadow rays
+// shade.glsl wrote, which adds the light they carry to the sample of every unoccluded one,
+// or with PATH_REGENERATION to the radiance in its path's state.
+#ifdef PATH_REGENERATION
+layout(rgba32f, binding = 0) uniform image2D pathStates;
+#else
+layout(rgba32f, binding = 0) uniform image2D outColor;
+#endif
+
+layout(std430, binding = 32) readonly  buffer ShadowRays                { vec4 shadowRays[];                };
+#else
 layout(std430, binding = 13) writeonly buffer IntersectionResult        { vec4 intersectionResult[];        };
 layout(std430, binding = 14) readonly  buffer RayBuffer                 { vec4 rayBuffer[];                 };
-layout(std430, binding = 1)  readonly  buffer TlasGetAABB               { vec4 tlasGetAABB[];               };
+#endif
+layout(std430, binding = 31) readonly  buffer RayCounts                 { uint rayCounts[];                 };
 layout(std430, binding = 2)  readonly  buffer TlasGetGeometry           { vec4 tlasGetGeometry[];           };
-layout(std430, binding = 3)  readonly  buffer TlasGetChild              { uint tlasGetChild[];              };
 layout(std430, binding = 4)  readonly  buffer TlasGetPrimitiveId        { uint tlasGetPrimitiveId[];        };
-layout(std430, binding = 5)  readonly  buffer TlasIsLeaf                { uint tlasIsLeaf[];                };
-layout(std430, binding = 6)  readonly  buffer TlasGetBlasNodeOffset     { uint tlasGetBlasNodeOffset[];     };
 layout(std430, binding = 7)  readonly  buffer TlasGetBlasGeometryOffset { uint tlasGetBlasGeometryOffset[]; };
+layout(std430, binding = 9)  readonly  buffer BlasGetTriangle           { vec4 blasGetTriangle[];           };
+layout(std430, binding = 22) readonly  buffer TlasGetInstanceBlas       { uint tlasGetInstanceBlas[];       };
+layout(std430, binding = 23) readonly  buffer TlasGetWorldToObject      { vec4 tlasGetWorldToObject[];      };
+
+#ifdef PACKED_NODES
+layout(std430, binding = 17) readonly  buffer TlasGetNode                     { vec4 tlasGetNode[];                     };
+layout(std430, binding = 18) readonly  buffer BlasGetNode                     { vec4 blasGetNode[];                     };
+layout(std430, binding = 19) readonly  buffer TlasGetBlasPackedNodeOffset     { uint tlasGetBlasPackedNodeOffset[];     };
+#else
+layout(std430, binding = 1)  readonly  buffer TlasGetAABB               { vec4 tlasGetAABB[];               };
+layout(std430, binding = 3)  readonly  buffer TlasGetChild              { uint tlasGetChild[];              };
 layout(std430, binding = 8)  readonly  buffer BlasGetAABB               { vec4 blasGetAABB[];               };
-layout(std430, binding = 9)  readonly  buffer BlasGetGeometry           { vec4 blasGetGeometry[];           };
 layout(std430, binding = 10) readonly  buffer BlasGetChild              { uint blasGetChild[];              };
-layout(std430, binding = 11) readonly  buffer BlasGetPrimitiveId        { uint blasGetPrimitiveId[];        };
+#endif
+
+// The stackless traversals take the leaf flags from the links, and the packed one indexes
+// the links of a BLAS by its split node offset.
+#if !defined(PACKED_NODES) || defined(STACKLESS_TRAVERSAL)
+layout(std430, binding = 6)  readonly  buffer TlasGetBlasNodeOffset     { uint tlasGetBlasNodeOffset[];     };
+#endif
+#ifdef STACKLESS_TRAVERSAL
+layout(std430, binding = 34) readonly  buffer TlasGetNodeLink           { uint tlasGetNodeLink[];           };
+layout(std430, binding = 35) readonly  buffer BlasGetNodeLink           { uint blasGetNodeLink[];           };
+#elif !defined(PACKED_NODES)
+layout(std430, binding = 5)  readonly  buffer TlasIsLeaf                { uint tlasIsLeaf[];                };
 layout(std430, binding = 12) readonly  buffer BlasIsLeaf                { uint blasIsLeaf[];                };
+#endif
+
+// Per ray traversal counters, summed per pixel into traversalHeatmap (one layer per counter,
+// the stack depth keeps its maximum) and binned by log2 into traversalHistogram.
+// Without TRAVERSAL_STATS every STATS() statement compiles to nothing.
+#ifdef TRAVERSAL_STATS
+#define STAT_NODES          0
+#define STAT_BOX_TESTS      1
+#define STAT_TRIANGLE_TESTS 2
+#define STAT_TLAS_LEAVES    3
+#define STAT_STACK_DEPTH    4
+#define STAT_COUNT          5
+#define HISTOGRAM_BINS      32
+
+layout(r32ui, binding = 1) uniform uimage2DArray traversalHeatmap;
+layout(r32ui, binding = 2) uniform uimage2D      traversalHistogram;
 
+uint g_stats[STAT_COUNT];
+
+#define STATS(statement) statement
+#else
+#define STATS(statement)
+#endif
+
+// Any hit closer than isec.dist occludes a shadow ray, so the traversal returns right away.
+#ifdef SHADOW_RAYS
+#define ANY_HIT_RETURN return;
+#else
+#define ANY_HIT_RETURN
+#endif
+
+// Tests a leaf's slots [first, first + count) and keeps the closest hit.
+#define INTERSECT_SLOTS(INTERSECT_FUNCTION, OUT_CHILD, first, count) \
+    for (uint i = 0; i < (count); i++) { \
+        Intersection newIsec = isec; \
+        INTERSECT_FUNCTION(ray, geometryOffset, (first) + i, newIsec); \
+        if (newIsec.dist >= 0 && newIsec.dist < isec.dist) { \
+            isec = newIsec; \
+            isec.OUT_CHILD = (first) + i; \
+            ANY_HIT_RETURN \
+        } \
+    }
+
+// Children are culled against [0, isec.dist], which is the shadow ray's segment in any-hit
+// mode and the closest hit so far otherwise. A leaf's child is its first primitive slot and
+// the max.w of its box the slot count.
 #define DECLARE_BVH_TRAVERSAL(NAME, GET_CHILD, GET_AABB, IS_LEAF, INTERSECT_FUNCTION, OUT_CHILD) \
     void NAME(in Ray ray, uint skipId, uint nodeOffset, uint geometryOffset, inout Intersection isec) { \
+        if (IS_LEAF[nodeOffset] > 0) { \
+            INTERSECT_SLOTS(INTERSECT_FUNCTION, OUT_CHILD, GET_CHILD[nodeOffset], floatBitsToUint(GET_AABB[nodeOffset * 2 + 1].w)) \
+            return; \
+        } \
+        \
         uint stack[32]; \
         uint stackIt = 0; \
         stack[stackIt++] = NULL; \
@@ -31,6 +114,7 @@ layout(std430, binding = 12) readonly  buffer BlasIsLeaf                { uint b
         uint leftChild = GET_CHILD[nodeOffset]; \
         while (leftChild != NULL) { \
             uint rightChild = leftChild + 1; \
+            STATS(g_stats[STAT_NODES]++; g_stats[STAT_BOX_TESTS] += 2;) \
             \
             vec4 bbMinLeft  = GET_AABB[(nodeOffset + leftChild) * 2 + 0]; \
             vec4 bbMaxLeft  = GET_AABB[(nodeOffset + leftChild) * 2 + 1]; \
@@ -40,26 +124,20 @@ layout(std430, binding = 12) readonly  buffer BlasIsLeaf                { uint b
             vec2 distLeft  = aabbIntersect(ray, bbMinLeft.xyz, bbMaxLeft.xyz); \
             vec2 distRight = aabbIntersect(ray, bbMinRight.xyz, bbMaxRight.xyz); \
             \
-            if (distLeft.x <= distLeft.y) { \
+            if (distLeft.x <= min(distLeft.y, isec.dist) && distLeft.y >= 0.0) { \
                 if (IS_LEAF[nodeOffset + leftChild] > 0) { \
-                    Intersection newIsec = isec; \
-                    INTERSECT_FUNCTION(ray, geometryOffset, GET_CHILD[nodeOffset + leftChild], newIsec); \
-                    if (newIsec.dist >= 0 && newIsec.dist < isec.dist) { \
-                        isec = newIsec; \
-                        isec.OUT_CHILD = leftChild; \
-                    } \
+                    uint first = GET_CHILD[nodeOffset + leftChild]; \
+                    uint count = floatBitsToUint(bbMaxLeft.w); \
+                    INTERSECT_SLOTS(INTERSECT_FUNCTION, OUT_CHILD, first, count) \
                     leftChild = NULL; \
                 } \
             } else leftChild = NULL; \
             \
-            if (distRight.x <= distRight.y) { \
+            if (distRight.x <= min(distRight.y, isec.dist) && distRight.y >= 0.0) { \
                 if (IS_LEAF[nodeOffset + rightChild] > 0) { \
-                    Intersection newIsec = isec; \
-                    INTERSECT_FUNCTION(ray, geometryOffset, GET_CHILD[nodeOffset + rightChild], newIsec); \
-                    if (newIsec.dist >= 0 && newIsec.dist < isec.dist) { \
-                        isec = newIsec; \
-                        isec.OUT_CHILD = rightChild; \
-                    } \
+                    uint first = GET_CHILD[nodeOffset + rightChild]; \
+                    uint count = floatBitsToUint(bbMaxRight.w); \
+                    INTERSECT_SLOTS(INTERSECT_FUNCTION, OUT_CHILD, first, count) \
                     rightChild = NULL; \
                 } \
             } else rightChild = NULL; \
@@ -69,6 +147,7 @@ layout(std430, binding = 12) readonly  buffer BlasIsLeaf                { uint b
                     if (distLeft.x > distRight.x) swap(leftChild, rightChild); \
                     if (stackIt == 32) break; \
                     stack[stackIt++] = GET_CHILD[nodeOffset + rightChild]; \
+                    STATS(g_stats[STAT_STACK_DEPTH] = max(g_stats[STAT_STACK_DEPTH], stackIt - 1);) \
                 } \
                 leftChild = GET_CHILD[nodeOffset + leftChild]; \
             } else if (rightChild != NULL) { \
@@ -79,6 +158,194 @@ layout(std430, binding = 12) readonly  buffer BlasIsLeaf                { uint b
         } \
     }
 
+// One record per pair of siblings: vec4(leftMin, leftChild), vec4(leftMax, leftCount),
+// vec4(rightMin, rightChild), vec4(rightMax, rightCount). A child with a non-zero count
+// is a leaf and its child field is the first primitive slot, otherwise it is the record
+// describing that child's own children.
+#define DECLARE_PACKED_BVH_TRAVERSAL(NAME, GET_NODE, INTERSECT_FUNCTION, OUT_CHILD) \
+    void NAME(in Ray ray, uint skipId, uint nodeOffset, uint geometryOffset, inout Intersection isec) { \
+        uint stack[32]; \
+        uint stackIt = 0; \
+        stack[stackIt++] = NULL; \
+        \
+        uint node = 0; \
+        while (node != NULL) { \
+            STATS(g_stats[STAT_NODES]++; g_stats[STAT_BOX_TESTS] += 2;) \
+            vec4 bbMinLeft  = GET_NODE[(nodeOffset + node) * 4 + 0]; \
+            vec4 bbMaxLeft  = GET_NODE[(nodeOffset + node) * 4 + 1]; \
+            vec4 bbMinRight = GET_NODE[(nodeOffset + node) * 4 + 2]; \
+            vec4 bbMaxRight = GET_NODE[(nodeOffset + node) * 4 + 3]; \
+            \
+            uint leftChild  = floatBitsToUint(bbMinLeft.w); \
+            uint rightChild = floatBitsToUint(bbMinRight.w); \
+            uint leftCount  = floatBitsToUint(bbMaxLeft.w); \
+            uint rightCount = floatBitsToUint(bbMaxRight.w); \
+            \
+            vec2 distLeft  = aabbIntersect(ray, bbMinLeft.xyz, bbMaxLeft.xyz); \
+            vec2 distRight = aabbIntersect(ray, bbMinRight.xyz, bbMaxRight.xyz); \
+            \
+            if (leftChild != NULL && distLeft.x <= min(distLeft.y, isec.dist) && distLeft.y >= 0.0) { \
+                if (leftCount > 0) { \
+                    INTERSECT_SLOTS(INTERSECT_FUNCTION, OUT_CHILD, leftChild, leftCount) \
+                    leftChild = NULL; \
+                } \
+            } else leftChild = NULL; \
+            \
+            if (rightChild != NULL && distRight.x <= min(distRight.y, isec.dist) && distRight.y >= 0.0) { \
+                if (rightCount > 0) { \
+                    INTERSECT_SLOTS(INTERSECT_FUNCTION, OUT_CHILD, rightChild, rightCount) \
+                    rightChild = NULL; \
+                } \
+            } else rightChild = NULL; \
+            \
+            if (leftChild != NULL) { \
+                if (rightChild != NULL) { \
+                    if (distLeft.x > distRight.x) swap(leftChild, rightChild); \
+                    if (stackIt == 32) break; \
+                    stack[stackIt++] = rightChild; \
+                    STATS(g_stats[STAT_STACK_DEPTH] = max(g_stats[STAT_STACK_DEPTH], stackIt - 1);) \
+                } \
+                node = leftChild; \
+            } else if (rightChild != NULL) { \
+                node = rightChild; \
+            } else { \
+                node = stack[--stackIt]; \
+            } \
+        } \
+    }
+
+// Stackless traversal after Hapala et al., "Efficient Stack-less BVH Traversal for Ray Tracing".
+// Nodes are numbered as in the split layout, siblings are the pairs (2k + 1, 2k + 2) and a link
+// holds parent << 1 | isLeaf. The near child of a pair is the one with the smaller entry
+// distance, ties going left like the stack order, and is recomputed on the way up to tell
+// whether the sibling is still to be visited. This costs extra box tests but no per ray memory,
+// so arbitrarily deep trees are traversed completely.
+#define FROM_PARENT  0
+#define FROM_SIBLING 1
+#define FROM_CHILD   2
+
+#define SIBLING(node)       ((node) + 1 - 2 * (((node) - 1) & 1u))
+#define FIRST_OF_PAIR(node) ((node) - (((node) - 1) & 1u))
+
+#ifdef TRAVERSAL_STATS
+#define STACKLESS_DEPTH_STATS(statement) statement g_stats[STAT_STACK_DEPTH] = max(g_stats[STAT_STACK_DEPTH], depth);
+#else
+#define STACKLESS_DEPTH_STATS(statement)
+#endif
+
+// The two boxes of a pair are consecutive in both layouts, so one helper picks the near child.
+#define SPLIT_NEAR_CHILD(GET_AABB, first)  NEAR_CHILD_OF_PAIR(GET_AABB, first, (nodeOffset + (first)) * 2)
+#define PACKED_NEAR_CHILD(GET_NODE, first) NEAR_CHILD_OF_PAIR(GET_NODE, first, (nodeOffset + (((first) - 1) >> 1)) * 4)
+#define NEAR_CHILD_OF_PAIR(BOXES, first, index) \
+    ((first) + (aabbIntersect(ray, BOXES[(index) + 0].xyz, BOXES[(index) + 1].xyz).x > \
+                 aabbIntersect(ray, BOXES[(index) + 2].xyz, BOXES[(index) + 3].xyz).x ? 1u : 0u))
+
+#define DECLARE_STACKLESS_BVH_TRAVERSAL(NAME, GET_CHILD, GET_AABB, GET_LINK, INTERSECT_FUNCTION, OUT_CHILD) \
+    void NAME(in Ray ray, uint nodeOffset, uint linkOffset, uint geometryOffset, inout Intersection isec) { \
+        if ((GET_LINK[linkOffset] & 1u) != 0) { \
+            uint first = GET_CHILD[nodeOffset]; \
+            uint count = floatBitsToUint(GET_AABB[nodeOffset * 2 + 1].w); \
+            INTERSECT_SLOTS(INTERSECT_FUNCTION, OUT_CHILD, first, count) \
+            return; \
+        } \
+        \
+        STATS(uint depth = 1; g_stats[STAT_BOX_TESTS] += 2;) \
+        uint node = SPLIT_NEAR_CHILD(GET_AABB, GET_CHILD[nodeOffset]); \
+        uint state = FROM_PARENT; \
+        while (true) { \
+            if (state == FROM_CHILD) { \
+                if (node == 0) return; \
+                STATS(g_stats[STAT_BOX_TESTS] += 2;) \
+                if (node == SPLIT_NEAR_CHILD(GET_AABB, FIRST_OF_PAIR(node))) { \
+                    node = SIBLING(node); \
+                    state = FROM_SIBLING; \
+                } else { \
+                    node = GET_LINK[linkOffset + node] >> 1; \
+                    STATS(depth--;) \
+                } \
+                continue; \
+            } \
+            \
+            STATS(g_stats[STAT_NODES]++; g_stats[STAT_BOX_TESTS]++;) \
+            vec4 bbMax = GET_AABB[(nodeOffset + node) * 2 + 1]; \
+            vec2 dist = aabbIntersect(ray, GET_AABB[(nodeOffset + node) * 2 + 0].xyz, bbMax.xyz); \
+            if (dist.x <= min(dist.y, isec.dist) && dist.y >= 0.0) { \
+                if ((GET_LINK[linkOffset + node] & 1u) == 0) { \
+                    STATS(g_stats[STAT_BOX_TESTS] += 2;) \
+                    STACKLESS_DEPTH_STATS(depth++;) \
+                    node = SPLIT_NEAR_CHILD(GET_AABB, GET_CHILD[nodeOffset + node]); \
+                    state = FROM_PARENT; \
+                    continue; \
+                } \
+                uint first = GET_CHILD[nodeOffset + node]; \
+                uint count = floatBitsToUint(bbMax.w); \
+                INTERSECT_SLOTS(INTERSECT_FUNCTION, OUT_CHILD, first, count) \
+            } \
+            \
+            if (state == FROM_PARENT) { \
+                node = SIBLING(node); \
+                state = FROM_SIBLING; \
+            } else { \
+                node = GET_LINK[linkOffset + node] >> 1; \
+                state = FROM_CHILD; \
+                STATS(depth--;) \
+            } \
+        } \
+    }
+
+// Node n > 0 is side (n - 1) & 1 of record (n - 1) / 2 and an inner child's record r holds
+// the nodes 2r + 1 and 2r + 2. A single leaf root is the left side of record 0.
+#define DECLARE_PACKED_STACKLESS_BVH_TRAVERSAL(NAME, GET_NODE, GET_LINK, INTERSECT_FUNCTION, OUT_CHILD) \
+    void NAME(in Ray ray, uint nodeOffset, uint linkOffset, uint geometryOffset, inout Intersection isec) { \
+        bool rootIsLeaf = (GET_LINK[linkOffset] & 1u) != 0; \
+        STATS(uint depth = 1; g_stats[STAT_BOX_TESTS] += rootIsLeaf ? 0 : 2;) \
+        uint node = rootIsLeaf ? 1u : PACKED_NEAR_CHILD(GET_NODE, 1u); \
+        uint state = FROM_PARENT; \
+        while (true) { \
+            if (state == FROM_CHILD) { \
+                if (node == 0) return; \
+                STATS(g_stats[STAT_BOX_TESTS] += 2;) \
+                if (node == PACKED_NEAR_CHILD(GET_NODE, FIRST_OF_PAIR(node))) { \
+                    node = SIBLING(node); \
+                    state = FROM_SIBLING; \
+                } else { \
+                    node = GET_LINK[linkOffset + node] >> 1; \
+                    STATS(depth--;) \
+                } \
+                continue; \
+            } \
+            \
+            uint index = (nodeOffset + ((node - 1) >> 1)) * 4 + ((node - 1) & 1u) * 2; \
+            vec4 bbMin = GET_NODE[index + 0]; \
+            vec4 bbMax = GET_NODE[index + 1]; \
+            uint child = floatBitsToUint(bbMin.w); \
+            uint count = floatBitsToUint(bbMax.w); \
+            \
+            STATS(g_stats[STAT_NODES]++; g_stats[STAT_BOX_TESTS]++;) \
+            vec2 dist = aabbIntersect(ray, bbMin.xyz, bbMax.xyz); \
+            if (dist.x <= min(dist.y, isec.dist) && dist.y >= 0.0) { \
+                if (count == 0) { \
+                    STATS(g_stats[STAT_BOX_TESTS] += 2;) \
+                    STACKLESS_DEPTH_STATS(depth++;) \
+                    node = PACKED_NEAR_CHILD(GET_NODE, child * 2 + 1); \
+                    state = FROM_PARENT; \
+                    continue; \
+                } \
+                INTERSECT_SLOTS(INTERSECT_FUNCTION, OUT_CHILD, child, count) \
+            } \
+            if (rootIsLeaf) return; \
+            \
+            if (state == FROM_PARENT) { \
+                node = SIBLING(node); \
+                state = FROM_SIBLING; \
+            } else { \
+                node = GET_LINK[linkOffset + node] >> 1; \
+                state = FROM_CHILD; \
+                STATS(depth--;) \
+            } \
+        } \
+    }
+
 struct Ray {
     vec3 origin;
     vec3 dir;
@@ -86,8 +353,8 @@ struct Ray {
 };
 
 struct Intersection {
-    uint tlasNodeId;
-    uint blasNodeId;
+    uint tlasPrimitiveSlot;
+    uint blasPrimitiveSlot;
     vec2 barycentric;
     float dist;
 };
@@ -104,9 +371,7 @@ vec3 safeInvDir(vec3 d) {
     return invdir;
 }
 
-void triIntersect(in Ray ray, in vec3 v0, in vec3 v1, in vec3 v2, inout Intersection isec) {
-    vec3 v1v0 = v1 - v0;
-    vec3 v2v0 = v2 - v0;
+void triIntersect(in Ray ray, in vec3 v0, in vec3 v1v0, in vec3 v2v0, inout Intersection isec) {
     vec3 rov0 = ray.origin - v0;
 
     vec3  n = cross(v1v0, v2v0);
@@ -133,39 +398,121 @@ vec2 aabbIntersect(in Ray ray, vec3 boxMin, vec3 boxMax) {
 };
 
 void intersectBLASLeaf(in Ray ray, uint geometryOffset, uint leafChild, inout Intersection isec) {
-    uint index = blasGetPrimitiveId[geometryOffset + leafChild];
-    uint stride = 3;
-    vec3 p1 = blasGetGeometry[((geometryOffset + index) * 3 + 0) * stride + 0].xyz;
-    vec3 p2 = blasGetGeometry[((geometryOffset + index) * 3 + 1) * stride + 0].xyz;
-    vec3 p3 = blasGetGeometry[((geometryOffset + index) * 3 + 2) * stride + 0].xyz;
-    triIntersect(ray, p1, p2, p3, isec);
+    // Triangles are stored in leaf slot order as p0, p1 - p0, p2 - p0.
+    uint triangle = (geometryOffset + leafChild) * 3;
+    STATS(g_stats[STAT_TRIANGLE_TESTS]++;)
+    vec3 p0 = blasGetTriangle[triangle + 0].xyz;
+    vec3 e1 = blasGetTriangle[triangle + 1].xyz;
+    vec3 e2 = blasGetTriangle[triangle + 2].xyz;
+    triIntersect(ray, p0, e1, e2, isec);
 }
-DECLARE_BVH_TRAVERSAL(intersectBLAS, blasGetChild, blasGetAABB, blasIsLeaf, intersectBLASLeaf, blasNodeId)
+#if defined(PACKED_NODES) && defined(STACKLESS_TRAVERSAL)
+DECLARE_PACKED_STACKLESS_BVH_TRAVERSAL(intersectBLAS, blasGetNode, blasGetNodeLink, intersectBLASLeaf, blasPrimitiveSlot)
+#elif defined(STACKLESS_TRAVERSAL)
+DECLARE_STACKLESS_BVH_TRAVERSAL(intersectBLAS, blasGetChild, blasGetAABB, blasGetNodeLink, intersectBLASLeaf, blasPrimitiveSlot)
+#elif defined(PACKED_NODES)
+DECLARE_PACKED_BVH_TRAVERSAL(intersectBLAS, blasGetNode, intersectBLASLeaf, blasPrimitiveSlot)
+#else
+DECLARE_BVH_TRAVERSAL(intersectBLAS, blasGetChild, blasGetAABB, blasIsLeaf, intersectBLASLeaf, blasPrimitiveSlot)
+#endif
 
 void intersectTLASLeaf(in Ray ray, uint geometryOffset, uint leafChild, inout Intersection isec) {
     uint index = tlasGetPrimitiveId[leafChild];
+    STATS(g_stats[STAT_TLAS_LEAVES]++; g_stats[STAT_BOX_TESTS]++;)
     vec3 aabbMin = tlasGetGeometry[index * 2 + 0].xyz;
     vec3 aabbMax = tlasGetGeometry[index * 2 + 1].xyz;
     vec2 isecAABB = aabbIntersect(ray, aabbMin, aabbMax);
-    if (isecAABB.x <= isecAABB.y) {
-        intersectBLAS(ray, NULL, tlasGetBlasNodeOffset[index], tlasGetBlasGeometryOffset[index], isec);
+    if (isecAABB.x <= min(isecAABB.y, isec.dist) && isecAABB.y >= 0.0) {
+        uint blas = tlasGetInstanceBlas[index];
+
+        // The direction is not renormalized, so hit distances stay comparable across instances.
+        vec4 row0 = tlasGetWorldToObject[index * 3 + 0];
+        vec4 row1 = tlasGetWorldToObject[index * 3 + 1];
+        vec4 row2 = tlasGetWorldToObject[index * 3 + 2];
+        Ray objectRay;
+        objectRay.origin = vec3(dot(row0, vec4(ray.origin, 1.0)), dot(row1, vec4(ray.origin, 1.0)), dot(row2, vec4(ray.origin, 1.0)));
+        objectRay.dir    = vec3(dot(row0.xyz, ray.dir), dot(row1.xyz, ray.dir), dot(row2.xyz, ray.dir));
+        objectRay.invDir = safeInvDir(objectRay.dir);
+#if defined(PACKED_NODES) && defined(STACKLESS_TRAVERSAL)
+        intersectBLAS(objectRay, tlasGetBlasPackedNodeOffset[blas], tlasGetBlasNodeOffset[blas], tlasGetBlasGeometryOffset[blas], isec);
+#elif defined(STACKLESS_TRAVERSAL)
+        intersectBLAS(objectRay, tlasGetBlasNodeOffset[blas], tlasGetBlasNodeOffset[blas], tlasGetBlasGeometryOffset[blas], isec);
+#elif defined(PACKED_NODES)
+        intersectBLAS(objectRay, NULL, tlasGetBlasPackedNodeOffset[blas], tlasGetBlasGeometryOffset[blas], isec);
+#else
+        intersectBLAS(objectRay, NULL, tlasGetBlasNodeOffset[blas], tlasGetBlasGeometryOffset[blas], isec);
+#endif
     }
 }
-DECLARE_BVH_TRAVERSAL(intersectTLAS, tlasGetChild, tlasGetAABB, tlasIsLeaf, intersectTLASLeaf, tlasNodeId)
+#if defined(PACKED_NODES) && defined(STACKLESS_TRAVERSAL)
+DECLARE_PACKED_STACKLESS_BVH_TRAVERSAL(intersectTLAS, tlasGetNode, tlasGetNodeLink, intersectTLASLeaf, tlasPrimitiveSlot)
+#elif defined(STACKLESS_TRAVERSAL)
+DECLARE_STACKLESS_BVH_TRAVERSAL(intersectTLAS, tlasGetChild, tlasGetAABB, tlasGetNodeLink, intersectTLASLeaf, tlasPrimitiveSlot)
+#elif defined(PACKED_NODES)
+DECLARE_PACKED_BVH_TRAVERSAL(intersectTLAS, tlasGetNode, intersectTLASLeaf, tlasPrimitiveSlot)
+#else
+DECLARE_BVH_TRAVERSAL(intersectTLAS, tlasGetChild, tlasGetAABB, tlasIsLeaf, intersectTLASLeaf, tlasPrimitiveSlot)
+#endif
+
+// The stack traversals take an unused skip id where the stackless ones take the node offset.
+#ifdef STACKLESS_TRAVERSAL
+#define TLAS_ROOT 0
+#else
+#define TLAS_ROOT NULL
+#endif
 
 Intersection intersectRay(in Ray ray) {
     Intersection isec;
     isec.dist = 1e10;
-    isec.tlasNodeId = NULL;
-    isec.blasNodeId = NULL;
-    intersectTLAS(ray, NULL, 0, 0, isec);
+    isec.tlasPrimitiveSlot = NULL;
+    isec.blasPrimitiveSlot = NULL;
+    intersectTLAS(ray, TLAS_ROOT, 0, 0, isec);
     isec.dist = (isec.dist == 1e10 ? -1.0 : isec.dist);
     return isec;
 }
 
+#ifdef SHADOW_RAYS
+// Shadow rays are vec4(origin, pixel x | pixel y << 16), vec4(light point - origin, light).
+// The segment stops short of the light point so the light's own triangle does not occlude it.
+#define SHADOW_RAY_END (1.0 - 1e-3)
+
 void main() {
     uint rayId = uint(gl_GlobalInvocationID.x);
-    if (rayId >= u_raysCount) {
+    if (rayId >= rayCounts[u_countIndex]) {
+        return;
+    }
+
+    vec4 rayData1 = shadowRays[rayId * 2 + 0];
+    vec4 rayData2 = shadowRays[rayId * 2 + 1];
+
+    Ray ray;
+    ray.origin = rayData1.xyz;
+    ray.dir    = rayData2.xyz;
+    ray.invDir = safeInvDir(ray.dir);
+
+    Intersection isec;
+    isec.dist = SHADOW_RAY_END;
+    isec.tlasPrimitiveSlot = NULL;
+    isec.blasPrimitiveSlot = NULL;
+    intersectTLAS(ray, TLAS_ROOT, 0, 0, isec);
+
+    if (isec.tlasPrimitiveSlot == NULL) {
+        uint pixel = floatBitsToUint(rayData1.w);
+        ivec2 pixelCoords = ivec2(pixel & 0xFFFFu, pixel >> 16);
+        // Every path casts at most one shadow ray per bounce, so no other invocation touches this pixel.
+#ifdef PATH_REGENERATION
+        vec4 path = imageLoad(pathStates, pixelCoords);
+        imageStore(pathStates, pixelCoords, vec4(path.x, path.y + rayData2.w, path.zw));
+#else
+        vec4 color = imageLoad(outColor, pixelCoords);
+        imageStore(outColor, pixelCoords, vec4(color.rgb + vec3(rayData2.w), 1.0));
+#endif
+    }
+}
+#else
+void main() {
+    uint rayId = uint(gl_GlobalInvocationID.x);
+    if (rayId >= rayCounts[u_countIndex]) {
         return;
     }
 
@@ -177,12 +524,28 @@ void main() {
     ray.dir    = rayData2.xyz;
     ray.invDir = safeInvDir(ray.dir);
 
+    STATS(for (uint i = 0; i < STAT_COUNT; i++) g_stats[i] = 0;)
+
     Intersection isec = intersectRay(ray);
 
-    intersectionResult[rayId] = vec4(uintBitsToFloat(uvec2(isec.tlasNodeId, isec.blasNodeId)), isec.barycentric);
+    intersectionResult[rayId] = vec4(uintBitsToFloat(uvec2(isec.tlasPrimitiveSlot, isec.blasPrimitiveSlot)), isec.barycentric);
+
+#ifdef TRAVERSAL_STATS
+    ivec2 pixelCoords = floatBitsToInt(vec2(rayData1.w, rayData2.w));
+    for (int i = 0; i < STAT_COUNT; i++) {
+        if (i == STAT_STACK_DEPTH) {
+            imageAtomicMax(traversalHeatmap, ivec3(pixelCoords, i), g_stats[i]);
+        } else {
+            imageAtomicAdd(traversalHeatmap, ivec3(pixelCoords, i), g_stats[i]);
+        }
+        int bin = g_stats[i] == 0 ? 0 : min(findMSB(g_stats[i]) + 1, HISTOGRAM_BINS - 1);
+        imageAtomicAdd(traversalHistogram, ivec2(bin, i), 1u);
+    }
+#endif
 
     //imageStore(outColor, floatBitsToInt(vec2(rayData1.w, rayData2.w)), vec4(vec3(isec.barycentric, 0.0), 1.0));
     //imageStore(outColor, floatBitsToInt(vec2(rayData1.w, rayData2.w)), vec4(floatBitsToInt(vec2(rayData1.w, rayData2.w)) / vec2(800.0, 600.0), 0.0, 1.0));
 
     //imageStore(outColor, floatBitsToInt(vec2(rayData1.w, rayData2.w)), vec4(ray.origin, 1.0));
 }
+#endif
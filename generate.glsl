@@ -2,15 +2,57 @@
 
 uniform mat4 u_viewInv;
 uniform ivec2 u_screenSize;
+// A pixel stops getting camera rays once it has u_minSamples samples and the standard error
+// of its mean luminance is below u_errorThreshold relative to that mean.
+uniform uint u_minSamples;
+uniform float u_errorThreshold;
+
+#define MIN_LUMINANCE (1.0 / 256.0)
 
 layout(local_size_x = 8, local_size_y = 8) in;
 
-layout(std430,  binding = 0)           buffer Counter   { uint counter; };
-layout(std430,  binding = 1) writeonly buffer OutBuffer { vec4 rayBuffer[]; };
+// Camera rays are counted in rayCounts[0], the bounces append to the following slots.
+layout(std430,  binding = 31)          buffer RayCounts    { uint rayCounts[];    };
+layout(std430,  binding = 1) writeonly buffer OutBuffer    { vec4 rayBuffer[];    };
+// Per pixel: mean and sample count, then the sum of squared differences (see accumulate.glsl).
+layout(std430,  binding = 15) readonly buffer Accumulation { vec4 accumulation[]; };
+
+shared uint s_count;
+shared uint s_offset;
+
+bool needsSample(ivec2 pixelCoords) {
+    uint pixel = uint(pixelCoords.y * u_screenSize.x + pixelCoords.x);
+    vec4 meanAndCount = accumulation[pixel * 2 + 0];
+    float samples = meanAndCount.w;
+    if (samples < float(max(u_minSamples, 2u))) {
+        return true;
+    }
+
+    vec3 luminanceWeights = vec3(0.2126, 0.7152, 0.0722);
+    float variance = dot(accumulation[pixel * 2 + 1].xyz, luminanceWeights) / (samples - 1.0);
+    float standardError = sqrt(variance / samples);
+    return standardError > u_errorThreshold * max(dot(meanAndCount.xyz, luminanceWeights), MIN_LUMINANCE);
+}
 
 void main() {
     ivec2 pixelCoords = ivec2(gl_GlobalInvocationID.xy);
-    if (pixelCoords.x >= u_screenSize.x || pixelCoords.y >= u_screenSize.y) {
+    bool sampled = pixelCoords.x < u_screenSize.x && pixelCoords.y < u_screenSize.y && needsSample(pixelCoords);
+
+    // Compacts the sampled pixels of the tile with one global atomic, keeping them next to each other.
+    if (gl_LocalInvocationIndex == 0) {
+        s_count = 0;
+    }
+    barrier();
+
+    uint localOffset = sampled ? atomicAdd(s_count, 1) : 0;
+    barrier();
+
+    if (gl_LocalInvocationIndex == 0) {
+        s_offset = s_count > 0 ? atomicAdd(rayCounts[0], s_count) : 0;
+    }
+    barrier();
+
+    if (!sampled) {
         return;
     }
 
@@ -23,7 +65,7 @@ void main() {
     origin.w = intBitsToFloat(pixelCoords.x);
     dir.w    = intBitsToFloat(pixelCoords.y);
 
-    uint offset = atomicAdd(counter, 1);
+    uint offset = s_offset + localOffset;
 
     rayBuffer[offset * 2 + 0] = origin;
     rayBuffer[offset * 2 + 1] = dir;
@@ -0,0 +1,160 @@
+#include "CpuRender.hpp"
+#include "DeltaTime.hpp"
+#include "SceneLoader.hpp"
+#include "ThreadPool.hpp"
+#include "TileRender.hpp"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <thread>
+#include <iostream>
+#include <string>
+#include <vector>
+
+void parseBuilderArg(const std::string& name, AccelerationStructures::Builder& builder) {
+    if (!AccelerationStructures::parseBuilder(name, builder)) {
+        std::cout << "Unknown builder " << name << ", using " << AccelerationStructures::getBuilderName(builder) << std::endl;
+    }
+}
+
+// Loads the scene the way the workers will, so the cache they map exists before they start.
+void prepareSceneCache(const CpuRender::Settings& settings) {
+    ThreadPool pool;
+    SceneLoader sceneLoader;
+    AccelerationStructures accels;
+    sceneLoader.setBuildOptions(settings.blasBuild);
+    accels.setTlasBuildOptions(settings.tlasBuild);
+    sceneLoader.load("sponza.obj", accels, pool);
+}
+
+int main(int argc, char** argv) {
+    CpuRender::Settings settings;
+
+    TileCompositor::Settings tileSettings;
+    tileSettings.executable = argv[0];
+    tileSettings.socketPath = "/tmp/BvhTestCpu-" + std::to_string(::getpid()) + ".sock";
+    bool composite = false;
+    std::string tileWorkerSocket;
+    std::uint32_t threads = 0;
+
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        // Compositor options stay here, everything else is passed on to the workers.
+        if (arg == "--workers" && i + 1 < argc) {
+            tileSettings.workers = std::atoi(argv[++i]);
+            composite = true;
+            continue;
+        } else if (arg == "--socket" && i + 1 < argc) {
+            tileSettings.socketPath = argv[++i];
+            continue;
+        } else if (arg == "--tile-size" && i + 1 < argc) {
+            tileSettings.tileSize = std::atoi(argv[++i]);
+            continue;
+        }
+        tileSettings.workerArgs.push_back(arg);
+
+        if (arg == "--tile-worker" && i + 1 < argc) {
+            tileWorkerSocket = argv[++i];
+            tileSettings.workerArgs.pop_back();
+        } else if (arg == "--threads" && i + 1 < argc) {
+            threads = std::atoi(argv[++i]);
+            tileSettings.workerArgs.push_back(argv[i]);
+        } else if (arg == "--packed-nodes") {
+            settings.layout = CpuTracer::NodeLayout::Packed;
+        } else if (arg == "--wide4") {
+            settings.layout = CpuTracer::NodeLayout::Wide4;
+        } else if (arg == "--wide8") {
+            settings.layout = CpuTracer::NodeLayout::Wide8;
+        } else if (arg == "--stackless") {
+            settings.traversal = CpuTracer::Traversal::Stackless;
+        } else if (arg == "--builder" && i + 1 < argc) {
+            parseBuilderArg(argv[++i], settings.blasBuild.builder);
+            tileSettings.workerArgs.push_back(argv[i]);
+        } else if (arg == "--leaf-size" && i + 1 < argc) {
+            settings.blasBuild.maxLeafSize = std::atoi(argv[++i]);
+            tileSettings.workerArgs.push_back(argv[i]);
+        } else if (arg == "--tlas-builder" && i + 1 < argc) {
+            parseBuilderArg(argv[++i], settings.tlasBuild.builder);
+            tileSettings.workerArgs.push_back(argv[i]);
+        } else if (arg == "--tlas-leaf-size" && i + 1 < argc) {
+            settings.tlasBuild.maxLeafSize = std::atoi(argv[++i]);
+            tileSettings.workerArgs.push_back(argv[i]);
+        } else if (arg == "--sort-rays") {
+            settings.sortRays = true;
+        } else if (arg == "--sort-from-bounce" && i + 1 < argc) {
+            settings.sortFromBounce = std::atoi(argv[++i]);
+            tileSettings.workerArgs.push_back(argv[i]);
+        } else if (arg == "--ray-stats") {
+            settings.rayStats = true;
+        } else if (arg == "--packets") {
+            settings.packets = true;
+        } else if (arg == "--no-nee") {
+            settings.nextEventEstimation = false;
+        } else {
+            positional.push_back(arg);
+        }
+    }
+
+    std::string output = positional.size() > 0 ? positional[0] : "render.ppm";
+    std::uint32_t width = positional.size() > 1 ? std::atoi(positional[1].c_str()) : 1600;
+    std::uint32_t height = positional.size() > 2 ? std::atoi(positional[2].c_str()) : 900;
+    std::uint32_t frames = positional.size() > 3 ? std::atoi(positional[3].c_str()) : 1;
+
+    if (composite) {
+        // Split the cores between the workers unless told otherwise.
+        if (threads == 0) {
+            std::uint32_t workerThreads = std::max(1u, std::thread::hardware_concurrency() / std::max(tileSettings.workers, 1u));
+            tileSettings.workerArgs.push_back("--threads");
+            tileSettings.workerArgs.push_back(std::to_string(workerThreads));
+        }
+
+        prepareSceneCache(settings);
+
+        TileCompositor compositor(width, height, tileSettings);
+        if (!compositor.start()) {
+            return 1;
+        }
+
+        DeltaTime deltaTime;
+        for (std::uint32_t frame = 0; frame < frames; frame++) {
+            if (!compositor.renderFrame()) {
+                return 1;
+            }
+            std::cout << deltaTime.get() << std::endl;
+        }
+        compositor.printStats();
+
+        if (!CpuRender::writeImage(output, width, height, compositor.getColors())) {
+            std::cout << "Failed to write " << output << std::endl;
+            return 1;
+        }
+        std::cout << "Wrote " << output << std::endl;
+        return 0;
+    }
+
+    ThreadPool pool(threads > 0 ? threads : std::thread::hardware_concurrency());
+    std::cout << "Using " << pool.getThreadCount() << " threads" << std::endl;
+
+    CpuRender render(width, height, pool, settings);
+
+    if (!tileWorkerSocket.empty()) {
+        TileWorker worker(render);
+        return worker.run(tileWorkerSocket) ? 0 : 1;
+    }
+
+    DeltaTime deltaTime;
+    float delta = 0.0f;
+    for (std::uint32_t frame = 0; frame < frames; frame++) {
+        render.render(delta);
+        delta = deltaTime.get();
+    }
+
+    if (!render.writeImage(output)) {
+        std::cout << "Failed to write " << output << std::endl;
+        return 1;
+    }
+    std::cout << "Wrote " << output << std::endl;
+}
@@ -1,46 +1,107 @@
 #include "AccelerationStructures.hpp"
+#include "CpuRender.hpp"
+#include "DeltaTime.hpp"
+#include "RaySorter.hpp"
+#include "SceneLoader.hpp"
 
 #include <GL/glew.h>
 #include <SDL.h>
 
-#include <assimp/Importer.hpp>
-#include <assimp/scene.h>
-#include <assimp/mesh.h>
-#include <assimp/postprocess.h>
+#ifdef BVH_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
 
 #include <glm/gtc/matrix_transform.hpp>
 
+#include <algorithm>
+#include <array>
 #include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <string>
+#include <utility>
 #include <vector>
 
-class DeltaTime {
-private:
-    std::chrono::time_point<std::chrono::system_clock> m_last;
-
+class Render {
 public:
-    DeltaTime() :
-        m_last(std::chrono::system_clock::now())
-    { }
-
-    float get() {
-        auto now = std::chrono::system_clock::now();
-        float delta = std::chrono::duration_cast<std::chrono::milliseconds>(now - m_last).count() / 1000.0f;
-        m_last = now;
-        return delta;
-    }
-};
+    struct Settings {
+        bool packedNodes = false;
+        // Moves the light instance every frame to exercise the TLAS refit.
+        bool animate = false;
+        // Radix-sorts the ray buffer before every extend from this bounce on (see RaySorter).
+        bool sortRays = false;
+        std::uint32_t sortFromBounce = 1;
+        // Prints per-bounce sort and extend times and the hit coherence of the ray order.
+        bool rayStats = false;
+        // No default framebuffer to blit to, see runHeadless.
+        bool headless = false;
+        // Averages the frames instead of showing the last one, and stops sampling pixels
+        // once they are converged (see generate.glsl). --animate restarts it every frame.
+        bool accumulate = false;
+        std::uint32_t minSamples = 8;
+        float errorThreshold = 0.02f;
+        // Samples the emissive triangles at every hit and traces shadow rays to them (see connect),
+        // instead of waiting for a bounce to hit the light.
+        bool nextEventEstimation = true;
+        // Traverses with parent links instead of a fixed size stack (see extend.glsl), which
+        // never drops hits on trees deeper than the stack.
+        bool stacklessTraversal = false;
+        // Keeps every extend on a full ray buffer: a path ended by a miss, a light or Russian roulette
+        // is replaced right away by a new camera ray for its pixel (see shade.glsl), and pathIterations
+        // extend/shade rounds run per frame, so a pixel can finish several samples a frame.
+        // Pixels are not checked for convergence in this mode.
+        bool persistentPaths = false;
+        std::uint32_t pathIterations = 8;
+        // --builder/--leaf-size for every BLAS, --tlas-builder/--tlas-leaf-size for the TLAS.
+        AccelerationStructures::BuildOptions blasBuild;
+        AccelerationStructures::BuildOptions tlasBuild;
+#ifdef BVH_STATS
+        // Where writeTraversalStats puts its heatmaps and histograms on exit.
+        std::string statsPrefix = "traversal";
+#endif
+    };
 
-class Render {
 private:
+    // Must match radixsort.glsl.
+    static constexpr std::uint32_t SORT_RADIX_BITS = 4;
+    static constexpr std::uint32_t SORT_RADIX      = 1 << SORT_RADIX_BITS;
+    static constexpr std::uint32_t SORT_BLOCK_SIZE = 256;
+
+    // Must match dispatchargs.glsl: per count slot, the 64 wide extend/shade groups then the sort blocks.
+    static constexpr std::uint32_t DISPATCH_ARGS_SIZE   = sizeof(std::uint32_t) * 6;
+    static constexpr std::uint32_t DISPATCH_SORT_OFFSET = sizeof(std::uint32_t) * 3;
+    // The CPU records at most this many frames ahead of the GPU.
+    static constexpr std::uint32_t FRAMES_IN_FLIGHT = 2;
+
+#ifdef BVH_STATS
+    // Built with BVH_STATS, every stage boundary of a frame is timestamped on the GPU and the CPU,
+    // and extend.glsl counts its traversal work (see TRAVERSAL_STATS there).
+    static constexpr std::uint32_t MAX_STAGE_MARKS = 64;
+    // Must match extend.glsl.
+    static constexpr std::uint32_t TRAVERSAL_STAT_COUNT = 5;
+    static constexpr std::uint32_t HISTOGRAM_BINS       = 32;
+    static constexpr std::array<const char*, TRAVERSAL_STAT_COUNT> TRAVERSAL_STAT_NAMES = {
+        "nodesVisited", "boxTests", "triangleTests", "tlasLeaves", "stackDepth"
+    };
+
+    struct StageMark {
+        const char*                           stage;
+        std::int32_t                          bounce;
+        std::chrono::steady_clock::time_point cpuTime;
+    };
+#endif
+
     class ComputeShader {
     private:
         GLuint m_shader;
         GLuint m_program;
 
     public:
-        ComputeShader(const std::string& name) {
+        ComputeShader(const std::string& name, const std::vector<std::string>& defines = {}) {
             int errLen = 0;
             char buffer[1024] = {};
             const char* sourcePtr = nullptr;
@@ -52,6 +113,12 @@ private:
             shaderSource.resize(size, 0);
             input.read(&shaderSource[0], size);
 
+            std::string defineBlock;
+            for (const auto& define : defines) {
+                defineBlock += "#define " + define + "\n";
+            }
+            shaderSource.insert(shaderSource.find('\n') + 1, defineBlock);
+
             sourcePtr = shaderSource.c_str();
             m_shader = glCreateShader(GL_COMPUTE_SHADER);
             glShaderSource(m_shader, 1, &sourcePtr, nullptr);
@@ -80,15 +147,53 @@ private:
 	std::uint32_t m_height;
 
     float m_timer;
+    // Frames folded into the accumulation since it was last reset.
+    std::uint32_t m_accumulatedFrames;
+
+    Settings m_settings;
+
+    // Extend/shade rounds per frame, CpuRender::BOUNCES unless the paths are persistent. generate counts into
+    // slot 0, every shade its bounced rays into the following one and its shadow rays into
+    // m_shadowCountSlot + iteration; persistent shades count the paths they restart in m_restartCountSlot.
+    std::uint32_t m_iterations;
+    std::uint32_t m_shadowCountSlot;
+    std::uint32_t m_restartCountSlot;
+    std::uint32_t m_rayCountSlots;
+    // Persistent paths are only generated once, after that shade keeps the ray buffer full.
+    bool m_pathsStarted;
+
+    // The counters a frame's dispatches read are only looked at by the CPU once its fence has signaled.
+    struct Frame {
+        GLuint rayCounts = 0;
+        GLuint dispatchArgs = 0;
+        GLsync fence = nullptr;
+        float delta = 0.0f;
+#ifdef BVH_STATS
+        std::array<GLuint, MAX_STAGE_MARKS> timestamps = {};
+        std::array<StageMark, MAX_STAGE_MARKS> marks = {};
+        std::uint32_t markCount = 0;
+#endif
+    };
+
+    std::array<Frame, FRAMES_IN_FLIGHT> m_frames;
+    std::uint32_t m_frameIndex;
 
 	GLuint m_fbo;
 	GLuint m_fboTexture;
+    GLuint m_sampleTexture;
+    GLuint m_pathStateTexture;
 
     std::optional<ComputeShader> m_programGenerate;
     std::optional<ComputeShader> m_programExtend;
     std::optional<ComputeShader> m_programShade;
-
-    Assimp::Importer m_meshImporter;
+    std::optional<ComputeShader> m_programConnect;
+    std::optional<ComputeShader> m_programDispatchArgs;
+    std::optional<ComputeShader> m_programAccumulate;
+    std::optional<ComputeShader> m_programRayKeys;
+    std::optional<ComputeShader> m_programRadixHistogram;
+    std::optional<ComputeShader> m_programRadixScan;
+    std::optional<ComputeShader> m_programRadixScatter;
+    std::optional<ComputeShader> m_programReorder;
 
     GLuint m_ssboTlasGetAABB;
     GLuint m_ssboTlasGetGeometry;
@@ -99,31 +204,98 @@ private:
     GLuint m_ssboTlasGetBlasGeometryOffset;
 
     GLuint m_ssboBlasGetAABB;
-    GLuint m_ssboBlasGetGeometry;
+    GLuint m_ssboBlasGetTriangle;
     GLuint m_ssboBlasGetChild;
-    GLuint m_ssboBlasGetPrimitiveId;
+    GLuint m_ssboBlasGetIndex;
     GLuint m_ssboBlasIsLeaf;
+    GLuint m_ssboBlasGetNormal;
+    GLuint m_ssboBlasGetMaterial;
+
+    GLuint m_ssboTlasGetInstanceBlas;
+    GLuint m_ssboTlasGetWorldToObject;
+    GLuint m_ssboTlasGetObjectToWorld;
+
+    GLuint m_ssboTlasGetNode;
+    GLuint m_ssboBlasGetNode;
+    GLuint m_ssboTlasGetBlasPackedNodeOffset;
+
+    GLuint m_ssboTlasGetNodeLink;
+    GLuint m_ssboBlasGetNodeLink;
 
-    GLuint m_ssboCounter;
     GLuint m_ssboRayBufferRead;
     GLuint m_ssboRayBufferWrite;
     GLuint m_ssboIntersectionBuffer;
+    GLuint m_ssboAccumulation;
+    GLuint m_ssboShadowRays;
+    GLuint m_ssboLights;
+    std::uint32_t m_lightCount;
+    float m_lightArea;
+
+#ifdef BVH_STATS
+    GLuint m_traversalHeatmap;
+    GLuint m_traversalHistogram;
+#endif
+
+    GLuint m_ssboSortKeys[2];
+    GLuint m_ssboSortValues[2];
+    GLuint m_ssboSortBlockHistogram;
+    GLuint m_ssboRayBufferSorted;
+    GLuint m_ssboRayStats;
 
     AccelerationStructures m_accels;
     glm::mat4 m_viewInv;
 
+    std::uint32_t m_animatedInstance;
+    std::array<float, 12> m_animatedTransform;
+
 public:
-	Render(std::uint32_t width, std::uint32_t height) :
+	Render(std::uint32_t width, std::uint32_t height, const Settings& settings) :
 		m_width(width),
         m_height(height),
         m_timer(0.0f),
+        m_accumulatedFrames(0),
+        m_settings(settings),
+        m_iterations(settings.persistentPaths ? std::max(settings.pathIterations, 1u) : CpuRender::BOUNCES),
+        m_shadowCountSlot(m_iterations + 1),
+        m_restartCountSlot(m_shadowCountSlot + m_iterations),
+        m_rayCountSlots(m_restartCountSlot + (settings.persistentPaths ? 1 : 0)),
+        m_pathsStarted(false),
+        m_frameIndex(0),
         m_viewInv(glm::transpose(glm::inverse(glm::lookAt(glm::vec3(0.0f, 10.0f, 50.0f), glm::vec3(0.0f, 10.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f)))))
     {
         glewInit();
 
-        m_programGenerate.emplace("generate.glsl");
-        m_programExtend.emplace("extend.glsl");
-        m_programShade.emplace("shade.glsl");
+        std::vector<std::string> defines;
+        if (m_settings.packedNodes) defines.push_back("PACKED_NODES");
+        if (m_settings.persistentPaths) defines.push_back("PATH_REGENERATION");
+
+        m_programGenerate.emplace("generate.glsl", defines);
+        std::vector<std::string> traversalDefines = defines;
+        if (m_settings.stacklessTraversal) traversalDefines.push_back("STACKLESS_TRAVERSAL");
+        std::vector<std::string> extendDefines = traversalDefines;
+#ifdef BVH_STATS
+        extendDefines.push_back("TRAVERSAL_STATS");
+#endif
+        m_programExtend.emplace("extend.glsl", extendDefines);
+        std::vector<std::string> shadeDefines = defines;
+        if (m_settings.rayStats) shadeDefines.push_back("RAY_STATS");
+        if (m_settings.nextEventEstimation) {
+            shadeDefines.push_back("NEXT_EVENT_ESTIMATION");
+            std::vector<std::string> connectDefines = traversalDefines;
+            connectDefines.push_back("SHADOW_RAYS");
+            m_programConnect.emplace("extend.glsl", connectDefines);
+        }
+        m_programShade.emplace("shade.glsl", shadeDefines);
+        m_programDispatchArgs.emplace("dispatchargs.glsl");
+        m_programAccumulate.emplace("accumulate.glsl", defines);
+
+        if (m_settings.sortRays) {
+            m_programRayKeys.emplace("raykeys.glsl");
+            m_programRadixHistogram.emplace("radixsort.glsl", std::vector<std::string>{"HISTOGRAM"});
+            m_programRadixScan.emplace("radixsort.glsl", std::vector<std::string>{"SCAN"});
+            m_programRadixScatter.emplace("radixsort.glsl", std::vector<std::string>{"SCATTER"});
+            m_programReorder.emplace("reorder.glsl");
+        }
 
 		glGenTextures(1, &m_fboTexture);
 		glBindTexture(GL_TEXTURE_2D, m_fboTexture);
@@ -131,6 +303,29 @@ public:
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 
+        // accumulate.glsl treats a zero alpha as "no sample this frame". Persistent paths tally
+        // the paths they finish there instead, with the count in alpha.
+        std::vector<float> zeros(m_width * m_height * 4, 0.0f);
+        glGenTextures(1, &m_sampleTexture);
+        glBindTexture(GL_TEXTURE_2D, m_sampleTexture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, m_width, m_height, 0, GL_RGBA, GL_FLOAT, zeros.data());
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+        // Persistent paths start with a throughput of 1 and nothing pending (see shade.glsl).
+        m_pathStateTexture = 0;
+        if (m_settings.persistentPaths) {
+            std::vector<float> states(m_width * m_height * 4, 0.0f);
+            for (std::size_t i = 0; i < states.size(); i += 4) {
+                states[i] = 1.0f;
+            }
+            glGenTextures(1, &m_pathStateTexture);
+            glBindTexture(GL_TEXTURE_2D, m_pathStateTexture);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, m_width, m_height, 0, GL_RGBA, GL_FLOAT, states.data());
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        }
+
 		glGenFramebuffers(1, &m_fbo);
 		glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
 		glViewport(0, 0, m_width, m_height);
@@ -138,107 +333,122 @@ public:
 		glDrawBuffers(1, drawBuffers);
 		glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, m_fboTexture, 0);
 
-        float totalBlasBuildTime = 0.0;
-
-        const aiScene* scene = m_meshImporter.ReadFile("sponza.obj", aiProcess_Triangulate);
-        for (std::uint32_t meshId = 0; meshId < scene->mNumMeshes; meshId++) {
-            const aiMesh* mesh = scene->mMeshes[meshId];
-
-            bool emissive = (meshId == scene->mNumMeshes - 1);
-
-            std::vector<float> triangles;
-            for (std::uint32_t faceId = 0; faceId < mesh->mNumFaces; faceId++) {
-                const aiFace* face = &mesh->mFaces[faceId];
-
-                for (std::uint32_t indexId = 0; indexId < face->mNumIndices; indexId++) {
-                    std::uint32_t index = face->mIndices[indexId];
-
-                    const aiVector3D* vertex = &mesh->mVertices[index];
-                    triangles.insert(triangles.end(), {vertex->x, vertex->y, vertex->z, 1.0f});
-
-                    const aiVector3D* normal = &mesh->mNormals[index];
-                    triangles.insert(triangles.end(), {normal->x, normal->y, normal->z, 0.0f});
-
-                    triangles.insert(triangles.end(), {emissive ? 1.0f : 0.0f, 0.0f, 0.0f, 0.0f});
-                }
+        ThreadPool loaderPool;
+        SceneLoader sceneLoader;
+        sceneLoader.setBuildOptions(m_settings.blasBuild);
+        m_accels.setTlasBuildOptions(m_settings.tlasBuild);
+        sceneLoader.load("sponza.obj", m_accels, loaderPool);
+
+        // Uploads straight from the AccelerationStructures views, which may point into the mapped cache file.
+        // Only the node layout the extend program was compiled for is uploaded.
+        auto uploadBuffer = [this](GLuint& ssbo, AccelerationStructures::Buffer buffer, GLenum usage, bool needed = true) {
+            ssbo = 0;
+            if (!needed) return;
+
+            const auto& view = m_accels.getBuffer(buffer);
+            glGenBuffers(1, &ssbo);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, view.size, view.data, usage);
+        };
+
+        using Buffer = AccelerationStructures::Buffer;
+
+        bool splitNodes = !m_settings.packedNodes;
+        bool stackless = m_settings.stacklessTraversal;
+
+        uploadBuffer(m_ssboTlasGetAABB, Buffer::TlasAABB, GL_DYNAMIC_DRAW, splitNodes);
+        uploadBuffer(m_ssboTlasGetGeometry, Buffer::TlasGeometry, GL_DYNAMIC_DRAW);
+        uploadBuffer(m_ssboTlasGetChild, Buffer::TlasChild, GL_DYNAMIC_DRAW, splitNodes);
+        uploadBuffer(m_ssboTlasGetPrimitiveId, Buffer::TlasPrimitiveId, GL_DYNAMIC_DRAW);
+        uploadBuffer(m_ssboTlasIsLeaf, Buffer::TlasIsLeaf, GL_DYNAMIC_DRAW, splitNodes && !stackless);
+        uploadBuffer(m_ssboTlasGetBlasNodeOffset, Buffer::TlasBlasNodeOffset, GL_DYNAMIC_DRAW, splitNodes || stackless);
+        uploadBuffer(m_ssboTlasGetBlasGeometryOffset, Buffer::TlasBlasGeometryOffset, GL_DYNAMIC_DRAW);
+
+        uploadBuffer(m_ssboBlasGetAABB, Buffer::BlasAABB, GL_STATIC_DRAW, splitNodes);
+        uploadBuffer(m_ssboBlasGetTriangle, Buffer::BlasTriangle, GL_STATIC_DRAW);
+        uploadBuffer(m_ssboBlasGetChild, Buffer::BlasChild, GL_STATIC_DRAW, splitNodes);
+        uploadBuffer(m_ssboBlasGetIndex, Buffer::BlasIndex, GL_STATIC_DRAW);
+        uploadBuffer(m_ssboBlasIsLeaf, Buffer::BlasIsLeaf, GL_STATIC_DRAW, splitNodes && !stackless);
+        uploadBuffer(m_ssboBlasGetNormal, Buffer::BlasNormal, GL_STATIC_DRAW);
+        uploadBuffer(m_ssboBlasGetMaterial, Buffer::BlasMaterial, GL_STATIC_DRAW);
+
+        uploadBuffer(m_ssboTlasGetInstanceBlas, Buffer::TlasInstanceBlas, GL_DYNAMIC_DRAW);
+        uploadBuffer(m_ssboTlasGetWorldToObject, Buffer::TlasWorldToObject, GL_DYNAMIC_DRAW);
+        uploadBuffer(m_ssboTlasGetObjectToWorld, Buffer::TlasObjectToWorld, GL_DYNAMIC_DRAW);
+
+        uploadBuffer(m_ssboTlasGetNode, Buffer::TlasNode, GL_DYNAMIC_DRAW, m_settings.packedNodes);
+        uploadBuffer(m_ssboBlasGetNode, Buffer::BlasNode, GL_STATIC_DRAW, m_settings.packedNodes);
+        uploadBuffer(m_ssboTlasGetBlasPackedNodeOffset, Buffer::TlasBlasPackedNodeOffset, GL_DYNAMIC_DRAW, m_settings.packedNodes);
+
+        uploadBuffer(m_ssboTlasGetNodeLink, Buffer::TlasNodeLink, GL_DYNAMIC_DRAW, stackless);
+        uploadBuffer(m_ssboBlasGetNodeLink, Buffer::BlasNodeLink, GL_STATIC_DRAW, stackless);
+
+        // The emissive mesh is loaded last, so the light is the instance of the highest BLAS id.
+        const auto& instances = m_accels.getInstances();
+        m_animatedInstance = 0;
+        for (std::uint32_t i = 0; i < instances.size(); i++) {
+            if (instances[i].blas >= instances[m_animatedInstance].blas) {
+                m_animatedInstance = i;
             }
-            DeltaTime deltaTime;
-            m_accels.addBLAS(triangles);
-            totalBlasBuildTime += deltaTime.get();
         }
-        std::cout << "BLAS built in " << totalBlasBuildTime << " seconds" << std::endl;
+        m_animatedTransform = instances[m_animatedInstance].transform;
+
+        // The light cdf is built once; --animate only translates the light, which keeps the areas.
+        m_ssboShadowRays = m_ssboLights = 0;
+        m_lightCount = 0;
+        m_lightArea = 0.0f;
+        if (m_settings.nextEventEstimation) {
+            auto emissiveTriangles = m_accels.getEmissiveTriangles();
+            for (const auto& triangle : emissiveTriangles) {
+                m_lightArea += triangle.area;
+            }
 
-        DeltaTime deltaTime;
-        m_accels.buildTLAS();
-        std::cout << "TLAS built in " << deltaTime.get() << " seconds" << std::endl;
-
-        const auto& tlas = m_accels.getTLAS();
-
-        glGenBuffers(1, &m_ssboTlasGetAABB);
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_ssboTlasGetAABB);
-        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(float) * tlas.aabbs.size(), tlas.aabbs.data(), GL_DYNAMIC_DRAW);
-
-        glGenBuffers(1, &m_ssboTlasGetGeometry);
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_ssboTlasGetGeometry);
-        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(float) * tlas.geometry.size(), tlas.geometry.data(), GL_DYNAMIC_DRAW);
-
-        glGenBuffers(1, &m_ssboTlasGetChild);
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_ssboTlasGetChild);
-        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(std::uint32_t) * tlas.children.size(), tlas.children.data(), GL_DYNAMIC_DRAW);
-
-        glGenBuffers(1, &m_ssboTlasGetPrimitiveId);
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_ssboTlasGetPrimitiveId);
-        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(std::uint32_t) * tlas.primitives.size(), tlas.primitives.data(), GL_DYNAMIC_DRAW);
-
-        glGenBuffers(1, &m_ssboTlasIsLeaf);
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_ssboTlasIsLeaf);
-        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(std::uint32_t) * tlas.leafs.size(), tlas.leafs.data(), GL_DYNAMIC_DRAW);
-
-        glGenBuffers(1, &m_ssboTlasGetBlasNodeOffset);
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_ssboTlasGetBlasNodeOffset);
-        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(std::uint32_t) * m_accels.getTlasBlasNodeOffsets().size(), m_accels.getTlasBlasNodeOffsets().data(), GL_DYNAMIC_DRAW);
-
-        glGenBuffers(1, &m_ssboTlasGetBlasGeometryOffset);
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_ssboTlasGetBlasGeometryOffset);
-        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(std::uint32_t) * m_accels.getTlasBlasGeometryOffsets().size(), m_accels.getTlasBlasGeometryOffsets().data(), GL_DYNAMIC_DRAW);
-
-        std::vector<float>         blasAABBs;
-        std::vector<float>         blasGeometry;
-        std::vector<std::uint32_t> blasChildren;
-        std::vector<std::uint32_t> blasPrimitives;
-        std::vector<std::uint32_t> blasLeafs;
-
-        for (const auto& blasBVH : m_accels.getBLAS()) {
-            blasAABBs.insert(blasAABBs.end(), blasBVH.aabbs.begin(), blasBVH.aabbs.end());
-            blasGeometry.insert(blasGeometry.end(), blasBVH.geometry.begin(), blasBVH.geometry.end());
-            blasChildren.insert(blasChildren.end(), blasBVH.children.begin(), blasBVH.children.end());
-            blasPrimitives.insert(blasPrimitives.end(), blasBVH.primitives.begin(), blasBVH.primitives.end());
-            blasLeafs.insert(blasLeafs.end(), blasBVH.leafs.begin(), blasBVH.leafs.end());
-        }
+            // uvec4(instance, slot, cdf bits, 0); one record stays allocated without lights.
+            std::vector<std::uint32_t> lights(std::max<std::size_t>(emissiveTriangles.size(), 1) * 4, 0);
+            float areaSum = 0.0f;
+            for (std::uint32_t i = 0; i < emissiveTriangles.size(); i++) {
+                areaSum += emissiveTriangles[i].area;
+                float cdf = i + 1 == emissiveTriangles.size() ? 1.0f : areaSum / m_lightArea;
+                lights[i * 4 + 0] = emissiveTriangles[i].instance;
+                lights[i * 4 + 1] = emissiveTriangles[i].slot;
+                std::memcpy(&lights[i * 4 + 2], &cdf, sizeof(cdf));
+            }
+            m_lightCount = emissiveTriangles.size();
 
-        glGenBuffers(1, &m_ssboBlasGetAABB);
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_ssboBlasGetAABB);
-        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(float) * blasAABBs.size(), blasAABBs.data(), GL_STATIC_DRAW);
+            glGenBuffers(1, &m_ssboLights);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_ssboLights);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(std::uint32_t) * lights.size(), lights.data(), GL_STATIC_DRAW);
 
-        glGenBuffers(1, &m_ssboBlasGetGeometry);
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_ssboBlasGetGeometry);
-        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(float) * blasGeometry.size(), blasGeometry.data(), GL_STATIC_DRAW);
+            glGenBuffers(1, &m_ssboShadowRays);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_ssboShadowRays);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(float) * 4 * 2 * m_width * m_height, nullptr, GL_DYNAMIC_DRAW);
+        }
 
-        glGenBuffers(1, &m_ssboBlasGetChild);
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_ssboBlasGetChild);
-        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(std::uint32_t) * blasChildren.size(), blasChildren.data(), GL_STATIC_DRAW);
+        for (auto& frame : m_frames) {
+            glGenBuffers(1, &frame.rayCounts);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, frame.rayCounts);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(std::uint32_t) * m_rayCountSlots, nullptr, GL_DYNAMIC_READ);
 
-        glGenBuffers(1, &m_ssboBlasGetPrimitiveId);
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_ssboBlasGetPrimitiveId);
-        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(std::uint32_t) * blasPrimitives.size(), blasPrimitives.data(), GL_STATIC_DRAW);
+            glGenBuffers(1, &frame.dispatchArgs);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, frame.dispatchArgs);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, DISPATCH_ARGS_SIZE * m_rayCountSlots, nullptr, GL_DYNAMIC_DRAW);
+
+#ifdef BVH_STATS
+            glGenQueries(MAX_STAGE_MARKS, frame.timestamps.data());
+#endif
+        }
 
-        glGenBuffers(1, &m_ssboBlasIsLeaf);
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_ssboBlasIsLeaf);
-        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(std::uint32_t) * blasLeafs.size(), blasLeafs.data(), GL_STATIC_DRAW);
+#ifdef BVH_STATS
+        // Counted over every frame until writeTraversalStats.
+        std::vector<std::uint32_t> zeroCounters(m_width * m_height * TRAVERSAL_STAT_COUNT, 0);
+        glGenTextures(1, &m_traversalHeatmap);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, m_traversalHeatmap);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R32UI, m_width, m_height, TRAVERSAL_STAT_COUNT, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, zeroCounters.data());
 
-        glGenBuffers(1, &m_ssboCounter);
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_ssboCounter);
-        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(std::uint32_t), nullptr, GL_DYNAMIC_DRAW);
+        glGenTextures(1, &m_traversalHistogram);
+        glBindTexture(GL_TEXTURE_2D, m_traversalHistogram);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R32UI, HISTOGRAM_BINS, TRAVERSAL_STAT_COUNT, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, zeroCounters.data());
+#endif
 
         glGenBuffers(1, &m_ssboRayBufferRead);
         glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_ssboRayBufferRead);
@@ -251,40 +461,177 @@ public:
         glGenBuffers(1, &m_ssboIntersectionBuffer);
         glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_ssboIntersectionBuffer);
         glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(float) * 4 * m_width * m_height, nullptr, GL_DYNAMIC_DRAW);
+
+        glGenBuffers(1, &m_ssboAccumulation);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_ssboAccumulation);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(float) * 4 * 2 * m_width * m_height, nullptr, GL_DYNAMIC_DRAW);
+        resetAccumulation();
+
+        m_ssboSortKeys[0] = m_ssboSortKeys[1] = m_ssboSortValues[0] = m_ssboSortValues[1] = 0;
+        m_ssboSortBlockHistogram = m_ssboRayBufferSorted = m_ssboRayStats = 0;
+        if (m_settings.sortRays) {
+            std::uint32_t blockCount = (m_width * m_height + SORT_BLOCK_SIZE - 1) / SORT_BLOCK_SIZE;
+
+            for (GLuint* ssbo : {&m_ssboSortKeys[0], &m_ssboSortKeys[1], &m_ssboSortValues[0], &m_ssboSortValues[1]}) {
+                glGenBuffers(1, ssbo);
+                glBindBuffer(GL_SHADER_STORAGE_BUFFER, *ssbo);
+                glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(std::uint32_t) * m_width * m_height, nullptr, GL_DYNAMIC_DRAW);
+            }
+
+            glGenBuffers(1, &m_ssboSortBlockHistogram);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_ssboSortBlockHistogram);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(std::uint32_t) * SORT_RADIX * blockCount, nullptr, GL_DYNAMIC_DRAW);
+
+            glGenBuffers(1, &m_ssboRayBufferSorted);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_ssboRayBufferSorted);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(float) * 4 * 2 * m_width * m_height, nullptr, GL_DYNAMIC_DRAW);
+        }
+
+        if (m_settings.rayStats) {
+            glGenBuffers(1, &m_ssboRayStats);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_ssboRayStats);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(std::uint32_t), nullptr, GL_DYNAMIC_DRAW);
+        }
     }
 
 	~Render() {
+        for (auto& frame : m_frames) {
+            if (frame.fence) glDeleteSync(frame.fence);
+            glDeleteBuffers(1, &frame.rayCounts);
+            glDeleteBuffers(1, &frame.dispatchArgs);
+#ifdef BVH_STATS
+            glDeleteQueries(MAX_STAGE_MARKS, frame.timestamps.data());
+#endif
+        }
+#ifdef BVH_STATS
+        glDeleteTextures(1, &m_traversalHeatmap);
+        glDeleteTextures(1, &m_traversalHistogram);
+#endif
 		glDeleteFramebuffers(1, &m_fbo);
 		glDeleteTextures(1, &m_fboTexture);
+		glDeleteTextures(1, &m_sampleTexture);
+        if (m_pathStateTexture) glDeleteTextures(1, &m_pathStateTexture);
 	}
 
-    std::uint32_t generate() {
+    // Reuploads what updateTLAS touched; buffers of the node layout that is not in use stay unallocated.
+    void applyTlasUpdate(const AccelerationStructures::TlasUpdate& update) {
+        using Buffer = AccelerationStructures::Buffer;
+
+        const std::pair<Buffer, GLuint> buffers[] = {
+            {Buffer::TlasAABB,          m_ssboTlasGetAABB},
+            {Buffer::TlasGeometry,      m_ssboTlasGetGeometry},
+            {Buffer::TlasChild,         m_ssboTlasGetChild},
+            {Buffer::TlasPrimitiveId,   m_ssboTlasGetPrimitiveId},
+            {Buffer::TlasIsLeaf,        m_ssboTlasIsLeaf},
+            {Buffer::TlasNodeLink,      m_ssboTlasGetNodeLink},
+            {Buffer::TlasNode,          m_ssboTlasGetNode},
+            {Buffer::TlasInstanceBlas,  m_ssboTlasGetInstanceBlas},
+            {Buffer::TlasWorldToObject, m_ssboTlasGetWorldToObject},
+            {Buffer::TlasObjectToWorld, m_ssboTlasGetObjectToWorld}
+        };
+
+        for (const auto& [buffer, ssbo] : buffers) {
+            const auto& range = update.ranges[static_cast<std::uint32_t>(buffer)];
+            if (ssbo == 0 || range.size == 0) continue;
+
+            const auto& view = m_accels.getBuffer(buffer);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
+            if (update.resized) {
+                glBufferData(GL_SHADER_STORAGE_BUFFER, view.size, view.data, GL_DYNAMIC_DRAW);
+            } else {
+                glBufferSubData(GL_SHADER_STORAGE_BUFFER, range.offset, range.size, static_cast<const std::uint8_t*>(view.data) + range.offset);
+            }
+        }
+    }
+
+    void animate() {
+        std::array<float, 12> transform = m_animatedTransform;
+        transform[3] += 5.0f * std::sin(m_timer);
+        m_accels.setInstanceTransform(m_animatedInstance, transform);
+        applyTlasUpdate(m_accels.updateTLAS());
+    }
+
+    void generate() {
         std::uint32_t workgroupSizeX = 8;
         std::uint32_t workgroupSizeY = 8;
 
-        std::uint32_t counter = 0;
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_ssboCounter);
-        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(std::uint32_t), &counter);
-
         glUseProgram(m_programGenerate->getProgram());
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, m_ssboCounter);
         glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, m_ssboRayBufferWrite);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 15, m_ssboAccumulation);
         glUniform2i(glGetUniformLocation(m_programGenerate->getProgram(), "u_screenSize"), m_width, m_height);
+        glUniform1ui(glGetUniformLocation(m_programGenerate->getProgram(), "u_minSamples"), m_settings.minSamples);
+        glUniform1f(glGetUniformLocation(m_programGenerate->getProgram(), "u_errorThreshold"), m_settings.errorThreshold);
         glUniformMatrix4fv(glGetUniformLocation(m_programGenerate->getProgram(), "u_viewInv"), 1, GL_TRUE, &m_viewInv[0][0]);
         glDispatchCompute((m_width + workgroupSizeX - 1) / workgroupSizeX, (m_height + workgroupSizeY - 1) / workgroupSizeY, 1);
-        glMemoryBarrier(GL_ALL_BARRIER_BITS);
         glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-        glFinish();
-
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_ssboCounter);
-        glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(std::uint32_t), &counter);
+    }
 
-        return counter;
+    // Writes the indirect arguments for the passes over the rays counted in rayCounts[countIndex].
+    void writeDispatchArgs(std::uint32_t countIndex) {
+        glUseProgram(m_programDispatchArgs->getProgram());
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, m_frames[m_frameIndex].dispatchArgs);
+        glUniform1ui(glGetUniformLocation(m_programDispatchArgs->getProgram(), "u_countIndex"), countIndex);
+        glDispatchCompute(1, 1, 1);
+        glMemoryBarrier(GL_COMMAND_BARRIER_BIT);
     }
 
-    void extend(std::uint32_t rayBufferSize) {
-        std::uint32_t workgroupSizeX = 64;
+    // Sorts the rays the next extend will read; see radixsort.glsl for the passes.
+    void sortRays(std::uint32_t countIndex) {
+        GLintptr blocksArgs = countIndex * DISPATCH_ARGS_SIZE + DISPATCH_SORT_OFFSET;
+
+        const float* root = m_accels.getBuffer(AccelerationStructures::Buffer::TlasAABB).as<float>();
+        glm::vec3 sceneMin(root[0], root[1], root[2]);
+        glm::vec3 sceneExtent = glm::max(glm::vec3(root[4], root[5], root[6]) - sceneMin, glm::vec3(1e-6f));
+        glm::vec3 sceneScale = glm::vec3(float(1 << RaySorter::MORTON_BITS_PER_AXIS)) / sceneExtent;
+
+        GLuint program = m_programRayKeys->getProgram();
+        glUseProgram(program);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 14, m_ssboRayBufferWrite);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 27, m_ssboSortKeys[0]);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 28, m_ssboSortValues[0]);
+        glUniform1ui(glGetUniformLocation(program, "u_countIndex"), countIndex);
+        glUniform3f(glGetUniformLocation(program, "u_sceneMin"), sceneMin.x, sceneMin.y, sceneMin.z);
+        glUniform3f(glGetUniformLocation(program, "u_sceneScale"), sceneScale.x, sceneScale.y, sceneScale.z);
+        glDispatchComputeIndirect(blocksArgs);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        std::uint32_t input = 0;
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 29, m_ssboSortBlockHistogram);
+        for (std::uint32_t shift = 0; shift < RaySorter::KEY_BITS; shift += SORT_RADIX_BITS) {
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 25, m_ssboSortKeys[input]);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 26, m_ssboSortValues[input]);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 27, m_ssboSortKeys[1 - input]);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 28, m_ssboSortValues[1 - input]);
+
+            for (auto* pass : {&m_programRadixHistogram, &m_programRadixScan, &m_programRadixScatter}) {
+                program = (*pass)->getProgram();
+                glUseProgram(program);
+                glUniform1ui(glGetUniformLocation(program, "u_countIndex"), countIndex);
+                glUniform1ui(glGetUniformLocation(program, "u_shift"), shift);
+                if (pass == &m_programRadixScan) {
+                    glDispatchCompute(1, 1, 1);
+                } else {
+                    glDispatchComputeIndirect(blocksArgs);
+                }
+                glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+            }
+
+            input = 1 - input;
+        }
+
+        program = m_programReorder->getProgram();
+        glUseProgram(program);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 14, m_ssboRayBufferWrite);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 16, m_ssboRayBufferSorted);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 26, m_ssboSortValues[input]);
+        glUniform1ui(glGetUniformLocation(program, "u_countIndex"), countIndex);
+        glDispatchComputeIndirect(blocksArgs);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        std::swap(m_ssboRayBufferWrite, m_ssboRayBufferSorted);
+    }
 
+    void extend(std::uint32_t countIndex) {
         std::swap(m_ssboRayBufferRead, m_ssboRayBufferWrite);
 
         glUseProgram(m_programExtend->getProgram());
@@ -298,29 +645,69 @@ public:
         glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, m_ssboTlasGetBlasNodeOffset);
         glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, m_ssboTlasGetBlasGeometryOffset);
         glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, m_ssboBlasGetAABB);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, m_ssboBlasGetGeometry);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, m_ssboBlasGetTriangle);
         glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 10, m_ssboBlasGetChild);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 11, m_ssboBlasGetPrimitiveId);
         glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 12, m_ssboBlasIsLeaf);
-        glUniform1ui(glGetUniformLocation(m_programExtend->getProgram(), "u_raysCount"), rayBufferSize);
-        glDispatchCompute((rayBufferSize + workgroupSizeX - 1) / workgroupSizeX, 1, 1);
-        glMemoryBarrier(GL_ALL_BARRIER_BITS);
-        glFinish();
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 17, m_ssboTlasGetNode);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 18, m_ssboBlasGetNode);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 19, m_ssboTlasGetBlasPackedNodeOffset);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 22, m_ssboTlasGetInstanceBlas);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 23, m_ssboTlasGetWorldToObject);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 34, m_ssboTlasGetNodeLink);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 35, m_ssboBlasGetNodeLink);
+#ifdef BVH_STATS
+        glBindImageTexture(1, m_traversalHeatmap, 0, GL_TRUE, 0, GL_READ_WRITE, GL_R32UI);
+        glBindImageTexture(2, m_traversalHistogram, 0, GL_FALSE, 0, GL_READ_WRITE, GL_R32UI);
+#endif
+        glUniform1ui(glGetUniformLocation(m_programExtend->getProgram(), "u_countIndex"), countIndex);
+        glDispatchComputeIndirect(countIndex * DISPATCH_ARGS_SIZE);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
     }
 
-    std::uint32_t shade(std::uint32_t rayBufferSize, std::uint32_t iteration) {
-        std::uint32_t workgroupSizeX = 64;
-
-        std::uint32_t counter = 0;
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_ssboCounter);
-        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(std::uint32_t), &counter);
-
+    // Appends the bounced rays to m_ssboRayBufferWrite and counts them in rayCounts[countIndex + 1],
+    // and with next event estimation the shadow rays to m_ssboShadowRays. Persistent paths write
+    // every ray back to its own slot, bounced or restarted.
+    void shade(std::uint32_t countIndex, std::uint32_t iteration) {
         glUseProgram(m_programShade->getProgram());
-        glBindImageTexture(0, m_fboTexture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+        glBindImageTexture(0, m_sampleTexture, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
+        glBindImageTexture(1, m_pathStateTexture, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
         glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 16, m_ssboRayBufferWrite);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 15, m_ssboCounter);
         glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 13, m_ssboIntersectionBuffer);
         glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 14, m_ssboRayBufferRead);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, m_ssboTlasGetPrimitiveId);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, m_ssboTlasGetBlasGeometryOffset);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, m_ssboBlasGetTriangle);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 11, m_ssboBlasGetIndex);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 20, m_ssboBlasGetNormal);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 21, m_ssboBlasGetMaterial);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 22, m_ssboTlasGetInstanceBlas);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 23, m_ssboTlasGetWorldToObject);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 24, m_ssboTlasGetObjectToWorld);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 30, m_ssboRayStats);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 32, m_ssboShadowRays);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 33, m_ssboLights);
+        glUniform1ui(glGetUniformLocation(m_programShade->getProgram(), "u_iteration"), iteration);
+        glUniform1ui(glGetUniformLocation(m_programShade->getProgram(), "u_frame"), m_accumulatedFrames);
+        glUniform1ui(glGetUniformLocation(m_programShade->getProgram(), "u_countIndex"), countIndex);
+        glUniform1f(glGetUniformLocation(m_programShade->getProgram(), "u_timer"), m_timer);
+        glUniform1ui(glGetUniformLocation(m_programShade->getProgram(), "u_shadowCountIndex"), m_shadowCountSlot + iteration);
+        glUniform1ui(glGetUniformLocation(m_programShade->getProgram(), "u_lightCount"), m_lightCount);
+        glUniform1f(glGetUniformLocation(m_programShade->getProgram(), "u_lightArea"), m_lightArea);
+        glUniform1ui(glGetUniformLocation(m_programShade->getProgram(), "u_restartCountIndex"), m_restartCountSlot);
+        glUniform2i(glGetUniformLocation(m_programShade->getProgram(), "u_screenSize"), m_width, m_height);
+        glUniformMatrix4fv(glGetUniformLocation(m_programShade->getProgram(), "u_viewInv"), 1, GL_TRUE, &m_viewInv[0][0]);
+        glDispatchComputeIndirect(countIndex * DISPATCH_ARGS_SIZE);
+        // Later bounces store to the same pixels.
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+    }
+
+    // Traces the shadow rays counted in rayCounts[countIndex] with the any-hit variant of extend
+    // and adds the light of the unoccluded ones to their samples, or to their paths' radiance.
+    void connect(std::uint32_t countIndex) {
+        GLuint program = m_programConnect->getProgram();
+        glUseProgram(program);
+        glBindImageTexture(0, m_settings.persistentPaths ? m_pathStateTexture : m_sampleTexture, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 32, m_ssboShadowRays);
         glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, m_ssboTlasGetAABB);
         glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, m_ssboTlasGetGeometry);
         glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, m_ssboTlasGetChild);
@@ -329,25 +716,171 @@ public:
         glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, m_ssboTlasGetBlasNodeOffset);
         glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, m_ssboTlasGetBlasGeometryOffset);
         glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, m_ssboBlasGetAABB);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, m_ssboBlasGetGeometry);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, m_ssboBlasGetTriangle);
         glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 10, m_ssboBlasGetChild);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 11, m_ssboBlasGetPrimitiveId);
         glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 12, m_ssboBlasIsLeaf);
-        glUniform1ui(glGetUniformLocation(m_programShade->getProgram(), "u_iteration"), iteration);
-        glUniform1ui(glGetUniformLocation(m_programShade->getProgram(), "u_raysCount"), rayBufferSize);
-        glUniform1f(glGetUniformLocation(m_programShade->getProgram(), "u_timer"), m_timer);
-        glDispatchCompute((rayBufferSize + workgroupSizeX - 1) / workgroupSizeX, 1, 1);
-        glMemoryBarrier(GL_ALL_BARRIER_BITS);
-        glFinish();
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 17, m_ssboTlasGetNode);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 18, m_ssboBlasGetNode);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 19, m_ssboTlasGetBlasPackedNodeOffset);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 22, m_ssboTlasGetInstanceBlas);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 23, m_ssboTlasGetWorldToObject);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 34, m_ssboTlasGetNodeLink);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 35, m_ssboBlasGetNodeLink);
+        glUniform1ui(glGetUniformLocation(program, "u_countIndex"), countIndex);
+        glDispatchComputeIndirect(countIndex * DISPATCH_ARGS_SIZE);
+        // The next bounce's shade appends to the same shadow ray buffer.
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+    }
+
+    // Folds the samples shade left in m_sampleTexture into the running mean and variance,
+    // and shows the mean.
+    void accumulate() {
+        std::uint32_t workgroupSizeX = 8;
+        std::uint32_t workgroupSizeY = 8;
+
+        glUseProgram(m_programAccumulate->getProgram());
+        glBindImageTexture(0, m_sampleTexture, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
+        glBindImageTexture(1, m_fboTexture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 15, m_ssboAccumulation);
+        glUniform2i(glGetUniformLocation(m_programAccumulate->getProgram(), "u_screenSize"), m_width, m_height);
+        glDispatchCompute((m_width + workgroupSizeX - 1) / workgroupSizeX, (m_height + workgroupSizeY - 1) / workgroupSizeY, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+
+        m_accumulatedFrames++;
+    }
+
+    void resetAccumulation() {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_ssboAccumulation);
+        glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_RGBA32F, GL_RGBA, GL_FLOAT, nullptr);
+        m_accumulatedFrames = 0;
+    }
+
+    // Records the end of a stage of the current frame; compiles to nothing without BVH_STATS.
+    void markStage([[maybe_unused]] const char* stage, [[maybe_unused]] std::int32_t bounce = -1) {
+#ifdef BVH_STATS
+        Frame& frame = m_frames[m_frameIndex];
+        if (frame.markCount == MAX_STAGE_MARKS) return;
+
+        glQueryCounter(frame.timestamps[frame.markCount], GL_TIMESTAMP);
+        frame.marks[frame.markCount] = {stage, bounce, std::chrono::steady_clock::now()};
+        frame.markCount++;
+#endif
+    }
+
+#ifdef BVH_STATS
+    // GPU time of every stage and, in parentheses, the CPU time spent recording it.
+    void printStageTimes(Frame& frame) {
+        std::array<GLuint64, MAX_STAGE_MARKS> timestamps = {};
+        for (std::uint32_t i = 0; i < frame.markCount; i++) {
+            glGetQueryObjectui64v(frame.timestamps[i], GL_QUERY_RESULT, &timestamps[i]);
+        }
 
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_ssboCounter);
-        glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(std::uint32_t), &counter);
+        std::cout << "stages:";
+        for (std::uint32_t i = 1; i < frame.markCount; i++) {
+            const StageMark& mark = frame.marks[i];
+            double cpuMs = std::chrono::duration<double, std::milli>(mark.cpuTime - frame.marks[i - 1].cpuTime).count();
+            std::cout << " " << mark.stage;
+            if (mark.bounce >= 0) std::cout << mark.bounce;
+            std::cout << " " << (timestamps[i] - timestamps[i - 1]) / 1e6 << " ms (" << cpuMs << " ms)";
+        }
+        std::cout << std::endl;
+        frame.markCount = 0;
+    }
+
+    // Writes one false color heatmap per traversal counter as <prefix>-<counter>.ppm, summed over
+    // the bounces and frames so far, and the per ray log2 histograms as <prefix>.json.
+    bool writeTraversalStats(const std::string& prefix) {
+        glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+
+        std::vector<std::uint32_t> heatmap(m_width * m_height * TRAVERSAL_STAT_COUNT);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, m_traversalHeatmap);
+        glGetTexImage(GL_TEXTURE_2D_ARRAY, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, heatmap.data());
+
+        std::vector<std::uint32_t> histogram(HISTOGRAM_BINS * TRAVERSAL_STAT_COUNT);
+        glBindTexture(GL_TEXTURE_2D, m_traversalHistogram);
+        glGetTexImage(GL_TEXTURE_2D, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, histogram.data());
+
+        for (std::uint32_t stat = 0; stat < TRAVERSAL_STAT_COUNT; stat++) {
+            const std::uint32_t* layer = &heatmap[stat * m_width * m_height];
+            std::uint32_t maxValue = std::max(*std::max_element(layer, layer + m_width * m_height), 1u);
+
+            std::ofstream output(prefix + "-" + TRAVERSAL_STAT_NAMES[stat] + ".ppm", std::ios::binary);
+            output << "P6\n" << m_width << " " << m_height << "\n255\n";
+            for (std::uint32_t y = m_height; y-- > 0;) {
+                for (std::uint32_t x = 0; x < m_width; x++) {
+                    // Black through blue and red to yellow.
+                    float t = float(layer[y * m_width + x]) / float(maxValue);
+                    unsigned char rgb[3] = {
+                        static_cast<unsigned char>(std::clamp(2.0f * t, 0.0f, 1.0f) * 255.0f),
+                        static_cast<unsigned char>(std::clamp(2.0f * t - 1.0f, 0.0f, 1.0f) * 255.0f),
+                        static_cast<unsigned char>(std::clamp(t < 0.5f ? 2.0f * t : 2.0f - 2.0f * t, 0.0f, 1.0f) * 255.0f)
+                    };
+                    output.write(reinterpret_cast<const char*>(rgb), sizeof(rgb));
+                }
+            }
+            if (!output) return false;
+        }
 
-        return counter;
+        std::ofstream output(prefix + ".json");
+        output << "{\n  \"bins\": \"bin 0 counts zeros, bin b > 0 counts values in [2^(b-1), 2^b)\"";
+        for (std::uint32_t stat = 0; stat < TRAVERSAL_STAT_COUNT; stat++) {
+            output << ",\n  \"" << TRAVERSAL_STAT_NAMES[stat] << "\": [";
+            for (std::uint32_t bin = 0; bin < HISTOGRAM_BINS; bin++) {
+                output << (bin ? ", " : "") << histogram[stat * HISTOGRAM_BINS + bin];
+            }
+            output << "]";
+        }
+        output << "\n}\n";
+        return bool(output);
     }
+#endif
+
+    // Waits for the frame that last used the current slot and reports it, one frame late,
+    // so reading its counters does not stall.
+    void retireFrame(Frame& frame) {
+        if (!frame.fence) return;
+
+        while (glClientWaitSync(frame.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) { }
+        glDeleteSync(frame.fence);
+        frame.fence = nullptr;
+
+        std::vector<std::uint32_t> rays(m_rayCountSlots);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, frame.rayCounts);
+        glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(std::uint32_t) * rays.size(), rays.data());
+        std::cout << frame.delta << "; " << rays[m_iterations];
+        if (m_settings.nextEventEstimation) {
+            std::uint32_t shadowRays = 0;
+            for (std::uint32_t i = 0; i < m_iterations; i++) {
+                shadowRays += rays[m_shadowCountSlot + i];
+            }
+            std::cout << "; " << shadowRays << " shadow rays";
+        }
+        if (m_settings.persistentPaths) {
+            std::cout << "; " << rays[m_restartCountSlot] << " paths restarted";
+        } else if (m_settings.accumulate) {
+            std::cout << "; " << rays[0] << " pixels sampled";
+        }
+        std::cout << std::endl;
 
-    void connect() {
+#ifdef BVH_STATS
+        printStageTimes(frame);
+#endif
+    }
 
+    // Only --ray-stats reads anything back mid-frame; it waits for every bounce to time it.
+    void printRayStats(std::uint32_t bounce, bool sorted, double sortMs, double extendMs) {
+        std::uint32_t extendedRays = 0;
+        std::uint32_t coherentPairs = 0;
+        glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_frames[m_frameIndex].rayCounts);
+        glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, sizeof(std::uint32_t) * bounce, sizeof(std::uint32_t), &extendedRays);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_ssboRayStats);
+        glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(std::uint32_t), &coherentPairs);
+
+        std::cout << "bounce " << bounce << ": " << extendedRays << " rays" << (sorted ? ", sort " : ", unsorted")
+                  << (sorted ? std::to_string(sortMs) + " ms" : std::string())
+                  << ", extend " << extendMs << " ms (" << extendedRays / std::max(extendMs, 1e-3) / 1e3 << " Mrays/s)"
+                  << ", coherence " << 100.0f * coherentPairs / std::max(extendedRays - 1, 1u) << "%" << std::endl;
     }
 
     void render(float delta) {
@@ -355,29 +888,238 @@ public:
 
         m_timer += delta;
 
-        std::uint32_t rays = generate();
+        Frame& frame = m_frames[m_frameIndex];
+        retireFrame(frame);
+        frame.delta = delta;
+
+        if (m_settings.animate) {
+            animate();
+        }
+        if (!m_settings.accumulate || m_settings.animate) {
+            resetAccumulation();
+        }
 
-        for (std::uint32_t i = 0; i < 2; i++) {
-            extend(rays);
-            rays = shade(rays, i);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, frame.rayCounts);
+        glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 31, frame.rayCounts);
+        glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, frame.dispatchArgs);
+        markStage("begin");
+
+        if (!m_settings.persistentPaths || !m_pathsStarted) {
+            generate();
+            m_pathsStarted = true;
+        } else {
+            // The last frame's shade left one ray per pixel in m_ssboRayBufferWrite.
+            std::uint32_t pathCount = m_width * m_height;
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(pathCount), &pathCount);
         }
+        markStage("generate");
+
+        for (std::uint32_t i = 0; i < m_iterations; i++) {
+            writeDispatchArgs(i);
+            markStage("args", i);
+
+            auto start = std::chrono::steady_clock::now();
+            bool sorted = m_settings.sortRays && i >= m_settings.sortFromBounce;
+            if (sorted) {
+                sortRays(i);
+                if (m_settings.rayStats) glFinish();
+                markStage("sort", i);
+            }
+            auto sortEnd = std::chrono::steady_clock::now();
+
+            extend(i);
+            if (m_settings.rayStats) glFinish();
+            markStage("extend", i);
+            auto extendEnd = std::chrono::steady_clock::now();
+
+            if (m_settings.rayStats) {
+                glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_ssboRayStats);
+                glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+            }
 
-        glBindFramebuffer(GL_READ_FRAMEBUFFER, m_fbo);
-        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
-        glBlitFramebuffer(0, 0, m_width, m_height, 0, 0, m_width, m_height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+            shade(i, i);
+            markStage("shade", i);
+
+            if (m_settings.nextEventEstimation) {
+                writeDispatchArgs(m_shadowCountSlot + i);
+                connect(m_shadowCountSlot + i);
+                markStage("connect", i);
+            }
+
+            if (m_settings.rayStats) {
+                printRayStats(i, sorted, std::chrono::duration<double, std::milli>(sortEnd - start).count(),
+                              std::chrono::duration<double, std::milli>(extendEnd - sortEnd).count());
+            }
+        }
 
-        std::cout << delta << "; " << rays << std::endl;
+        accumulate();
+        markStage("accumulate");
+
+        glMemoryBarrier(GL_FRAMEBUFFER_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+        if (!m_settings.headless) {
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, m_fbo);
+            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+            glBlitFramebuffer(0, 0, m_width, m_height, 0, 0, m_width, m_height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+            markStage("blit");
+        }
+
+        frame.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        m_frameIndex = (m_frameIndex + 1) % FRAMES_IN_FLIGHT;
 	}
+
+    // Waits for all frames and writes the image as binary PPM.
+    bool writeImage(const std::string& path) {
+        for (std::uint32_t i = 0; i < FRAMES_IN_FLIGHT; i++) {
+            retireFrame(m_frames[(m_frameIndex + i) % FRAMES_IN_FLIGHT]);
+        }
+
+        std::vector<glm::vec4> pixels(m_width * m_height);
+        glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+        glBindTexture(GL_TEXTURE_2D, m_fboTexture);
+        glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, pixels.data());
+
+        std::ofstream output(path, std::ios::binary);
+        if (!output) {
+            return false;
+        }
+
+        output << "P6\n" << m_width << " " << m_height << "\n255\n";
+        for (std::uint32_t y = m_height; y-- > 0;) {
+            for (std::uint32_t x = 0; x < m_width; x++) {
+                const glm::vec4& color = pixels[y * m_width + x];
+                unsigned char rgb[3];
+                for (int c = 0; c < 3; c++) {
+                    rgb[c] = static_cast<unsigned char>(std::clamp(color[c], 0.0f, 1.0f) * 255.0f + 0.5f);
+                }
+                output.write(reinterpret_cast<const char*>(rgb), sizeof(rgb));
+            }
+        }
+
+        return bool(output);
+    }
 };
 
-int main() {
-    const std::uint32_t width = 1600;
-    const std::uint32_t height = 900;
+#ifdef BVH_EGL
+// Renders into the offscreen texture on a surfaceless EGL context, which Mesa's llvmpipe
+// provides without a display, and writes it out.
+int runHeadless(std::uint32_t width, std::uint32_t height, Render::Settings settings, const std::string& output, std::uint32_t frames) {
+    auto getPlatformDisplay = reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(eglGetProcAddress("eglGetPlatformDisplayEXT"));
+    EGLDisplay display = getPlatformDisplay ? getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr) : EGL_NO_DISPLAY;
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, nullptr, nullptr) || !eglBindAPI(EGL_OPENGL_API)) {
+        std::cout << "No surfaceless EGL display" << std::endl;
+        return 1;
+    }
+
+    const EGLint contextAttributes[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 4,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_CONTEXT_OPENGL_DEBUG, EGL_TRUE,
+        EGL_NONE
+    };
+    EGLContext context = eglCreateContext(display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, contextAttributes);
+    if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+        std::cout << "Failed to create an OpenGL 4.3 core context" << std::endl;
+        eglTerminate(display);
+        return 1;
+    }
+
+    // GLEW skips the core profile entry points otherwise.
+    glewExperimental = GL_TRUE;
+    glewInit();
+    glEnable(GL_DEBUG_OUTPUT);
+    glDebugMessageCallback([](GLenum, GLenum type, GLuint, GLenum, GLsizei, const GLchar* message, const void*) {
+        if (type == GL_DEBUG_TYPE_ERROR) std::cout << "GL error: " << message << std::endl;
+    }, nullptr);
+
+    bool written = false;
+    {
+        settings.headless = true;
+        Render render(width, height, settings);
+
+        DeltaTime deltaTime;
+        float delta = 0.0f;
+        for (std::uint32_t frame = 0; frame < frames; frame++) {
+            render.render(delta);
+            delta = deltaTime.get();
+        }
+
+        written = render.writeImage(output);
+#ifdef BVH_STATS
+        written = render.writeTraversalStats(settings.statsPrefix) && written;
+#endif
+    }
+
+    eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(display, context);
+    eglTerminate(display);
+
+    if (!written) {
+        std::cout << "Failed to write " << output << std::endl;
+        return 1;
+    }
+    std::cout << "Wrote " << output << std::endl;
+    return 0;
+}
+#endif
+
+void parseBuilderArg(const std::string& name, AccelerationStructures::Builder& builder) {
+    if (!AccelerationStructures::parseBuilder(name, builder)) {
+        std::cout << "Unknown builder " << name << ", using " << AccelerationStructures::getBuilderName(builder) << std::endl;
+    }
+}
+
+int main(int argc, char** argv) {
+    std::uint32_t width = 1600;
+    std::uint32_t height = 900;
+
+    Render::Settings settings;
+    bool headless = false;
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--packed-nodes") settings.packedNodes = true;
+        else if (arg == "--animate") settings.animate = true;
+        else if (arg == "--sort-rays") settings.sortRays = true;
+        else if (arg == "--sort-from-bounce" && i + 1 < argc) settings.sortFromBounce = std::atoi(argv[++i]);
+        else if (arg == "--ray-stats") settings.rayStats = true;
+        else if (arg == "--headless") headless = true;
+        else if (arg == "--accumulate") settings.accumulate = true;
+        else if (arg == "--min-samples" && i + 1 < argc) settings.minSamples = std::atoi(argv[++i]);
+        else if (arg == "--error-threshold" && i + 1 < argc) settings.errorThreshold = std::atof(argv[++i]);
+        else if (arg == "--no-nee") settings.nextEventEstimation = false;
+        else if (arg == "--stackless") settings.stacklessTraversal = true;
+        else if (arg == "--persistent") settings.persistentPaths = true;
+        else if (arg == "--path-iterations" && i + 1 < argc) settings.pathIterations = std::atoi(argv[++i]);
+        else if (arg == "--builder" && i + 1 < argc) parseBuilderArg(argv[++i], settings.blasBuild.builder);
+        else if (arg == "--leaf-size" && i + 1 < argc) settings.blasBuild.maxLeafSize = std::atoi(argv[++i]);
+        else if (arg == "--tlas-builder" && i + 1 < argc) parseBuilderArg(argv[++i], settings.tlasBuild.builder);
+        else if (arg == "--tlas-leaf-size" && i + 1 < argc) settings.tlasBuild.maxLeafSize = std::atoi(argv[++i]);
+#ifdef BVH_STATS
+        else if (arg == "--stats-prefix" && i + 1 < argc) settings.statsPrefix = argv[++i];
+#endif
+        else positional.push_back(arg);
+    }
+
+    // --headless [output.ppm] [width] [height] [frames], the same arguments as BvhTestCpu.
+    if (headless) {
+#ifdef BVH_EGL
+        std::string output = positional.size() > 0 ? positional[0] : "render.ppm";
+        width = positional.size() > 1 ? std::atoi(positional[1].c_str()) : width;
+        height = positional.size() > 2 ? std::atoi(positional[2].c_str()) : height;
+        std::uint32_t frames = positional.size() > 3 ? std::atoi(positional[3].c_str()) : 1;
+        return runHeadless(width, height, settings, output, frames);
+#else
+        std::cout << "Built without EGL, --headless is not available" << std::endl;
+        return 1;
+#endif
+    }
 
 	SDL_Init(SDL_INIT_VIDEO);
 	SDL_Window* window = SDL_CreateWindow("bvh test", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, width, height, SDL_WINDOW_OPENGL | SDL_WINDOW_SHOWN);
 	SDL_GLContext glContext = SDL_GL_CreateContext(window);
-	Render render(width, height);
+	Render render(width, height, settings);
 
     DeltaTime deltaTime;
     float delta = 0.0f;
@@ -399,6 +1141,12 @@ int main() {
         delta = deltaTime.get();
     }
 
+#ifdef BVH_STATS
+    if (!render.writeTraversalStats(settings.statsPrefix)) {
+        std::cout << "Failed to write " << settings.statsPrefix << std::endl;
+    }
+#endif
+
 	SDL_GL_DeleteContext(glContext);
 	SDL_DestroyWindow(window);
 	SDL_Quit();
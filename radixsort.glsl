@@ -0,0 +1,153 @@
+#version 430
+
+// One pass of an LSD radix sort over (key, value) pairs, RADIX_BITS per pass.
+// Compiled three times: HISTOGRAM counts the digits of every block, SCAN turns the
+// counts into output offsets in (digit, block) order and SCATTER sorts each block
+// locally by the digit and writes it out, which keeps the pass stable.
+#define RADIX_BITS 4u
+#define RADIX      (1u << RADIX_BITS)
+#define BLOCK_SIZE 256u
+
+#ifdef SCAN
+#define WORKGROUP_SIZE 1024u
+#else
+#define WORKGROUP_SIZE BLOCK_SIZE
+#endif
+
+// The item count is read from rayCounts[u_countIndex], so the passes can be dispatched indirectly.
+uniform uint u_countIndex;
+uniform uint u_shift;
+
+layout(local_size_x = WORKGROUP_SIZE) in;
+
+layout(std430, binding = 25) readonly  buffer KeysIn         { uint keysIn[];         };
+layout(std430, binding = 26) readonly  buffer ValuesIn       { uint valuesIn[];       };
+layout(std430, binding = 27) writeonly buffer KeysOut        { uint keysOut[];        };
+layout(std430, binding = 28) writeonly buffer ValuesOut      { uint valuesOut[];      };
+layout(std430, binding = 29)           buffer BlockHistogram { uint blockHistogram[]; };
+layout(std430, binding = 31) readonly  buffer RayCounts      { uint rayCounts[];      };
+
+shared uint s_scan[WORKGROUP_SIZE];
+shared uint s_counts[RADIX];
+
+uint exclusiveScan(uint value, out uint total) {
+    uint lid = gl_LocalInvocationID.x;
+    s_scan[lid] = value;
+    barrier();
+    for (uint offset = 1u; offset < WORKGROUP_SIZE; offset <<= 1) {
+        uint add = lid >= offset ? s_scan[lid - offset] : 0u;
+        barrier();
+        s_scan[lid] += add;
+        barrier();
+    }
+    uint inclusive = s_scan[lid];
+    total = s_scan[WORKGROUP_SIZE - 1u];
+    barrier();
+    return inclusive - value;
+}
+
+uint digitOf(uint key) {
+    return (key >> u_shift) & (RADIX - 1u);
+}
+
+#ifdef HISTOGRAM
+void main() {
+    uint u_count = rayCounts[u_countIndex];
+    uint u_blockCount = (u_count + BLOCK_SIZE - 1u) / BLOCK_SIZE;
+    uint lid = gl_LocalInvocationID.x;
+    if (lid < RADIX) {
+        s_counts[lid] = 0u;
+    }
+    barrier();
+
+    uint id = gl_GlobalInvocationID.x;
+    if (id < u_count) {
+        atomicAdd(s_counts[digitOf(keysIn[id])], 1u);
+    }
+    barrier();
+
+    if (lid < RADIX) {
+        blockHistogram[lid * u_blockCount + gl_WorkGroupID.x] = s_counts[lid];
+    }
+}
+#endif
+
+#ifdef SCAN
+void main() {
+    uint lid = gl_LocalInvocationID.x;
+    uint count = (rayCounts[u_countIndex] + BLOCK_SIZE - 1u) / BLOCK_SIZE * RADIX;
+
+    uint carry = 0u;
+    for (uint base = 0u; base < count; base += WORKGROUP_SIZE) {
+        uint id = base + lid;
+        uint value = id < count ? blockHistogram[id] : 0u;
+
+        uint total;
+        uint prefix = exclusiveScan(value, total);
+        if (id < count) {
+            blockHistogram[id] = carry + prefix;
+        }
+        carry += total;
+    }
+}
+#endif
+
+#ifdef SCATTER
+shared uint s_keys[WORKGROUP_SIZE];
+shared uint s_values[WORKGROUP_SIZE];
+
+void main() {
+    uint u_count = rayCounts[u_countIndex];
+    uint u_blockCount = (u_count + BLOCK_SIZE - 1u) / BLOCK_SIZE;
+    uint lid = gl_LocalInvocationID.x;
+    uint id = gl_GlobalInvocationID.x;
+    uint blockStart = gl_WorkGroupID.x * WORKGROUP_SIZE;
+    uint validCount = min(WORKGROUP_SIZE, u_count - blockStart);
+
+    if (lid < RADIX) {
+        s_counts[lid] = 0u;
+    }
+    barrier();
+
+    // Padding gets the largest digit; it starts behind every valid item and the
+    // stable splits keep it there.
+    uint key   = id < u_count ? keysIn[id] : 0xFFFFFFFFu;
+    uint value = id < u_count ? valuesIn[id] : 0u;
+    if (id < u_count) {
+        atomicAdd(s_counts[digitOf(key)], 1u);
+    }
+
+    for (uint bit = 0u; bit < RADIX_BITS; bit++) {
+        uint isOne = (digitOf(key) >> bit) & 1u;
+
+        uint zeros;
+        uint zerosBefore = exclusiveScan(1u - isOne, zeros);
+        uint position = isOne == 0u ? zerosBefore : zeros + lid - zerosBefore;
+
+        s_keys[position] = key;
+        s_values[position] = value;
+        barrier();
+        key = s_keys[lid];
+        value = s_values[lid];
+        barrier();
+    }
+
+    // Turn the block's digit counts into the first local index of every digit.
+    if (lid == 0u) {
+        uint sum = 0u;
+        for (uint digit = 0u; digit < RADIX; digit++) {
+            uint digitCount = s_counts[digit];
+            s_counts[digit] = sum;
+            sum += digitCount;
+        }
+    }
+    barrier();
+
+    if (lid < validCount) {
+        uint digit = digitOf(key);
+        uint position = blockHistogram[digit * u_blockCount + gl_WorkGroupID.x] + lid - s_counts[digit];
+        keysOut[position] = key;
+        valuesOut[position] = value;
+    }
+}
+#endif
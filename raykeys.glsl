@@ -0,0 +1,41 @@
+#version 430
+
+// Same key as RaySorter::computeKey: direction octant on top, then a Morton code
+// of the origin quantized to the scene bounds.
+#define MORTON_BITS_PER_AXIS 9u
+
+uniform uint u_countIndex;
+uniform vec3 u_sceneMin;
+uniform vec3 u_sceneScale;
+
+layout(local_size_x = 256) in;
+
+layout(std430, binding = 14) readonly  buffer RayBuffer { vec4 rayBuffer[]; };
+layout(std430, binding = 31) readonly  buffer RayCounts { uint rayCounts[]; };
+layout(std430, binding = 27) writeonly buffer KeysOut   { uint keysOut[];   };
+layout(std430, binding = 28) writeonly buffer ValuesOut { uint valuesOut[]; };
+
+uint expandBits(uint v) {
+    v = (v | (v << 16)) & 0x030000FFu;
+    v = (v | (v <<  8)) & 0x0300F00Fu;
+    v = (v | (v <<  4)) & 0x030C30C3u;
+    v = (v | (v <<  2)) & 0x09249249u;
+    return v;
+}
+
+void main() {
+    uint rayId = uint(gl_GlobalInvocationID.x);
+    if (rayId >= rayCounts[u_countIndex]) {
+        return;
+    }
+
+    vec3 origin = rayBuffer[rayId * 2 + 0].xyz;
+    vec3 dir    = rayBuffer[rayId * 2 + 1].xyz;
+
+    uvec3 cell = uvec3(clamp((origin - u_sceneMin) * u_sceneScale, vec3(0.0), vec3(float((1u << MORTON_BITS_PER_AXIS) - 1u))));
+    uint octant = (dir.x < 0.0 ? 1u : 0u) | (dir.y < 0.0 ? 2u : 0u) | (dir.z < 0.0 ? 4u : 0u);
+    uint morton = (expandBits(cell.x) << 2) | (expandBits(cell.y) << 1) | expandBits(cell.z);
+
+    keysOut[rayId]   = (octant << (3u * MORTON_BITS_PER_AXIS)) | morton;
+    valuesOut[rayId] = rayId;
+}
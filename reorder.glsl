@@ -0,0 +1,21 @@
+#version 430
+
+uniform uint u_countIndex;
+
+layout(local_size_x = 256) in;
+
+layout(std430, binding = 14) readonly  buffer RayBuffer { vec4 rayBuffer[]; };
+layout(std430, binding = 16) writeonly buffer NextRays  { vec4 nextRays[];  };
+layout(std430, binding = 26) readonly  buffer ValuesIn  { uint valuesIn[];  };
+layout(std430, binding = 31) readonly  buffer RayCounts { uint rayCounts[]; };
+
+void main() {
+    uint rayId = uint(gl_GlobalInvocationID.x);
+    if (rayId >= rayCounts[u_countIndex]) {
+        return;
+    }
+
+    uint source = valuesIn[rayId];
+    nextRays[rayId * 2 + 0] = rayBuffer[source * 2 + 0];
+    nextRays[rayId * 2 + 1] = rayBuffer[source * 2 + 1];
+}
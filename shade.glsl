@@ -2,31 +2,72 @@
 
 #define NULL uint(-1)
 #define M_PI 3.141592653
+#define MATERIAL_EMISSIVE 1u
 
 uniform uint u_iteration;
-uniform uint u_raysCount;
+// Frames since the accumulation was reset, so every frame draws different samples.
+uniform uint u_frame;
+// Reads the rays counted in rayCounts[u_countIndex] and appends to the next slot.
+uniform uint u_countIndex;
 uniform float u_timer;
+uniform ivec2 u_screenSize;
 
 layout(local_size_x = 64) in;
 
+// This frame's sample, folded into the running mean by accumulate.glsl.
 layout(rgba32f, binding = 0) uniform image2D outColor;
 
 layout(std430,  binding = 16) writeonly buffer NextRays                  { vec4 nextRays[];                  };
-layout(std430,  binding = 15)           buffer Counter                   { uint counter;                     };
+layout(std430,  binding = 31)           buffer RayCounts                 { uint rayCounts[];                 };
 layout(std430,  binding = 13) readonly  buffer IntersectionBuffer        { vec4 intersectionBuffer[];        };
 layout(std430,  binding = 14) readonly  buffer RayBuffer                 { vec4 rayBuffer[];                 };
-layout(std430,  binding = 1)  readonly  buffer TlasGetAABB               { vec4 tlasGetAABB[];               };
-layout(std430,  binding = 2)  readonly  buffer TlasGetGeometry           { vec4 tlasGetGeometry[];           };
-layout(std430,  binding = 3)  readonly  buffer TlasGetChild              { uint tlasGetChild[];              };
 layout(std430,  binding = 4)  readonly  buffer TlasGetPrimitiveId        { uint tlasGetPrimitiveId[];        };
-layout(std430,  binding = 5)  readonly  buffer TlasIsLeaf                { uint tlasIsLeaf[];                };
-layout(std430,  binding = 6)  readonly  buffer TlasGetBlasNodeOffset     { uint tlasGetBlasNodeOffset[];     };
 layout(std430,  binding = 7)  readonly  buffer TlasGetBlasGeometryOffset { uint tlasGetBlasGeometryOffset[]; };
-layout(std430,  binding = 8)  readonly  buffer BlasGetAABB               { vec4 blasGetAABB[];               };
-layout(std430,  binding = 9)  readonly  buffer BlasGetGeometry           { vec4 blasGetGeometry[];           };
-layout(std430,  binding = 10) readonly  buffer BlasGetChild              { uint blasGetChild[];              };
-layout(std430,  binding = 11) readonly  buffer BlasGetPrimitiveId        { uint blasGetPrimitiveId[];        };
-layout(std430,  binding = 12) readonly  buffer BlasIsLeaf                { uint blasIsLeaf[];                };
+layout(std430,  binding = 9)  readonly  buffer BlasGetTriangle           { vec4 blasGetTriangle[];           };
+layout(std430,  binding = 11) readonly  buffer BlasGetIndex              { uint blasGetIndex[];              };
+layout(std430,  binding = 20) readonly  buffer BlasGetNormal             { float blasGetNormal[];            };
+layout(std430,  binding = 21) readonly  buffer BlasGetMaterial           { uint blasGetMaterial[];           };
+layout(std430,  binding = 22) readonly  buffer TlasGetInstanceBlas       { uint tlasGetInstanceBlas[];       };
+layout(std430,  binding = 23) readonly  buffer TlasGetWorldToObject      { vec4 tlasGetWorldToObject[];      };
+layout(std430,  binding = 24) readonly  buffer TlasGetObjectToWorld      { vec4 tlasGetObjectToWorld[];      };
+
+#ifdef NEXT_EVENT_ESTIMATION
+// Every non-emissive hit also samples a light and appends a shadow ray for the connect stage,
+// counted in rayCounts[u_shadowCountIndex]. Lights are uvec4(instance, slot, cdf bits, 0),
+// picked in proportion to their world space area, which sums to u_lightArea.
+uniform uint u_shadowCountIndex;
+uniform uint u_lightCount;
+uniform float u_lightArea;
+
+layout(std430,  binding = 32) writeonly buffer ShadowRays                { vec4 shadowRays[];                };
+layout(std430,  binding = 33) readonly  buffer Lights                    { uvec4 lights[];                   };
+#endif
+
+#ifdef PATH_REGENERATION
+// Every pixel has one path in flight, and a path that ends is replaced in its ray slot by a new
+// camera ray, so the ray count never drops. Its state is vec4(throughput, radiance, depth, finished),
+// kept per pixel as the rays carry their pixel and may be sorted. A finished path waits in the state
+// until the next shade of the pixel, after connect has added the light of its last shadow ray, and
+// is then tallied in outColor as vec4(radiance sum, sum of squares, 0, paths) for accumulate.glsl.
+// The GGX lobe is sampled with a weight of about 1, so the throughput alone never drops: past
+// ROULETTE_DEPTH bounces a path survives with a fixed probability and is weighted by its inverse.
+#define ROULETTE_DEPTH    2u
+#define ROULETTE_SURVIVAL 0.75
+#define MAX_PATH_DEPTH    16u
+
+uniform mat4 u_viewInv;
+// Paths restarted this frame are counted in rayCounts[u_restartCountIndex].
+uniform uint u_restartCountIndex;
+
+layout(rgba32f, binding = 1) uniform image2D pathStates;
+#endif
+
+#ifdef RAY_STATS
+// Neighbouring rays that miss together or hit the same instance within the same block
+// of leaf slots; mirrors CpuRender::measureCoherence.
+#define COHERENCE_SLOT_SHIFT 6u
+layout(std430,  binding = 30)           buffer RayStats                  { uint coherentPairs;               };
+#endif
 
 struct Ray {
     vec3 origin;
@@ -34,8 +75,8 @@ struct Ray {
 };
 
 struct Intersection {
-    uint tlasNodeId;
-    uint blasNodeId;
+    uint tlasPrimitiveSlot;
+    uint blasPrimitiveSlot;
     vec2 barycentric;
 };
 
@@ -73,8 +114,22 @@ vec3 getPerpendicularVector(vec3 u) {
     return cross(u, vec3(xm, ym, zm));
 }
 
-vec3 getGGXMicrofacet(float roughness, vec3 hitNorm) {
-    float seed = rand(float(gl_GlobalInvocationID.x) / float(u_raysCount) + float(u_iteration));
+uint pcgHash(uint value) {
+    uint state = value * 747796405u + 2891336453u;
+    uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+// Seeded by the pixel rather than the ray slot, which changes with compaction and sorting,
+// so CpuRender draws the same samples. The integer hash keeps every pixel, frame and
+// iteration apart, where a float sum of them runs out of mantissa within a few frames.
+float getSeed(ivec2 pixelCoords) {
+    uint pixel = uint(pixelCoords.y * u_screenSize.x + pixelCoords.x);
+    return float(pcgHash(pixel + pcgHash(u_iteration + pcgHash(u_frame))) >> 8) / 16777216.0;
+}
+
+vec3 getGGXMicrofacet(float roughness, vec3 hitNorm, ivec2 pixelCoords) {
+    float seed = getSeed(pixelCoords);
 
     vec2 randVal = vec2(rand(seed + 0.1), rand(seed + 0.2));
 
@@ -91,9 +146,82 @@ vec3 getGGXMicrofacet(float roughness, vec3 hitNorm) {
        hitNorm * cosThetaH;
 }
 
+#ifdef NEXT_EVENT_ESTIMATION
+// Picks a point on a light with a pdf of 1 / u_lightArea and queues a shadow ray to it carrying
+// the light (of radiance 1) that the GGX lobe reflects towards the viewer if nothing is in between,
+// times the throughput of the path.
+void connectLight(vec3 origin, vec3 normal, vec3 viewDir, float roughness, ivec2 pixelCoords, float throughput) {
+    if (u_lightCount == 0) {
+        return;
+    }
+
+    float seed = getSeed(pixelCoords);
+    float u = rand(seed + 0.3);
+    uint first = 0;
+    uint last = u_lightCount - 1;
+    while (first < last) {
+        uint middle = (first + last) / 2;
+        if (uintBitsToFloat(lights[middle].z) < u) first = middle + 1;
+        else last = middle;
+    }
+    uvec4 light = lights[first];
+
+    vec2 randVal = vec2(rand(seed + 0.4), rand(seed + 0.5));
+    float sqrtX = sqrt(randVal.x);
+    vec2 barycentric = vec2(sqrtX * (1.0 - randVal.y), sqrtX * randVal.y);
+
+    vec3 p0 = blasGetTriangle[light.y * 3 + 0].xyz;
+    vec3 e1 = blasGetTriangle[light.y * 3 + 1].xyz;
+    vec3 e2 = blasGetTriangle[light.y * 3 + 2].xyz;
+    mat3x4 objectToWorld = mat3x4(tlasGetObjectToWorld[light.x * 3 + 0], tlasGetObjectToWorld[light.x * 3 + 1], tlasGetObjectToWorld[light.x * 3 + 2]);
+    vec3 lightPos = vec4(p0 + barycentric.x * e1 + barycentric.y * e2, 1.0) * objectToWorld;
+    vec3 lightNormal = normalize(cross(vec4(e1, 0.0) * objectToWorld, vec4(e2, 0.0) * objectToWorld));
+
+    vec3 toLight = lightPos - origin;
+    float dist2 = dot(toLight, toLight);
+    vec3 L = toLight * inversesqrt(dist2);
+    vec3 V = -normalize(viewDir);
+    float NdotL = dot(normal, L);
+    float NdotV = dot(normal, V);
+    float cosLight = abs(dot(lightNormal, L));
+    if (NdotL <= 0.0 || NdotV <= 0.0 || cosLight <= 0.0) {
+        return;
+    }
+
+    // BRDF times NdotL with F = 1, the same lobe the bounces sample with a weight of about 1.
+    float NdotH = max(dot(normal, normalize(L + V)), 0.0);
+    float brdfCos = ggxNormalDistribution(NdotH, roughness) * schlickMaskingTerm(NdotL, NdotV, roughness) / (4.0 * NdotV);
+    float radiance = brdfCos * cosLight * u_lightArea / dist2 * throughput;
+
+    uint offset = atomicAdd(rayCounts[u_shadowCountIndex], 1);
+    shadowRays[offset * 2 + 0] = vec4(origin, uintBitsToFloat(uint(pixelCoords.x) | (uint(pixelCoords.y) << 16)));
+    shadowRays[offset * 2 + 1] = vec4(toLight, radiance);
+}
+#endif
+
+#ifdef PATH_REGENERATION
+// The same camera rays as generate.glsl.
+void cameraRay(ivec2 pixelCoords, out vec4 origin, out vec4 dir) {
+    vec2 xy = vec2(2.0 * float(pixelCoords.x * 2.0 - u_screenSize.x) / float(u_screenSize.x), 2.0 * float(pixelCoords.y * 2.0 - u_screenSize.y) / float(u_screenSize.y));
+    xy.x *= float(u_screenSize.x) / float(u_screenSize.y);
+
+    origin = u_viewInv*vec4(0.0, 0.0, 0.0, 1.0);
+    dir    = u_viewInv*vec4(normalize(vec3(xy, -5.0)), 0.0);
+
+    origin.w = intBitsToFloat(pixelCoords.x);
+    dir.w    = intBitsToFloat(pixelCoords.y);
+}
+
+void tallyPath(ivec2 pixelCoords, float radiance) {
+    vec4 tally = imageLoad(outColor, pixelCoords);
+    imageStore(outColor, pixelCoords, vec4(tally.r + radiance, tally.g + radiance * radiance, 0.0, tally.a + 1.0));
+}
+#endif
+
 void main() {
     uint rayId = uint(gl_GlobalInvocationID.x);
-    if (rayId >= u_raysCount) {
+    uint raysCount = rayCounts[u_countIndex];
+    if (rayId >= raysCount) {
         return;
     }
 
@@ -105,57 +233,129 @@ void main() {
 
     vec4 isecData = intersectionBuffer[rayId];
     Intersection isec;
-    isec.tlasNodeId = floatBitsToUint(isecData.x);
-    isec.blasNodeId = floatBitsToUint(isecData.y);
+    isec.tlasPrimitiveSlot = floatBitsToUint(isecData.x);
+    isec.blasPrimitiveSlot = floatBitsToUint(isecData.y);
     isec.barycentric = isecData.zw;
 
+    ivec2 pixelCoords = floatBitsToInt(vec2(rayData1.w, rayData2.w));
+    uint depth = u_iteration;
+    float throughput = 1.0;
+#ifdef PATH_REGENERATION
+    vec4 path = imageLoad(pathStates, pixelCoords);
+    if (path.w != 0.0) {
+        tallyPath(pixelCoords, path.y);
+        path = vec4(1.0, 0.0, 0.0, 0.0);
+    }
+    throughput = path.x;
+    depth = uint(path.z);
+    bool bounced = false;
+#endif
+
+#ifdef RAY_STATS
+    if (rayId + 1 < raysCount) {
+        uvec2 next = floatBitsToUint(intersectionBuffer[rayId + 1].xy);
+        if (next.x == isec.tlasPrimitiveSlot && (next.y >> COHERENCE_SLOT_SHIFT) == (isec.blasPrimitiveSlot >> COHERENCE_SLOT_SHIFT)) {
+            atomicAdd(coherentPairs, 1u);
+        }
+    }
+#endif
+
     float light = 0.0;
-    if (isec.tlasNodeId != NULL && isec.blasNodeId != NULL) {
-        uint tlasIndex = tlasGetPrimitiveId[tlasGetChild[isec.tlasNodeId]];
-        uint blasNodeOffset = tlasGetBlasNodeOffset[tlasIndex];
-        uint blasGeometryOffset = tlasGetBlasGeometryOffset[tlasIndex];
-        uint blasIndex = blasGetPrimitiveId[blasGeometryOffset + blasGetChild[blasNodeOffset + isec.blasNodeId]];
+    if (isec.tlasPrimitiveSlot != NULL && isec.blasPrimitiveSlot != NULL) {
+        uint tlasIndex = tlasGetPrimitiveId[isec.tlasPrimitiveSlot];
+        uint blasGeometryOffset = tlasGetBlasGeometryOffset[tlasGetInstanceBlas[tlasIndex]];
+        uint slot = blasGeometryOffset + isec.blasPrimitiveSlot;
 
-        uint stride = 3;
+        vec3 p0 = blasGetTriangle[slot * 3 + 0].xyz;
+        vec3 e1 = blasGetTriangle[slot * 3 + 1].xyz;
+        vec3 e2 = blasGetTriangle[slot * 3 + 2].xyz;
 
-        vec3 p1 = blasGetGeometry[((blasGeometryOffset + blasIndex) * 3 + 0) * stride + 0].xyz;
-        vec3 p2 = blasGetGeometry[((blasGeometryOffset + blasIndex) * 3 + 1) * stride + 0].xyz;
-        vec3 p3 = blasGetGeometry[((blasGeometryOffset + blasIndex) * 3 + 2) * stride + 0].xyz;
+        uint i1 = blasGetIndex[slot * 3 + 0] * 3;
+        uint i2 = blasGetIndex[slot * 3 + 1] * 3;
+        uint i3 = blasGetIndex[slot * 3 + 2] * 3;
 
-        vec3 n1 = blasGetGeometry[((blasGeometryOffset + blasIndex) * 3 + 0) * stride + 1].xyz;
-        vec3 n2 = blasGetGeometry[((blasGeometryOffset + blasIndex) * 3 + 1) * stride + 1].xyz;
-        vec3 n3 = blasGetGeometry[((blasGeometryOffset + blasIndex) * 3 + 2) * stride + 1].xyz;
+        vec3 n1 = vec3(blasGetNormal[i1], blasGetNormal[i1 + 1], blasGetNormal[i1 + 2]);
+        vec3 n2 = vec3(blasGetNormal[i2], blasGetNormal[i2 + 1], blasGetNormal[i2 + 2]);
+        vec3 n3 = vec3(blasGetNormal[i3], blasGetNormal[i3 + 1], blasGetNormal[i3 + 2]);
 
-        bool emissive = blasGetGeometry[((blasGeometryOffset + blasIndex) * 3 + 0) * stride + 2].x > 0.0;
+        bool emissive = (blasGetMaterial[slot] & MATERIAL_EMISSIVE) != 0;
 
         vec3 normal = (1.0 - isec.barycentric.x - isec.barycentric.y) * n1 +
                                                   isec.barycentric.x  * n2 +
                                                   isec.barycentric.y  * n3;
-        normal = normalize(normal);
 
-        vec3 pos = (1.0 - isec.barycentric.x - isec.barycentric.y) * p1 +
-                                               isec.barycentric.x  * p2 +
-                                               isec.barycentric.y  * p3;
+        vec3 pos = p0 + isec.barycentric.x * e1 + isec.barycentric.y * e2;
+
+        // Positions go through the object to world matrix, normals through the transposed world to object one.
+        mat3x4 worldToObject = mat3x4(tlasGetWorldToObject[tlasIndex * 3 + 0], tlasGetWorldToObject[tlasIndex * 3 + 1], tlasGetWorldToObject[tlasIndex * 3 + 2]);
+        mat3x4 objectToWorld = mat3x4(tlasGetObjectToWorld[tlasIndex * 3 + 0], tlasGetObjectToWorld[tlasIndex * 3 + 1], tlasGetObjectToWorld[tlasIndex * 3 + 2]);
+        pos = vec4(pos, 1.0) * objectToWorld;
+        normal = normalize(vec3(worldToObject * normal));
 
         //light = (emissive ? 1.0 : 0.1) * length(pos - ray.origin) / 20;
 
         if (emissive) {
             light = 1.0;
         } else {
-            uint offset = atomicAdd(counter, 1);
+#ifdef PATH_REGENERATION
+            bounced = true;
+#else
+            uint offset = atomicAdd(rayCounts[u_countIndex + 1], 1);
+#endif
 
-            vec3 newRayDirection = reflect(rayData2.xyz, getGGXMicrofacet(0.1, normal));
+            vec3 newRayDirection = reflect(rayData2.xyz, getGGXMicrofacet(0.1, normal, pixelCoords));
 
             rayData1.xyz = pos + normal * 0.001;
+#ifdef NEXT_EVENT_ESTIMATION
+            connectLight(rayData1.xyz, normal, ray.dir, 0.1, pixelCoords, throughput);
+#endif
             //rayData2.xyz = reflect(rayData2.xyz, normal);
             rayData2.xyz = newRayDirection;
 
+#ifndef PATH_REGENERATION
             nextRays[offset * 2 + 0] = rayData1;
             nextRays[offset * 2 + 1] = rayData2;
+#endif
         }
     } else {
         //light = 1.0;
     }
 
-    imageStore(outColor, floatBitsToInt(vec2(rayData1.w, rayData2.w)), vec4(vec3(light), 1.0));
+#ifdef PATH_REGENERATION
+#ifdef NEXT_EVENT_ESTIMATION
+    // Direct light after the first hit comes from connect.
+    if (depth > 0) {
+        light = 0.0;
+    }
+#endif
+    path.y += throughput * light;
+
+    if (bounced && ++depth >= ROULETTE_DEPTH) {
+        bounced = depth < MAX_PATH_DEPTH && rand(getSeed(pixelCoords) + 0.6) < ROULETTE_SURVIVAL;
+        throughput /= ROULETTE_SURVIVAL;
+    }
+
+    if (bounced) {
+        imageStore(pathStates, pixelCoords, vec4(throughput, path.y, float(depth), 0.0));
+    } else {
+        imageStore(pathStates, pixelCoords, vec4(1.0, path.y, 0.0, 1.0));
+        cameraRay(pixelCoords, rayData1, rayData2);
+        atomicAdd(rayCounts[u_restartCountIndex], 1);
+    }
+
+    nextRays[rayId * 2 + 0] = rayData1;
+    nextRays[rayId * 2 + 1] = rayData2;
+    if (rayId == 0) {
+        rayCounts[u_countIndex + 1] = raysCount;
+    }
+#else
+#ifdef NEXT_EVENT_ESTIMATION
+    // Direct light after the first hit comes from connect, so bounces hitting a light add nothing
+    // and must not overwrite what connect added.
+    if (depth > 0) {
+        return;
+    }
+#endif
+    imageStore(outColor, pixelCoords, vec4(vec3(light), 1.0));
+#endif
 }